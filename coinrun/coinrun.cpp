@@ -11,6 +11,7 @@ Copyright (c) Meta Platforms, Inc. All Right reserved.
 
 #include <QtCore/QMutexLocker>
 #include <QtCore/QWaitCondition>
+#include <QtCore/QReadWriteLock>
 #include <QtWidgets/QApplication>
 #include <QtWidgets/QGridLayout>
 #include <QtWidgets/QCheckBox>
@@ -29,6 +30,10 @@ Copyright (c) Meta Platforms, Inc. All Right reserved.
 #include <stdint.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <cmath>
 #include <math.h>
 #include <random>
@@ -36,11 +41,29 @@ Copyright (c) Meta Platforms, Inc. All Right reserved.
 #include <sstream>
 #include <memory>
 #include <assert.h>
-#include <set>
 #include <map>
+#include <deque>
+#include <atomic>
+#include <tuple>
+#include <algorithm>
+#include <chrono>
+#if defined(COINRUN_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#ifdef COINRUN_GL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
 
 const int NUM_ACTIONS = 7;
-const int MAZE_OFFSET = 1;
 
 static
 int DISCRETE_ACTIONS[NUM_ACTIONS * 2] = {
@@ -53,19 +76,19 @@ int DISCRETE_ACTIONS[NUM_ACTIONS * 2] = {
     0, -1,  // down  (step down from a crate)
 };
 
-#define VIDEORES 1024
-#define VIDEORES_STR "1024"
-
-const std::map<std::string, int> AUDIO_LABEL_MAP = {
-    { "ladder_climbing", 0 },
-    { "jump", 1 },
-    { "walk", 2 },
-    { "bumped_head", 3 },
-    { "killed", 4 },
-    { "coin", 5 },
-    { "killed_monster", 6 },
-    { "gem", 7 },
-    { "power_up_mode", 8 },
+// What happens to the agent, reported as Events (see Agent::event()). The values are
+// also the columns of the audio segmentation map, where EVENT_POWER_UP_MODE, which is a
+// state and never an event, marks the frames the agent is powered up.
+enum EventKind {
+  EVENT_LADDER_CLIMBING = 0,
+  EVENT_JUMP = 1,
+  EVENT_WALK = 2,
+  EVENT_BUMPED_HEAD = 3,
+  EVENT_KILLED = 4,
+  EVENT_COIN = 5,
+  EVENT_KILLED_MONSTER = 6,
+  EVENT_GEM = 7,
+  EVENT_POWER_UP_MODE = 8,
 };
 
 const char SPACE = '.';
@@ -95,8 +118,10 @@ float AIR_CONTROL = 0.15;
 
 const int RES_W = 64;
 const int RES_H = 64;
+const double AGENT_FRAME_ZOOM = 5.0;
 
 const int AUDIO_MAP_SIZE = 9;
+static_assert(AUDIO_MAP_SIZE == EVENT_POWER_UP_MODE + 1, "one audio map column per EventKind");
 
 const int DEATH_ANIM_LENGTH = 30;
 const int FINISHED_LEVEL_ANIM_LENGTH = 20;
@@ -111,12 +136,36 @@ float JITTER_SQUAT_PENALTY = 0.0;
 
 bool USE_LEVEL_SET = false;
 int NUM_LEVELS = 0;
-int *LEVEL_SEEDS;
+int *LEVEL_SEEDS = 0;
 int LEVEL_TIMEOUT = 1000;
 
 bool RANDOM_TILE_COLORS = false;
 bool PAINT_VEL_INFO = false;
 bool USE_DATA_AUGMENTATION = false;
+bool USE_FAST_AGENT_RENDER = false;
+bool BATCHED_PHYSICS = false; // workers move the agents of their claimed envs together
+int VIDEORES = 1024;
+int VIDEO_THREADS = 0; // 0 paints hires frames inside the step
+bool VIDEO_GL = false;  // hires frames drawn with OpenGL when built with COINRUN_GL, see gl_video_frame_draw()
+bool PIN_THREADS = false; // stepping threads are pinned to cores, see worker_cpus_choose()
+int LOCAL_RANK = 0;       // of this process among those on the machine
+
+// Flags the stepping and agent painting code is compiled for, as template argument Cfg.
+// vec_create() records the flags in effect for its vector, and workers step it with the
+// step_claimed<>() compiled for them, so the usual configuration (no penalties, no
+// augmentation) runs without their branches.
+enum StepConfig {
+  CFG_PENALTIES = 1,  // one of BUMP_HEAD_PENALTY, JUMP_PENALTY, SQUAT_PENALTY, JITTER_SQUAT_PENALTY is set
+  CFG_VEL_INFO = 2,   // PAINT_VEL_INFO
+  CFG_AUGMENT = 4,    // USE_DATA_AUGMENTATION
+};
+
+static
+int step_config()
+{
+  bool penalties = BUMP_HEAD_PENALTY != 0 || JUMP_PENALTY != 0 || SQUAT_PENALTY != 0 || JITTER_SQUAT_PENALTY != 0;
+  return (penalties ? CFG_PENALTIES : 0) | (PAINT_VEL_INFO ? CFG_VEL_INFO : 0) | (USE_DATA_AUGMENTATION ? CFG_AUGMENT : 0);
+}
 
 static bool shutdown_flag = false;
 static std::string monitor_dir;
@@ -169,25 +218,53 @@ static std::vector<int> ground_theme_idxs;
 static std::vector<int> walking_theme_idxs;
 static std::vector<int> flying_theme_idxs;
 
-bool is_crat(char c) {
-  return c=='#' || c=='$' || c=='&' || c=='%';
+const uint8_t TILE_WALL   = 1 << 0;
+const uint8_t TILE_CRATE  = 1 << 1;
+const uint8_t TILE_LETHAL = 1 << 2;
+const uint8_t TILE_COIN   = 1 << 3;
+const uint8_t TILE_GEM    = 1 << 4;
+const uint8_t TILE_LADDER = 1 << 5;
+
+constexpr uint8_t tile_properties(int c)
+{
+  return
+    (c=='S' || c=='A' || c=='a' || c=='b' ? TILE_WALL : 0) |
+    (c=='#' || c=='$' || c=='&' || c=='%' ? TILE_CRATE : 0) |
+    (c==LAVA_SURFACE || c==LAVA_MIDDLE || c==SPIKE_OBJ ? TILE_LETHAL : 0) |
+    (c==COIN_OBJ1 ? TILE_COIN : 0) |
+    (c==COIN_OBJ2 ? TILE_GEM : 0) |
+    (c==LADDER ? TILE_LADDER : 0);
 }
 
-bool is_wall(char c, bool crate_counts=false)
+// tile char -> TILE_* bits, so every tile test below is one load
+#define TILE_PROPERTIES_4(c)   tile_properties(c), tile_properties(c+1), tile_properties(c+2), tile_properties(c+3)
+#define TILE_PROPERTIES_16(c)  TILE_PROPERTIES_4(c), TILE_PROPERTIES_4(c+4), TILE_PROPERTIES_4(c+8), TILE_PROPERTIES_4(c+12)
+#define TILE_PROPERTIES_64(c)  TILE_PROPERTIES_16(c), TILE_PROPERTIES_16(c+16), TILE_PROPERTIES_16(c+32), TILE_PROPERTIES_16(c+48)
+constexpr uint8_t TILE_PROPERTIES[256] = {
+  TILE_PROPERTIES_64(0), TILE_PROPERTIES_64(64), TILE_PROPERTIES_64(128), TILE_PROPERTIES_64(192)
+};
+#undef TILE_PROPERTIES_64
+#undef TILE_PROPERTIES_16
+#undef TILE_PROPERTIES_4
+
+inline bool is_crat(uint8_t c) {
+  return TILE_PROPERTIES[c] & TILE_CRATE;
+}
+inline bool is_wall(uint8_t c, bool crate_counts=false)
 {
-  bool wall = c=='S' || c=='A' || c=='a' || c=='b' || c=='a';
-  if (crate_counts)
-    wall |= is_crat(c);
-  return wall;
+  return TILE_PROPERTIES[c] & (crate_counts ? TILE_WALL|TILE_CRATE : TILE_WALL);
 }
-bool is_lethal(char c) {
-  return c == LAVA_SURFACE || c == LAVA_MIDDLE || c == SPIKE_OBJ;
+inline bool is_lethal(uint8_t c) {
+  return TILE_PROPERTIES[c] & TILE_LETHAL;
 }
-bool is_coin(char c) {
-  return c==COIN_OBJ1;
+inline bool is_coin(uint8_t c) {
+  return TILE_PROPERTIES[c] & TILE_COIN;
 }
-bool is_gem(char c) {
-  return c==COIN_OBJ2;
+inline bool is_gem(uint8_t c) {
+  return TILE_PROPERTIES[c] & TILE_GEM;
+}
+inline bool is_ladder(uint8_t c) {
+  return TILE_PROPERTIES[c] & TILE_LADDER;
 }
 
 class VectorOfStates;
@@ -221,7 +298,38 @@ public:
   }
 };
 
-static RandGen global_rand_gen;
+// Each env draws from its own streams, derived from the master seed and the env's index
+// by hashing, not from one shared generator: results then don't depend on the thread
+// count or scheduling, and no generator state bounces between cores.
+static uint32_t master_seed;
+static int process_rand_seed; // rand_seed of initialize_args(), differs between MPI workers
+
+inline uint64_t splitmix64(uint64_t z)
+{
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Seed of stream number `counter` of the env whose key is `key`.
+inline int rand_stream_seed(uint64_t key, uint64_t counter)
+{
+  return int(uint32_t(splitmix64(key ^ splitmix64(counter))));
+}
+
+// Counters of the streams besides the per-level ones, which are numbered from 0.
+const uint64_t RAND_STREAM_ENV = ~0ULL;
+const uint64_t RAND_STREAM_AUGMENT = ~1ULL;
+
+// Key of env env_n of the vec_n-th vector of the process with this rand_seed and local
+// rank. The training set seed alone is the same for all MPI workers, which must not play
+// the same levels with the same draws, so the process seed and rank go in as well.
+inline uint64_t env_rand_key(int rand_seed, int rank, uint64_t vec_n, uint64_t env_n)
+{
+  uint64_t process = splitmix64((uint64_t(uint32_t(rand_seed)) << 32) | uint32_t(rank));
+  return splitmix64(splitmix64(master_seed) ^ process ^ (vec_n << 40) ^ env_n);
+}
 
 double get_time() {
   struct timespec time;
@@ -240,7 +348,75 @@ std::string stdprintf(const char *fmt, ...)
   return buf;
 }
 
+// -- stats --
+//
+// Built with COINRUN_STATS (make COINRUN_STATS=1), the stages of the hot path count their
+// calls and time spent, per thread, without locks. get_stats() sums the threads up.
+// Without it STATS_SCOPE compiles to nothing.
+
+enum StatsStage {
+  STAT_QUEUE_WAIT,   // an env waiting in its todo ring until a worker claims it
+  STAT_CLAIM,        // workers taking envs off the todo rings, stealing included
+  STAT_IDLE,         // workers asleep for lack of work
+  STAT_MONSTERS,     // monsters_step_and_collide()
+  STAT_AGENT,        // agent physics, Agent::step() or agents_step()
+  STAT_RESET,        // state_reset() at game over
+  STAT_PAINT_AGENT,  // paint_agent_render_buf()
+  STAT_PAINT_VIDEO,  // paint_video_data(), hires frame or its snapshot for a render thread
+  STAT_AUDIO,        // paint_audio_seg_map_buf()
+  STAT_OUTPUTS,      // write_step_outputs(), copy_render_buf() and friends
+  STAT_WAIT,         // vec_wait() blocked on steps
+  STATS_N
+};
+
+static const char* STATS_NAMES[STATS_N] = {
+  "queue_wait", "claim", "idle", "monsters", "agent", "reset",
+  "paint_agent", "paint_video", "audio", "outputs", "wait",
+};
+
+#ifdef COINRUN_STATS
+inline uint64_t stats_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// One cache line pair per thread. Threads past the last slot share it, hence the atomics.
+struct alignas(64) StatsSlot {
+  std::atomic<uint64_t> count[STATS_N];
+  std::atomic<uint64_t> ticks[STATS_N];
+};
+
+const int STATS_SLOTS = 256;
+static StatsSlot stats_slots[STATS_SLOTS];
+static std::atomic<int> stats_slots_used{0};
+static thread_local StatsSlot* stats_slot = 0;
+
+inline void stats_add(int stage, uint64_t ticks)
+{
+  if (!stats_slot)
+    stats_slot = &stats_slots[std::min(STATS_SLOTS - 1, stats_slots_used.fetch_add(1))];
+  stats_slot->count[stage].fetch_add(1, std::memory_order_relaxed);
+  stats_slot->ticks[stage].fetch_add(ticks, std::memory_order_relaxed);
+}
+
+struct StatsTimer {
+  int stage;
+  uint64_t t0;
+  StatsTimer(int stage): stage(stage), t0(stats_ticks())  { }
+  ~StatsTimer()  { stats_add(stage, stats_ticks() - t0); }
+};
+
+#define STATS_SCOPE(stage) StatsTimer stats_timer_##stage(stage)
+#else
+#define STATS_SCOPE(stage) ((void)0)
+#endif
+
 inline double sqr(double x)  { return x*x; }
+inline int iround(double v) { return int(floor(v + 0.5)); }
 inline double sign(double x)  { return x > 0 ? +1 : (x==0 ? 0 : -1); }
 inline int min(int a, int b) { return a < b ? a : b; }
 inline int max(int a, int b) { return a > b ? a : b; }
@@ -250,25 +426,64 @@ class Maze;
 
 const int MONSTER_TRAIL = 14;
 
-class Monster {
+// All monsters of a level, one array per field, so that the physics and the collision
+// pass walk contiguous memory. The enemy theme properties the step needs are copied in
+// by add(). Trails share one ring: row trail_head of trail_x/trail_y (n floats each) is
+// the newest position of every monster.
+class Monsters {
 public:
-  float x, y;
-  float prev_x[MONSTER_TRAIL], prev_y[MONSTER_TRAIL];
-  float vx = 0.01, vy = 0;
-  bool is_flying;
-  bool is_walking;
-  bool is_dead = false;
-  int monster_dying_frame_cnt = 0;
-  int theme_n = -1;
-  int pause = 0;
-  void step(const std::shared_ptr<Maze>& maze);
+  int n = 0;
+  std::vector<float> x, y, vx, vy;
+  std::vector<int> theme_n;
+  std::vector<int> pause;
+  std::vector<int> monster_dying_frame_cnt;
+  std::vector<uint8_t> is_flying, is_walking, is_dead;
+
+  std::vector<float> max_speed;
+  std::vector<float> max_jump_height;
+  std::vector<int> max_pause_time;
+  std::vector<uint8_t> is_jumping, can_be_killed;
+
+  int trail_head = 0;
+  std::vector<float> trail_x, trail_y;
+
+  int size() const  { return n; }
+
+  void clear()
+  {
+    n = 0;
+    x.clear(); y.clear(); vx.clear(); vy.clear();
+    theme_n.clear(); pause.clear(); monster_dying_frame_cnt.clear();
+    is_flying.clear(); is_walking.clear(); is_dead.clear();
+    max_speed.clear(); max_jump_height.clear(); max_pause_time.clear();
+    is_jumping.clear(); can_be_killed.clear();
+    trail_x.clear(); trail_y.clear();
+  }
+
+  void add(float mx, float my, bool flying, bool walking, int theme);
+  void trails_reset(); // after the last add()
+
+  // t=0 is the oldest trail point, t=MONSTER_TRAIL-1 the current position
+  float prev_x(int i, int t) const  { return trail_x[((trail_head + 1 + t) % MONSTER_TRAIL)*n + i]; }
+  float prev_y(int i, int t) const  { return trail_y[((trail_head + 1 + t) % MONSTER_TRAIL)*n + i]; }
+
+  void step(int i, Maze* maze, RandGen& rand_gen);
+  void push_trails();
 };
 
+// One byte per tile, with a MAZE_PAD tile wide border of WALL_MIDDLE all around, so
+// neighbour reads just outside the level need no bounds checks.
+const int MAZE_PAD = 1;
+
+static std::atomic<uint64_t> maze_layout_seq(1);
+
 class Maze {
 public:
   int spawnpos[2];
   int w, h;
-  int* walls;
+  int stride;      // w + 2*MAZE_PAD
+  uint8_t* grid;   // the whole padded grid, grid_size() bytes
+  uint8_t* walls;  // tile (0,0) inside grid
   int coins;
   bool is_terminated;
   bool is_new_level = true;
@@ -282,30 +497,59 @@ public:
   float max_speed;
   float mix_rate;
 
-  std::vector<std::shared_ptr<Monster>> monsters;
+  Monsters monsters;
+
+  // Tiles changed by play since the level was generated, oldest first. With the grid
+  // as generated (level_grid, made on the first snapshot_save()) they give the current
+  // grid, which is how snapshots share one copy of a level.
+  struct TileEdit { int offset; uint8_t before, after; };
+  std::vector<TileEdit> edits;
+  std::shared_ptr<const std::vector<uint8_t>> level_grid;
+
+  // New whenever the grid is rewritten other than by edit_elem(), i.e. for every level
+  // generated or loaded, so painted copies of the level know when to start over.
+  uint64_t layout_n;
 
   Maze(const int _w, const int _h)
   {
     w = _w;
     h = _h;
-    walls = new int[w*h];
+    stride = w + 2*MAZE_PAD;
+    grid = new uint8_t[grid_size()];
+    memset(grid, WALL_MIDDLE, grid_size());
+    walls = grid + MAZE_PAD*stride + MAZE_PAD;
     is_terminated = false;
     coins = 0;
+    layout_n = maze_layout_seq++;
   }
 
   ~Maze()
   {
-    delete[] walls;
+    delete[] grid;
   }
 
-  int& get_elem(int x, int y)
+  Maze(const Maze&) = delete;
+  Maze& operator=(const Maze&) = delete;
+
+  int grid_size() const  { return stride * (h + 2*MAZE_PAD); }
+
+  uint8_t& get_elem(int x, int y)
   {
-    return walls[w*y + x];
+    return walls[stride*y + x];
   }
 
   int set_elem(int x, int y, int val)
   {
-    return walls[w*y + x] = val;
+    return walls[stride*y + x] = uint8_t(val);
+  }
+
+  // set_elem() for changes made after generation
+  void edit_elem(int x, int y, int val)
+  {
+    int offset = int(&walls[stride*y + x] - grid);
+    TileEdit e = { offset, grid[offset], uint8_t(val) };
+    edits.push_back(e);
+    grid[offset] = e.after;
   }
 
   void fill_elem(int x, int y, int dx, int dy, char elem)
@@ -359,26 +603,22 @@ public:
   std::shared_ptr<Maze> maze;
   RandGen rand_gen;
 
-  int dif;
-  int maze_dim;
-  int danger_type;
-
-  std::set<int> cell_sets[2000];
-  int free_cells[2000];
-  int num_free_cells;
-
-  std::set<int> lookup(std::set<int> *cell_sets, int x, int y) {
-      return cell_sets[maze_dim*y + x];
-  }
+  // scratch for jump_and_build_platform_somewhere(), kept here so that
+  // a generator reused across resets stops allocating after the first few levels
+  std::vector<Rec> future_ladder;
+  std::vector<Rec> crates;
+  std::vector<Rec> monster_candidates;
 
-  bool is_maze_wall(int x, int y) {
-      return is_wall(maze->get_elem(x + MAZE_OFFSET, y + MAZE_OFFSET));
+  void begin(int level_seed, const std::shared_ptr<Maze>& m)
+  {
+    rand_gen.seed(level_seed);
+    maze = m;
+    rec_stack.clear();
   }
 
-  void set_free_cell(int x, int y) {
-      maze->set_elem(x + MAZE_OFFSET, y + MAZE_OFFSET, SPACE);
-      free_cells[num_free_cells] = maze_dim*y + x;
-      num_free_cells += 1;
+  void end()
+  {
+    maze.reset(); // don't keep the maze alive, so reusable_maze() can recycle it
   }
 
   void fill_block_top(int x, int y, int dx, int dy, char fill, char top)
@@ -471,7 +711,7 @@ public:
       if (is_crat(maze->get_elem(ix, iy)) || is_crat(maze->get_elem(ix, iy-1)))
         return false; // don't build ladders starting from crates
       rec_stack.erase(rec_stack.begin()+n);
-      std::vector<Rec> future_ladder;
+      future_ladder.clear();
       int ladder_len = 5 + randn(10);
       for (int s=0; s<ladder_len; s++) {
         future_ladder.push_back(Rec({ ix, iy }));
@@ -493,8 +733,8 @@ public:
         return false;
     if (c==SPACE || c==' ')
       maze->set_elem(ix, iy, vx>0 ? 'a':'b');
-    std::vector<Rec> crates;
-    std::vector<Rec> monster_candidates;
+    crates.clear();
+    monster_candidates.clear();
     int len = 2 + randn(10);
     int crates_shift = randn(20);
     for (int platform=0; platform<len; platform++) {
@@ -583,11 +823,12 @@ public:
 
   void remove_traces_add_monsters()
   {
-    maze->monsters.clear();
+    Monsters& monsters = maze->monsters;
+    monsters.clear();
     for (int y=1; y<maze->h; ++y) {
       for (int x=1; x<maze->w-1; x++) {
-        int& c = maze->get_elem(x, y);
-        int& b = maze->get_elem(x, y-1);
+        uint8_t& c = maze->get_elem(x, y);
+        uint8_t& b = maze->get_elem(x, y-1);
         int cl = maze->get_elem(x-1, y);
         int cr = maze->get_elem(x+1, y);
 
@@ -601,38 +842,32 @@ public:
         if (is_wall(c) && is_wall(b))
           b = 'A';
         if (c==FLYING_MONSTER || c==WALKING_MONSTER || c==GROUND_MONSTER) {
-          std::shared_ptr<Monster> m(new Monster);
-          m->x = x;
-          m->y = y;
-          for (int t=0; t<MONSTER_TRAIL; t++) {
-            m->prev_x[t] = x;
-            m->prev_y[t] = y;
-          }
-          m->is_flying = c==FLYING_MONSTER;
-          m->is_walking = c==WALKING_MONSTER;
+          bool is_flying = c==FLYING_MONSTER;
+          bool is_walking = c==WALKING_MONSTER;
 
           std::vector<int> *type_theme_idxs;
 
-          if (m->is_flying) {
+          if (is_flying) {
             type_theme_idxs = &flying_theme_idxs;
-          } else if (m->is_walking) {
+          } else if (is_walking) {
             type_theme_idxs = &walking_theme_idxs;
           } else {
             type_theme_idxs = &ground_theme_idxs;
           }
 
           int chosen_idx = randn(type_theme_idxs->size());
-          m->theme_n = (*type_theme_idxs)[chosen_idx];
+          int theme_n = (*type_theme_idxs)[chosen_idx];
 
           c = SPACE;
 
-          if ((!m->is_walking || (!is_wall(cl) && !is_wall(cr))) && !(!m->is_flying && !is_wall(b))) 
+          if ((!is_walking || (!is_wall(cl) && !is_wall(cr))) && !(!is_flying && !is_wall(b)))
           // walking monster should have some free space to move
           // walking monster and ground monster should be on a platform
-            maze->monsters.push_back(m);
+            monsters.add(x, y, is_flying, is_walking, theme_n); // arrays keep their capacity across levels
         }
       }
     }
+    monsters.trails_reset();
   }
 
   void generate_test_level()
@@ -672,6 +907,19 @@ public:
 
 static QString resource_path;
 
+enum PlayerPose {
+  POSE_STAND,
+  POSE_FRONT,
+  POSE_WALK1,
+  POSE_WALK2,
+  POSE_CLIMB1,
+  POSE_CLIMB2,
+  POSE_JUMP,
+  POSE_DUCK,
+  POSE_HIT,
+  POSE_COUNT
+};
+
 struct PlayerTheme {
   QString theme_name;
   QImage stand;
@@ -683,6 +931,21 @@ struct PlayerTheme {
   QImage jump;
   QImage duck;
   QImage hit;
+
+  const QImage& pose(int p) const
+  {
+    switch (p) {
+    case POSE_FRONT: return front;
+    case POSE_WALK1: return walk1;
+    case POSE_WALK2: return walk2;
+    case POSE_CLIMB1: return climb1;
+    case POSE_CLIMB2: return climb2;
+    case POSE_JUMP: return jump;
+    case POSE_DUCK: return duck;
+    case POSE_HIT: return hit;
+    default: return stand;
+    }
+  }
 };
 
 struct GroundTheme {
@@ -731,75 +994,220 @@ QImage downsample(QImage img)
   return img.scaled(w / DOWNSAMPLE, h / DOWNSAMPLE, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
 }
 
-static
-void ground_theme_downsample(GroundTheme *g, GroundTheme *d)
+QImage load_resource(QString relpath)
 {
-  for (const std::pair<char, QImage> &pair : g->walls) {
-    d->walls[pair.first] = downsample(pair.second);
+  auto path = resource_path + "/" + relpath;
+  auto img = QImage(path);
+  if (img.width() == 0) {
+    fprintf(stderr, "failed to load image %s\n", path.toUtf8().constData());
+    exit(EXIT_FAILURE);
   }
-  d->default_wall = downsample(g->default_wall);
+  return img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
 }
 
-static
-void player_theme_downsample(PlayerTheme *theme, PlayerTheme *theme_down)
-{
-  theme_down->stand = downsample(theme->stand);
-  theme_down->front = downsample(theme->front);
-  theme_down->walk1 = downsample(theme->walk1);
-  theme_down->walk2 = downsample(theme->walk2);
-  theme_down->climb1 = downsample(theme->climb1);
-  theme_down->climb2 = downsample(theme->climb2);
-  theme_down->jump = downsample(theme->jump);
-  theme_down->duck = downsample(theme->duck);
-  theme_down->hit = downsample(theme->hit);
-}
+// -- asset atlas --
+//
+// Decoding, mirroring and downsampling every asset takes seconds, and every process
+// ends up with a private copy of the same pixels. With an atlas path set (see
+// initialize_set_asset_atlas()) the results are baked once into one file, which later
+// processes map read-only: their images point straight into the mapping, so startup
+// is a few stats and the pages are shared by all processes of the machine. The atlas
+// lists the size and mtime of the files it was baked from, and is baked again when
+// one changed or an image is missing from it.
+//
+// Layout, native byte order: AtlasHeader, AtlasSource[sources], AtlasImage[images],
+// then the premultiplied ARGB32 pixels of each image at its 64 byte aligned offset.
+
+const uint32_t ATLAS_VERSION = 1;
+const int ATLAS_KEY_LEN = 128;
+
+struct AtlasHeader {
+  char magic[8];        // "CRATLAS\0"
+  uint32_t version;     // ATLAS_VERSION
+  uint32_t downsample;  // DOWNSAMPLE
+  uint32_t sources;
+  uint32_t images;
+  uint64_t size;        // of the whole file
+};
+
+struct AtlasSource {
+  char path[ATLAS_KEY_LEN]; // relative to resource_path
+  int64_t size;
+  int64_t mtime;
+};
+
+struct AtlasImage {
+  char key[ATLAS_KEY_LEN];  // see asset()
+  int32_t w, h;
+  uint64_t offset;
+};
+
+static std::string asset_atlas_path;  // empty: always decode
+static const uint8_t* atlas_data = 0; // the mapping, kept for the life of the process
+static size_t atlas_size = 0;
+static std::map<std::string, const AtlasImage*> atlas_index;
+static std::map<std::string, QImage> assets;     // every image asset() returned, by key
+static std::vector<std::string> asset_sources;   // files asset() decoded or verified
+static bool atlas_stale = false;                 // some asset was not in the atlas
 
 static
-void enemy_theme_downsample(EnemyTheme* theme, EnemyTheme* theme_down)
+bool atlas_source_stat(const std::string& relpath, int64_t* size, int64_t* mtime)
 {
-  theme_down->walk1 = downsample(theme->walk1);
-  theme_down->walk2 = downsample(theme->walk2);
+  struct stat st;
+  std::string path = resource_path.toUtf8().constData() + std::string("/") + relpath;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+  return true;
 }
 
+// Maps the atlas if there is one and it was baked from the files now on disk.
 static
-PlayerTheme* choose_player_theme(int theme_n, bool is_facing_right, bool lowres)
+void atlas_open()
 {
-  std::vector<PlayerTheme>* active_theme;
+  int fd = open(asset_atlas_path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  void* p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(AtlasHeader))
+    p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return;
 
-  if (lowres) {
-    active_theme = is_facing_right ? &player_themesr_down : &player_themesl_down;
-  } else {
-    active_theme = is_facing_right ? &player_themesr : &player_themesl;
+  const uint8_t* data = (const uint8_t*)p;
+  size_t size = st.st_size;
+  const AtlasHeader* h = (const AtlasHeader*)data;
+  const AtlasSource* sources = (const AtlasSource*)(h + 1);
+  const AtlasImage* images = (const AtlasImage*)(sources + h->sources);
+  bool ok = memcmp(h->magic, "CRATLAS", 8) == 0 && h->version == ATLAS_VERSION &&
+    h->downsample == uint32_t(DOWNSAMPLE) && h->size == size &&
+    sizeof(AtlasHeader) + h->sources * sizeof(AtlasSource) + h->images * sizeof(AtlasImage) <= size;
+  for (uint32_t i = 0; ok && i < h->sources; i++) {
+    int64_t file_size, mtime;
+    ok = sources[i].path[ATLAS_KEY_LEN - 1] == 0 &&
+      atlas_source_stat(sources[i].path, &file_size, &mtime) &&
+      file_size == sources[i].size && mtime == sources[i].mtime;
+  }
+  for (uint32_t i = 0; ok && i < h->images; i++)
+    ok = images[i].key[ATLAS_KEY_LEN - 1] == 0 && images[i].w > 0 && images[i].h > 0 &&
+      images[i].offset % 4 == 0 && // the QImages wrapping the pixels read them as uint32
+      images[i].offset + uint64_t(images[i].w) * images[i].h * 4 <= size;
+  if (!ok) {
+    munmap(p, size);
+    return;
   }
-  
-  return &(*active_theme)[theme_n];
-}
 
-static
-GroundTheme* choose_ground_theme(int theme_n, bool lowres)
-{
-  return lowres ? &ground_themes_down[theme_n] : &ground_themes[theme_n];
+  atlas_data = data;
+  atlas_size = size;
+  for (uint32_t i = 0; i < h->sources; i++)
+    asset_sources.push_back(sources[i].path);
+  for (uint32_t i = 0; i < h->images; i++)
+    atlas_index[images[i].key] = &images[i];
 }
 
+// The image at relpath under resource_path, in premultiplied ARGB32, optionally
+// mirrored left to right and then downsampled. Comes from the atlas when it has it.
 static
-EnemyTheme* choose_enemy_theme(const std::shared_ptr<Monster>& m, int monster_n, bool lowres)
+QImage asset(const QString& relpath, bool mirror = false, bool down = false)
 {
-  if (lowres) {
-    return m->vx>0 ? &enemy_themer_down[m->theme_n] : &enemy_themel_down[m->theme_n];
+  std::string rel = relpath.toUtf8().constData();
+  std::string key = rel + (mirror ? "|mirrored" : "") + (down ? "|downsampled" : "");
+  std::map<std::string, QImage>::iterator it = assets.find(key);
+  if (it != assets.end())
+    return it->second;
+
+  QImage img;
+  std::map<std::string, const AtlasImage*>::iterator a = atlas_index.find(key);
+  if (a != atlas_index.end()) {
+    const AtlasImage* e = a->second;
+    img = QImage(atlas_data + e->offset, e->w, e->h, e->w * 4, QImage::Format_ARGB32_Premultiplied);
   } else {
-    return m->vx>0 ? &enemy_themer[m->theme_n] : &enemy_themel[m->theme_n];
+    atlas_stale = true;
+    if (down) {
+      img = downsample(asset(relpath, mirror, false)).convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    } else if (mirror) {
+      img = asset(relpath).mirrored(true, false);
+    } else {
+      img = load_resource(relpath);
+      if (std::find(asset_sources.begin(), asset_sources.end(), rel) == asset_sources.end())
+        asset_sources.push_back(rel);
+    }
   }
+  assets[key] = img;
+  return img;
 }
 
-QImage load_resource(QString relpath)
+// Writes every asset loaded so far to the atlas path. Goes through a file of its own
+// and a rename, so processes baking at the same time don't see each other's halves.
+static
+void atlas_bake()
 {
-  auto path = resource_path + "/" + relpath;
-  auto img = QImage(path);
-  if (img.width() == 0) {
-    fprintf(stderr, "failed to load image %s\n", path.toUtf8().constData());
-    exit(EXIT_FAILURE);
+  std::vector<AtlasSource> sources;
+  for (const std::string& rel: asset_sources) {
+    AtlasSource s;
+    memset(&s, 0, sizeof(s));
+    if (rel.size() >= sizeof(s.path) || !atlas_source_stat(rel, &s.size, &s.mtime)) {
+      fprintf(stderr, "coinrun: cannot bake asset atlas, bad source %s\n", rel.c_str());
+      return;
+    }
+    memcpy(s.path, rel.c_str(), rel.size());
+    sources.push_back(s);
+  }
+
+  std::vector<AtlasImage> images;
+  uint64_t offset = sizeof(AtlasHeader) + sources.size() * sizeof(AtlasSource) + assets.size() * sizeof(AtlasImage);
+  for (const std::pair<const std::string, QImage>& pair: assets) {
+    AtlasImage e;
+    memset(&e, 0, sizeof(e));
+    if (pair.first.size() >= sizeof(e.key)) {
+      fprintf(stderr, "coinrun: cannot bake asset atlas, key too long %s\n", pair.first.c_str());
+      return;
+    }
+    memcpy(e.key, pair.first.c_str(), pair.first.size());
+    e.w = pair.second.width();
+    e.h = pair.second.height();
+    offset = (offset + 63) & ~uint64_t(63);
+    e.offset = offset;
+    offset += uint64_t(e.w) * e.h * 4;
+    images.push_back(e);
+  }
+
+  AtlasHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "CRATLAS", 8);
+  h.version = ATLAS_VERSION;
+  h.downsample = DOWNSAMPLE;
+  h.sources = sources.size();
+  h.images = images.size();
+  h.size = offset;
+
+  std::string tmp = asset_atlas_path + stdprintf(".%i.tmp", int(getpid()));
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "coinrun: cannot write asset atlas %s: %s\n", tmp.c_str(), strerror(errno));
+    return;
+  }
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  ok = ok && (sources.empty() || fwrite(sources.data(), sizeof(AtlasSource), sources.size(), f) == sources.size());
+  ok = ok && fwrite(images.data(), sizeof(AtlasImage), images.size(), f) == images.size();
+  size_t i = 0;
+  for (const std::pair<const std::string, QImage>& pair: assets) {
+    const AtlasImage& e = images[i++];
+    static const char zeros[64] = {0};
+    ok = ok && fseek(f, 0, SEEK_END) == 0;
+    long at = ftell(f);
+    ok = ok && (uint64_t(at) == e.offset || fwrite(zeros, 1, e.offset - at, f) == e.offset - at);
+    for (int y = 0; ok && y < e.h; y++)
+      ok = fwrite(pair.second.constScanLine(y), 4, e.w, f) == size_t(e.w);
+  }
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), asset_atlas_path.c_str()) != 0) {
+    fprintf(stderr, "coinrun: cannot write asset atlas %s\n", asset_atlas_path.c_str());
+    remove(tmp.c_str());
   }
-  return img;
 }
 
 void load_enemy_themes(const char **ethemes, std::vector<int> &type_theme_idxs, bool is_flying_type, bool is_walking_type) {
@@ -836,21 +1244,27 @@ void load_enemy_themes(const char **ethemes, std::vector<int> &type_theme_idxs,
       e1.max_jump_height = 0.2;
     }
     e1.can_be_killed = (strcmp(*theme, "slimeBlock") == 0 || strcmp(*theme, "snail") == 0 || strcmp(*theme, "wormPink") == 0);
-    e1.walk1 = load_resource(dir + e1.enemy_name + ".png");
-    e1.walk2 = load_resource(dir + e1.enemy_name + "_move.png");
-    e1.dead = load_resource(dir + e1.enemy_name + "_dead.png");
+    QString walk1 = dir + e1.enemy_name + ".png";
+    QString walk2 = dir + e1.enemy_name + "_move.png";
+    QString dead = dir + e1.enemy_name + "_dead.png";
+    e1.walk1 = asset(walk1);
+    e1.walk2 = asset(walk2);
+    e1.dead = asset(dead);
     enemy_themel.push_back(e1);
-    EnemyTheme e1d = e1;
 
     EnemyTheme e2 = e1;
-    e2.walk1 = e2.walk1.mirrored(true, false);
-    e2.walk2 = e2.walk2.mirrored(true, false);
-    e2.dead = e2.dead.mirrored(true, false);
-    EnemyTheme e2d = e2;
+    e2.walk1 = asset(walk1, true);
+    e2.walk2 = asset(walk2, true);
+    e2.dead = asset(dead, true);
     enemy_themer.push_back(e2);
 
-    enemy_theme_downsample(&e1, &e1d);
-    enemy_theme_downsample(&e2, &e2d);
+    // the dead sprite is never downsampled
+    EnemyTheme e1d = e1;
+    e1d.walk1 = asset(walk1, false, true);
+    e1d.walk2 = asset(walk2, false, true);
+    EnemyTheme e2d = e2;
+    e2d.walk1 = asset(walk1, true, true);
+    e2d.walk2 = asset(walk2, true, true);
     enemy_themel_down.push_back(e1d);
     enemy_themer_down.push_back(e2d);
   }
@@ -895,9 +1309,12 @@ static const char *walking_monsters[] = {
 
 void images_load()
 {
+  if (!asset_atlas_path.empty())
+    atlas_open();
+
   for (const char **theme=bgthemes; *theme; ++theme) {
     QString path = QString::fromUtf8(*theme);
-    bg_images.push_back(load_resource(path));
+    bg_images.push_back(asset(path));
     bg_images_fn.push_back(path);
   }
 
@@ -906,1110 +1323,4588 @@ void images_load()
     GroundTheme td;
     t.theme_name = QString::fromUtf8(*theme);
     QString walls = "kenney/Ground/" + t.theme_name + "/" + t.theme_name.toLower();
-    t.default_wall = load_resource(walls + "Center.png"); 
-    t.walls['a'] = load_resource(walls + "Cliff_left.png");
-    t.walls['b'] = load_resource(walls + "Cliff_right.png");
-    t.walls[WALL_SURFACE] = load_resource(walls + "Mid.png");
-    t.walls['^'] = load_resource(walls + "Half_mid.png");
     QString items = "kenneyLarge/Items/";
-    t.walls[' '] = load_resource(items + "star.png");
-    t.walls[COIN_OBJ1] = load_resource(items + "coinGold.png");
-    t.walls[COIN_OBJ2] = load_resource(items + "gemRed.png");
     QString tiles = "kenney/Tiles/";
-    t.walls['#'] = load_resource(tiles + "boxCrate.png");
-    t.walls['$'] = load_resource(tiles + "boxCrate_double.png");
-    t.walls['&'] = load_resource(tiles + "boxCrate_single.png");
-    t.walls['%'] = load_resource(tiles + "boxCrate_warning.png");
-    t.walls[LAVA_MIDDLE] = load_resource(tiles + "lava.png");
-    t.walls[LAVA_SURFACE] = load_resource(tiles + "lavaTop_low.png");
-    t.walls[SPIKE_OBJ] = load_resource(tiles + "spikes.png");
-    t.walls[LADDER] = load_resource(tiles + "ladderMid.png");
+    std::map<char, QString> wall_paths;
+    wall_paths['a'] = walls + "Cliff_left.png";
+    wall_paths['b'] = walls + "Cliff_right.png";
+    wall_paths[WALL_SURFACE] = walls + "Mid.png";
+    wall_paths['^'] = walls + "Half_mid.png";
+    wall_paths[' '] = items + "star.png";
+    wall_paths[COIN_OBJ1] = items + "coinGold.png";
+    wall_paths[COIN_OBJ2] = items + "gemRed.png";
+    wall_paths['#'] = tiles + "boxCrate.png";
+    wall_paths['$'] = tiles + "boxCrate_double.png";
+    wall_paths['&'] = tiles + "boxCrate_single.png";
+    wall_paths['%'] = tiles + "boxCrate_warning.png";
+    wall_paths[LAVA_MIDDLE] = tiles + "lava.png";
+    wall_paths[LAVA_SURFACE] = tiles + "lavaTop_low.png";
+    wall_paths[SPIKE_OBJ] = tiles + "spikes.png";
+    wall_paths[LADDER] = tiles + "ladderMid.png";
+    t.default_wall = asset(walls + "Center.png");
+    td.default_wall = asset(walls + "Center.png", false, true);
+    for (const std::pair<const char, QString>& pair: wall_paths) {
+      t.walls[pair.first] = asset(pair.second);
+      td.walls[pair.first] = asset(pair.second, false, true);
+    }
+    td.theme_name = t.theme_name;
     ground_themes.push_back(t);
-    ground_theme_downsample(&t, &td);
     ground_themes_down.push_back(td);
   }
 
   for (const char **theme=pthemes; *theme; ++theme) {
-    PlayerTheme t1;
-    PlayerTheme t1d;
-    t1.theme_name = QString::fromUtf8(*theme);
+    QString name = QString::fromUtf8(*theme);
     // We removed Mugen's helmet for aesthetic reasons
-    QString dir = "kenneyLarge/Players/128x256_no_helmet/" + t1.theme_name + "/alien" + t1.theme_name;
-    t1.stand = load_resource(dir + "_stand.png");
-    t1.front = load_resource(dir + "_front.png");
-    t1.walk1 = load_resource(dir + "_walk1.png");
-    t1.walk2 = load_resource(dir + "_walk2.png");
-    t1.climb1 = load_resource(dir + "_climb1.png");
-    t1.climb2 = load_resource(dir + "_climb2.png");
-    t1.jump = load_resource(dir + "_jump.png");
-    t1.duck = load_resource(dir + "_duck.png");
-    t1.hit = load_resource(dir + "_hit.png");
-    player_themesr.push_back(t1);
-
-    PlayerTheme t2;
-    PlayerTheme t2d;
-    t2.theme_name = QString::fromUtf8(*theme);
-    t2.stand = t1.stand.mirrored(true, false);
-    t2.front = t1.front.mirrored(true, false);
-    t2.walk1 = t1.walk1.mirrored(true, false);
-    t2.walk2 = t1.walk2.mirrored(true, false);
-    t2.climb1 = t1.climb1.mirrored(true, false);
-    t2.climb2 = t1.climb2.mirrored(true, false);
-    t2.jump = t1.jump.mirrored(true, false);
-    t2.duck = t1.duck.mirrored(true, false);
-    t2.hit = t1.hit.mirrored(true, false);
-    player_themesl.push_back(t2);
-
-    player_theme_downsample(&t1, &t1d);
-    player_themesr_down.push_back(t1d);
-    player_theme_downsample(&t2, &t2d);
-    player_themesl_down.push_back(t2d);
+    QString dir = "kenneyLarge/Players/128x256_no_helmet/" + name + "/alien" + name;
+    // themes facing right are the files as they are, those facing left mirrored
+    std::vector<PlayerTheme>* themes[2][2] = {
+      { &player_themesr, &player_themesr_down },
+      { &player_themesl, &player_themesl_down } };
+    for (int mirror = 0; mirror < 2; mirror++) {
+      for (int down = 0; down < 2; down++) {
+        PlayerTheme t;
+        t.theme_name = name;
+        t.stand = asset(dir + "_stand.png", mirror, down);
+        t.front = asset(dir + "_front.png", mirror, down);
+        t.walk1 = asset(dir + "_walk1.png", mirror, down);
+        t.walk2 = asset(dir + "_walk2.png", mirror, down);
+        t.climb1 = asset(dir + "_climb1.png", mirror, down);
+        t.climb2 = asset(dir + "_climb2.png", mirror, down);
+        t.jump = asset(dir + "_jump.png", mirror, down);
+        t.duck = asset(dir + "_duck.png", mirror, down);
+        t.hit = asset(dir + "_hit.png", mirror, down);
+        themes[mirror][down]->push_back(t);
+      }
+    }
   }
 
   // load power up agent assets
-  power_up_shield = load_resource("bubble_shield.png");
+  power_up_shield = asset("bubble_shield.png");
 
   // load enemy themes
   load_enemy_themes(ground_monsters, ground_theme_idxs, false, false);
   load_enemy_themes(walking_monsters, walking_theme_idxs, false, true);
   load_enemy_themes(flying_monsters, flying_theme_idxs, true, false);
+
+  if (!asset_atlas_path.empty() && atlas_stale)
+    atlas_bake();
 }
 
-void monitor_csv_save_string(FILE* monitor_csv, const char* c_str) {
-  if (!monitor_csv)
-    return;
-  fprintf(monitor_csv, "%s\n", c_str);
-  fflush(monitor_csv);
+static void fast_sprites_load();
+
+// -- pre-scaled themes --
+//
+// Drawing a sprite into a fractional QRectF makes QPainter resample it on every call.
+// Destination sizes only depend on zoom and resolution, which rarely change for a
+// given env, so each theme is scaled once per integer cell size into premultiplied
+// ARGB32 and then drawn with drawImage(QPointF), which the raster engine turns into
+// a plain blend at the rounded offset.
+
+struct ScaledThemes {
+  bool lowres;
+  int tile_w, tile_h;     // maze cell plus overlap, so neighbouring tiles leave no seams
+  int sprite_w, sprite_h; // one cell, players are 2 cells tall
+  std::vector<GroundTheme> ground;
+  std::vector<PlayerTheme> playerl;
+  std::vector<PlayerTheme> playerr;
+  std::vector<PlayerTheme> playerl_power_up; // channels rotated, see power_up_recolor()
+  std::vector<PlayerTheme> playerr_power_up;
+  std::vector<EnemyTheme> enemyl;
+  std::vector<EnemyTheme> enemyr;
+  QImage power_up_shield;
+
+  // Faded hit pose for every killed_animation_frame_cnt, per facing and theme. Only
+  // the video frame shows it and only when collecting data, so it is baked on first use.
+  QMutex fade_mutex;
+  std::vector<std::vector<QImage>> hit_fade[2];
+};
+
+static QMutex scaled_themes_mutex;
+static std::map<std::tuple<bool, int, int, int, int>, std::unique_ptr<ScaledThemes>> scaled_themes_cache;
+
+static
+QImage scale_to(const QImage& img, int w, int h)
+{
+  return img.scaled(max(1, w), max(1, h), Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+    .convertToFormat(QImage::Format_ARGB32_Premultiplied);
 }
 
-struct Agent {
-  std::shared_ptr<Maze> maze;
-  int theme_n;
-  float x, y, vx, vy;
-  float spring = 0;
-  float zoom = 1.0;
-  float target_zoom = 1.0;
-  uint8_t render_buf[RES_W*RES_H*4];
-  uint8_t* audio_seg_map_buf = 0;
-  uint8_t* render_hires_buf = 0;
-  bool game_over = false;
-  float reward = 0;
-  float reward_sum = 0;
-  bool is_facing_right;
-  bool ladder_mode;
-  int action_dx = 0;
-  int action_dy = 0;
-  int time_alive;
-  bool is_killed = false;
-  bool is_preparing_to_jump = false;
-  bool killed_monster = false;
-  bool bumped_head = false;
-  int killed_animation_frame_cnt = 0;
-  int finished_level_frame_cnt = 0;
-  bool power_up_mode = false;
-  bool collected_coin = false;
-  bool collected_gem = false;
-  bool collect_data;
-  bool support;
-  FILE *monitor_csv = 0;
-  double t0;
+static
+void scale_player_theme(const PlayerTheme& t, PlayerTheme* s, int w, int h)
+{
+  s->theme_name = t.theme_name;
+  s->stand = scale_to(t.stand, w, h);
+  s->front = scale_to(t.front, w, h);
+  s->walk1 = scale_to(t.walk1, w, h);
+  s->walk2 = scale_to(t.walk2, w, h);
+  s->climb1 = scale_to(t.climb1, w, h);
+  s->climb2 = scale_to(t.climb2, w, h);
+  s->jump = scale_to(t.jump, w, h);
+  s->duck = scale_to(t.duck, w, h);
+  s->hit = scale_to(t.hit, w, h);
+}
 
-  ~Agent() {
-    if (render_hires_buf) {
-      delete[] render_hires_buf;
-      render_hires_buf = 0;
-    }
-    if (audio_seg_map_buf) {
-      delete[] audio_seg_map_buf;
-      audio_seg_map_buf = 0;
-    }
-    if (monitor_csv) {
-      fclose(monitor_csv);
-      monitor_csv = 0;
+static
+QImage power_up_recolor(const QImage& src)
+{
+  QImage img = src;
+  for (int x = 0; x < img.width(); x++) {
+    for (int y = 0; y < img.height(); y++) {
+      QColor pixel_color = img.pixelColor(x, y);
+      pixel_color.setRgb(pixel_color.blue(), pixel_color.red(), pixel_color.green(), pixel_color.alpha());
+      img.setPixelColor(x, y, pixel_color);
     }
   }
+  return img;
+}
 
-  void monitor_csv_open(int n_in_vec) {
-    t0 = get_time();
-    std::string monitor_fn;
-    char *rank_ch = getenv("PMI_RANK");
-    if (rank_ch) {
-      int rank = atoi(rank_ch);
-      monitor_fn = monitor_dir + stdprintf("/%02i%02i.monitor.csv", rank, n_in_vec);
-    } else {
-      monitor_fn = monitor_dir + stdprintf("/%03i.monitor.csv", n_in_vec);
-    }
-    monitor_csv = fopen(monitor_fn.c_str(), "wt");
-    std::cout << "csv file location: " << monitor_fn.c_str() << std::endl;
-    fprintf(monitor_csv, "# {\"t_start\": %0.2lf, \"gym_version\": \"coinrun\", \"env_id\": \"coinrun\"}\n", t0);
-    // fprintf(monitor_csv, "r,l,t\n");
-    fflush(monitor_csv);
+static
+void power_up_player_theme(const PlayerTheme& t, PlayerTheme* s)
+{
+  s->theme_name = t.theme_name;
+  s->stand = power_up_recolor(t.stand);
+  s->front = power_up_recolor(t.front);
+  s->walk1 = power_up_recolor(t.walk1);
+  s->walk2 = power_up_recolor(t.walk2);
+  s->climb1 = power_up_recolor(t.climb1);
+  s->climb2 = power_up_recolor(t.climb2);
+  s->jump = power_up_recolor(t.jump);
+  s->duck = power_up_recolor(t.duck);
+  s->hit = power_up_recolor(t.hit);
+}
 
-    // save global generation parameters to be able to reproduce later
-    std::stringstream buffer;
-    buffer << "background_themes";
-    for (const char **theme=bgthemes; *theme; ++theme) {
-      buffer << "," << *theme;
-    }
-    buffer << std::endl << "ground_themes";
-    for (const char **theme=gthemes; *theme; ++theme) {
-      buffer << "," << *theme;
-    }
-    buffer << std::endl << "agent_themes";
-    for (const char **theme=pthemes; *theme; ++theme) {
-      buffer << "," << *theme;
-    }
-    buffer << std::endl << "ground_monsters";
-    for (const char **theme=ground_monsters; *theme; ++theme) {
-      buffer << "," << *theme;
-    }
-    buffer << std::endl << "flying_monsters";
-    for (const char **theme=flying_monsters; *theme; ++theme) {
-      buffer << "," << *theme;
-    }
-    buffer << std::endl << "walking_monsters";
-    for (const char **theme=walking_monsters; *theme; ++theme) {
-      buffer << "," << *theme;
+static
+QImage death_fade(const QImage& src, int killed_animation_frame_cnt)
+{
+  int fade = (DEATH_ANIM_LENGTH + 1 - killed_animation_frame_cnt)*12;
+  QImage img = src;
+  for (int x = 0; x < img.width(); x++) {
+    for (int y = 0; y < img.height(); y++) {
+      QColor pixel_color = img.pixelColor(x, y);
+      int hue = pixel_color.hue();
+      int saturation = max(pixel_color.saturation() - fade, 0);
+      int value = max(pixel_color.value(), 0);
+      int alpha = max(pixel_color.alpha() - fade, 0);
+
+      pixel_color.setHsv(hue, saturation, value, alpha);
+      img.setPixelColor(x, y, pixel_color);
     }
-    buffer << std::endl;
-
-    monitor_csv_save_string(monitor_csv, buffer.str().c_str());
   }
+  return img;
+}
 
-  void monitor_csv_episode_over() {
-    if (!monitor_csv)
-      return;
-    fprintf(monitor_csv, "episode_over,%0.1f,%i,%0.1f\n", reward_sum, time_alive, get_time() - t0);
-    fflush(monitor_csv);
-  }
+static
+void scale_enemy_theme(const EnemyTheme& t, EnemyTheme* s, int w, int h)
+{
+  *s = t;
+  s->walk1 = scale_to(t.walk1, w, h);
+  s->walk2 = scale_to(t.walk2, w, h);
+  s->dead = scale_to(t.dead, w, h);
+}
 
-  void reset(int spawn_n) {
-    x = maze->spawnpos[0];
-    y = maze->spawnpos[1];
-    action_dx = 0;
-    action_dy = 0;
-    time_alive = 0;
-    reward_sum = 0;
-    vx = vy = spring = 0;
-    is_facing_right = true;
+static
+ScaledThemes* build_scaled_themes(bool lowres, int tile_w, int tile_h, int sprite_w, int sprite_h, double kx, double ky)
+{
+  ScaledThemes* s = new ScaledThemes();
+  s->lowres = lowres;
+  s->tile_w = tile_w;
+  s->tile_h = tile_h;
+  s->sprite_w = sprite_w;
+  s->sprite_h = sprite_h;
+
+  const std::vector<GroundTheme>& ground = lowres ? ground_themes_down : ground_themes;
+  s->ground.resize(ground.size());
+  for (size_t i = 0; i < ground.size(); i++) {
+    s->ground[i].theme_name = ground[i].theme_name;
+    for (const std::pair<const char, QImage> &pair : ground[i].walls)
+      s->ground[i].walls[pair.first] = scale_to(pair.second, tile_w, tile_h);
+    s->ground[i].default_wall = scale_to(ground[i].default_wall, tile_w, tile_h);
   }
 
-  void eat_coin(int x, int y)
-  {
-    int obj = maze->get_elem(x, y);
-    bool eat_coin_to_save = false;
+  const std::vector<PlayerTheme>& pl = lowres ? player_themesl_down : player_themesl;
+  const std::vector<PlayerTheme>& pr = lowres ? player_themesr_down : player_themesr;
+  s->playerl.resize(pl.size());
+  s->playerr.resize(pr.size());
+  for (size_t i = 0; i < pl.size(); i++)
+    scale_player_theme(pl[i], &s->playerl[i], sprite_w, 2*sprite_h);
+  for (size_t i = 0; i < pr.size(); i++)
+    scale_player_theme(pr[i], &s->playerr[i], sprite_w, 2*sprite_h);
+  s->playerl_power_up.resize(pl.size());
+  s->playerr_power_up.resize(pr.size());
+  for (size_t i = 0; i < pl.size(); i++)
+    power_up_player_theme(s->playerl[i], &s->playerl_power_up[i]);
+  for (size_t i = 0; i < pr.size(); i++)
+    power_up_player_theme(s->playerr[i], &s->playerr_power_up[i]);
+
+  // the dead sprite is never downsampled, see load_enemy_themes
+  const std::vector<EnemyTheme>& el = lowres ? enemy_themel_down : enemy_themel;
+  const std::vector<EnemyTheme>& er = lowres ? enemy_themer_down : enemy_themer;
+  s->enemyl.resize(el.size());
+  s->enemyr.resize(er.size());
+  for (size_t i = 0; i < el.size(); i++)
+    scale_enemy_theme(el[i], &s->enemyl[i], sprite_w, sprite_h);
+  for (size_t i = 0; i < er.size(); i++)
+    scale_enemy_theme(er[i], &s->enemyr[i], sprite_w, sprite_h);
+
+  s->power_up_shield = scale_to(power_up_shield, iround(kx * 1.15), iround(2.1 * ky));
+  return s;
+}
 
-    if (is_lethal(obj)) {
-      maze->is_terminated = true;
-      is_killed = true;
-      killed_animation_frame_cnt = DEATH_ANIM_LENGTH;
-    }
+// Returns themes scaled for cell size kx by ky. memo is the caller's last result, and
+// is returned as is while the integer sizes still match, so the cache lock is only
+// taken when zoom or resolution actually changes.
+static
+ScaledThemes* find_scaled_themes(ScaledThemes*& memo, bool lowres, double kx, double ky)
+{
+  int tile_w = int(ceil(kx + .5));
+  int tile_h = int(ceil(ky + .5));
+  int sprite_w = iround(kx);
+  int sprite_h = iround(ky);
+  if (memo && memo->lowres == lowres && memo->tile_w == tile_w && memo->tile_h == tile_h &&
+      memo->sprite_w == sprite_w && memo->sprite_h == sprite_h)
+    return memo;
+
+  QMutexLocker lock(&scaled_themes_mutex);
+  std::unique_ptr<ScaledThemes>& slot = scaled_themes_cache[std::make_tuple(lowres, tile_w, tile_h, sprite_w, sprite_h)];
+  if (!slot)
+    slot.reset(build_scaled_themes(lowres, tile_w, tile_h, sprite_w, sprite_h, kx, ky));
+  memo = slot.get();
+  return memo;
+}
 
-    if (is_coin(obj)) {
-      maze->set_elem(x, y, SPACE);
-      maze->coins -= 1;
-      collected_coin = true;
-      eat_coin_to_save = true;
-      if (power_up_mode)
-        power_up_mode = false;
+static
+const PlayerTheme* choose_player_theme(const ScaledThemes* themes, int theme_n, bool is_facing_right, bool power_up)
+{
+  if (power_up)
+    return is_facing_right ? &themes->playerr_power_up[theme_n] : &themes->playerl_power_up[theme_n];
+  return is_facing_right ? &themes->playerr[theme_n] : &themes->playerl[theme_n];
+}
 
-      if (maze->coins == 0) {
-        reward += 10.0f;
-        reward_sum += 10.0f;
-        maze->is_terminated = true;
-        finished_level_frame_cnt = FINISHED_LEVEL_ANIM_LENGTH;
-      } else {
-        reward += 1.0f;
-        reward_sum += 1.0f;
+// Hit pose faded for killed_animation_frame_cnt. Counts outside 0..DEATH_ANIM_LENGTH
+// don't occur, and below ~9 the sprite is already fully transparent.
+static
+const QImage& choose_death_fade(ScaledThemes* themes, int theme_n, bool is_facing_right, int killed_animation_frame_cnt)
+{
+  int cnt = max(0, min(DEATH_ANIM_LENGTH, killed_animation_frame_cnt));
+  QMutexLocker lock(&themes->fade_mutex);
+  std::vector<std::vector<QImage>>& fades = themes->hit_fade[is_facing_right ? 1 : 0];
+  if (fades.empty())
+    fades.resize(themes->playerl.size());
+  std::vector<QImage>& frames = fades[theme_n];
+  if (frames.empty()) {
+    const QImage& hit = choose_player_theme(themes, theme_n, is_facing_right, false)->hit;
+    for (int c = 0; c <= DEATH_ANIM_LENGTH; c++)
+      frames.push_back(death_fade(hit, c));
+  }
+  return frames[cnt];
+}
+
+static
+const GroundTheme* choose_ground_theme(const ScaledThemes* themes, int theme_n)
+{
+  return &themes->ground[theme_n];
+}
+
+static
+const EnemyTheme* choose_enemy_theme(const ScaledThemes* themes, int theme_n, bool is_facing_right)
+{
+  return is_facing_right ? &themes->enemyr[theme_n] : &themes->enemyl[theme_n];
+}
+
+// Draws a scrolling lava tile: the source is shifted left by tr of its width and wraps.
+static
+void draw_scrolling_tile(QPainter& p, const QPointF& dst, const QImage& img, float tr)
+{
+  int w = img.width();
+  int s = iround(tr * w) % w;
+  p.drawImage(dst, img, QRectF(s, 0, w - s, img.height()));
+  if (s > 0)
+    p.drawImage(QPointF(dst.x() + w - s, dst.y()), img, QRectF(0, 0, s, img.height()));
+}
+
+// Per-env output file name in dir, without extension. Includes the MPI rank when there is one.
+std::string env_file_prefix(const std::string& dir, int n_in_vec) {
+  char *rank_ch = getenv("PMI_RANK");
+  if (rank_ch) {
+    int rank = atoi(rank_ch);
+    return dir + stdprintf("/%02i%02i", rank, n_in_vec);
+  }
+  return dir + stdprintf("/%03i", n_in_vec);
+}
+
+// -- monitor log --
+//
+// monitor.csv records are appended to a per-env byte ring by whichever stepping thread
+// is stepping that env, and a single background thread writes all rings out in large
+// chunks. The file is only flushed at episode boundaries and when it is closed. An env's
+// steps never overlap (state_mutex), so each ring has one producer at a time. A producer
+// that finds its ring full sleeps until the writer has been through the rings again.
+
+const int MONITOR_RING_SIZE = 1 << 16;    // bytes per env, a maze dump is about 2k
+const int MONITOR_WRITE_INTERVAL_MS = 20;
+
+static QMutex monitor_logs_mutex;
+static QWaitCondition monitor_writer_wake;
+static QWaitCondition monitor_rings_drained;         // after every pass of the writer
+static bool monitor_writer_stop = false;             // under monitor_logs_mutex
+static bool monitor_writer_pending = false;          // under monitor_logs_mutex, write without waiting
+static std::atomic<bool> monitor_writer_exited{false}; // producers write for themselves after this, set under monitor_logs_mutex
+
+// Makes the writer start a pass now rather than at its next interval.
+static
+void monitor_writer_kick()
+{
+  QMutexLocker lock(&monitor_logs_mutex);
+  monitor_writer_pending = true;
+  monitor_writer_wake.wakeOne();
+}
+
+class MonitorLog {
+public:
+  explicit MonitorLog(FILE* f)
+      : f(f), ring(new char[MONITOR_RING_SIZE]) {}
+
+  void append(const char* s, size_t n)
+  {
+    while (n > 0) {
+      uint64_t h = head.load(std::memory_order_relaxed);
+      size_t space = MONITOR_RING_SIZE - (h - tail.load(std::memory_order_acquire));
+      if (space == 0) {
+        wait_for_space(h);
+        continue;
       }
+      size_t chunk = n < space ? n : space;
+      size_t pos = h % MONITOR_RING_SIZE;
+      size_t first = min(int(chunk), int(MONITOR_RING_SIZE - pos));
+      memcpy(ring.get() + pos, s, first);
+      memcpy(ring.get(), s + first, chunk - first);
+      head.store(h + chunk, std::memory_order_release);
+      s += chunk;
+      n -= chunk;
     }
+  }
 
-    if (is_gem(obj)) {
-      maze->set_elem(x, y, SPACE);
-      eat_coin_to_save = true;
-      reward += 1.0f;
-      reward_sum += 1.0f;
-      power_up_mode = true;
-      collected_gem = true;
-    }
+  void append(const std::string& s) { append(s.data(), s.size()); }
 
-    if (eat_coin_to_save) {
-      std::stringstream buffer;
-      buffer << "eat_coin," << x << "," << y << std::endl;
-      monitor_csv_save_string(monitor_csv, buffer.str().c_str());
+  // Bytes appended so far, i.e. the file offset of the next append. Producer side only.
+  uint64_t size() const { return head.load(std::memory_order_relaxed); }
+
+  void printf(const char* fmt, ...)
+  {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < int(sizeof(buf))) {
+      append(buf, n);
+      return;
     }
+    va_start(ap, fmt);
+    std::string big(n + 1, '\0');
+    vsnprintf(&big[0], n + 1, fmt, ap);
+    va_end(ap);
+    append(big.data(), n);
   }
 
-  void sub_step(float _vx, float _vy)
+  // Asks the writer to flush the file after writing what was appended so far.
+  void flush()
   {
-    float ny = y + _vy;
-    float nx = x + _vx;
+    flush_requested = true;
+    monitor_writer_kick();
+  }
 
-    if (_vy < 0 && !maze->has_vertical_space(x, ny, false)) {
-      y = int(ny) + 1;
-      support = true;
-      vy = 0;
+  // No appends after this, the writer closes the file once the ring is empty.
+  void close()
+  {
+    closed = true;
+    if (monitor_writer_exited)
+      write_out(true);
+    else
+      monitor_writer_kick();
+  }
 
-    } else if (_vy < 0 && !maze->has_vertical_space(x, ny, true)) {
-      if (action_dy >= 0 && int(ny)!=int(y)) {
-        y = int(ny) + 1;
-        vy = 0;
-        support = true;
-      } else {  // action_dy < 0, come down from a crate
-        support = false;
-        y = ny;
-      }
+  // Writer thread only, or the producer once the writer has exited. Returns false
+  // once the file is closed.
+  bool write_out(bool final_sweep)
+  {
+    if (!f)
+      return false;
+    bool closing = closed.load();
+    bool flushing = flush_requested.exchange(false) || final_sweep;
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    uint64_t h = head.load(std::memory_order_acquire);
+    while (t < h) {
+      size_t pos = t % MONITOR_RING_SIZE;
+      size_t chunk = min(int(h - t), int(MONITOR_RING_SIZE - pos));
+      fwrite(ring.get() + pos, 1, chunk, f);
+      t += chunk;
+    }
+    tail.store(t, std::memory_order_release);
+    if (closing) {
+      fclose(f);
+      f = 0;
+      return false;
+    }
+    if (flushing)
+      fflush(f);
+    return true;
+  }
 
-    } else if (_vy > 0 && !maze->has_vertical_space(x, ny + 1, false)) {
-      y = int(ny);
-      while (!maze->has_vertical_space(x, y, false)) {
-        y -= 1;
+private:
+  // Producer side, with the ring full at head h. The writer moves tail and then signals
+  // monitor_rings_drained under monitor_logs_mutex, so checking tail under that mutex
+  // before waiting cannot miss the signal.
+  void wait_for_space(uint64_t h)
+  {
+    {
+      QMutexLocker lock(&monitor_logs_mutex);
+      if (!monitor_writer_exited) {
+        if (h - tail.load(std::memory_order_acquire) == MONITOR_RING_SIZE) {
+          monitor_writer_pending = true;
+          monitor_writer_wake.wakeOne();
+          monitor_rings_drained.wait(&monitor_logs_mutex);
+        }
+        return;
       }
-      bumped_head = true;
-      vy = 0;
-      reward -= BUMP_HEAD_PENALTY;
-      reward_sum -= BUMP_HEAD_PENALTY;
-
-    } else {
-      y = ny;
     }
+    write_out(false);
+  }
 
-    int ix = int(x);
-    int iy = int(y);
-    int inx = int(nx);
+  FILE* f;
+  std::unique_ptr<char[]> ring;
+  std::atomic<uint64_t> head{0}; // bytes appended
+  char pad[64];                  // keep producer and writer cursors apart
+  std::atomic<uint64_t> tail{0}; // bytes written
+  std::atomic<bool> flush_requested{false};
+  std::atomic<bool> closed{false};
+};
 
-    if (_vx < 0 && is_wall(maze->get_elem(inx, iy)) ) {
-      vx = 0;
-      x = int(inx) + 1;
-    } else if (_vx > 0 && is_wall(maze->get_elem(inx + 1, iy))) {
-      vx = 0;
-      x = int(inx);
-    } else {
-      x = nx;
-    }
+static std::vector<std::shared_ptr<MonitorLog>> monitor_logs;
+static std::shared_ptr<QThread> monitor_writer;
 
-    eat_coin(ix, iy);
-    eat_coin(ix, iy+1);
-    eat_coin(ix+1, iy);
-    eat_coin(ix+1, iy+1);
+static
+std::shared_ptr<MonitorLog> monitor_log_open(const std::string& fn, const char* mode)
+{
+  FILE* f = fopen(fn.c_str(), mode);
+  if (!f) {
+    fprintf(stderr, "coinrun: cannot open %s\n", fn.c_str());
+    return std::shared_ptr<MonitorLog>();
   }
+  std::shared_ptr<MonitorLog> log(new MonitorLog(f));
+  QMutexLocker lock(&monitor_logs_mutex);
+  monitor_logs.push_back(log);
+  return log;
+}
 
-  void step_coinrun()
-  {
-    support = false;
-    if (finished_level_frame_cnt > 0) {
-      action_dy = 0;
-      action_dx = 0;
+static
+void monitor_writer_thread()
+{
+  std::vector<std::shared_ptr<MonitorLog>> logs;
+  while (1) {
+    bool stop;
+    {
+      QMutexLocker lock(&monitor_logs_mutex);
+      if (!monitor_writer_stop && !monitor_writer_pending)
+        monitor_writer_wake.wait(&monitor_logs_mutex, MONITOR_WRITE_INTERVAL_MS);
+      monitor_writer_pending = false;
+      stop = monitor_writer_stop;
+      logs = monitor_logs;
     }
 
-    int near_x = int(x + .5);
-    char test_is_ladder1 = maze->get_elem(near_x, int(y + 0.2));
-    char test_is_ladder2 = maze->get_elem(near_x, int(y - 0.2));
+    std::vector<MonitorLog*> finished;
+    for (const std::shared_ptr<MonitorLog>& log: logs)
+      if (!log->write_out(stop))
+        finished.push_back(log.get());
+    logs.clear();
 
-    if (test_is_ladder1 == LADDER || test_is_ladder2 == LADDER) {
-      if (action_dy != 0)
-        ladder_mode = true;
-    } else {
-      ladder_mode = false;
+    {
+      QMutexLocker lock(&monitor_logs_mutex);
+      for (MonitorLog* log: finished)
+        for (size_t i = 0; i < monitor_logs.size(); i++)
+          if (monitor_logs[i].get() == log) {
+            monitor_logs.erase(monitor_logs.begin() + i);
+            break;
+          }
+      if (stop)
+        monitor_writer_exited = true; // producers still waiting write for themselves
+      monitor_rings_drained.wakeAll();
     }
+    if (stop)
+      return;
+  }
+}
 
-    float max_jump = maze->max_jump;
-    float max_speed = maze->max_speed;
-    float mix_rate = maze->mix_rate;
+class MonitorWriterThread : public QThread {
+public:
+  void run() { monitor_writer_thread(); }
+};
 
-    if (ladder_mode) {
-      vx = (1-LADDER_MIXRATE_X)*vx + LADDER_MIXRATE_X*max_speed*(action_dx + 0.2*(near_x - x));
-      vx = clip_abs(vx, LADDER_V);
-      vy = (1-LADDER_MIXRATE_Y)*vy + LADDER_MIXRATE_Y*max_speed*action_dy;
-      vy = clip_abs(vy, LADDER_V);
+void monitor_csv_save_string(MonitorLog* monitor_csv, const char* c_str) {
+  if (!monitor_csv)
+    return;
+  monitor_csv->append(c_str, strlen(c_str));
+  monitor_csv->append("\n", 1);
+}
 
-    } else if (spring > 0 && vy==0 && action_dy==0) {
-      vy = max_jump;
-      reward -= JUMP_PENALTY;
-      reward_sum -= JUMP_PENALTY;
+// -- binary metadata --
+//
+// Fixed-schema alternative to the monitor.csv text records, selected with
+// initialize_set_monitor_format(). Everything is a little-endian POD record, so
+// the file can be memory-mapped and indexed without parsing it:
+//
+//   MetaFileHeader, then META_THEME_TABLES x (uint32 count, count x char[META_NAME_LEN])
+//   per game: MetaGameHeader, maze_w*maze_h tile chars padded to 8 bytes,
+//             then per frame one MetaFrame followed by n_monsters MetaMonster
+//   one MetaIndexEntry per game, then MetaTrailer as the last 16 bytes
+//
+// Index and trailer are written when the env closes; without them, games can still
+// be found by walking the game headers. coinrun/metadata.py reads this format.
+// A frame is one env step, like a video frame: with an action repeat it records the
+// last game step of the repeat, and its event flags those of all the repeats.
+
+enum { MONITOR_FORMAT_CSV = 0, MONITOR_FORMAT_BIN = 1, MONITOR_FORMAT_BOTH = 2 };
+static int monitor_format = MONITOR_FORMAT_CSV;
+
+const uint32_t META_VERSION = 2;
+const int META_THEME_TABLES = 6;
+const int META_NAME_LEN = 64;
+// One frame record covers up to MAX_ACTION_REPEAT game steps, and eat_coin checks 4 cells
+// per sub step, 2 sub steps per game step.
+const int MAX_ACTION_REPEAT = 8;
+const int META_MAX_COINS = 8 * MAX_ACTION_REPEAT;
+
+struct MetaFileHeader {
+  char magic[8];            // "CRMETA\0\0"
+  uint32_t version;
+  uint32_t n_theme_tables;
+  double t_start;
+};
 
-      spring = 0;
-      support = true;
-    } else {
-      vy -= maze->gravity;
-    }
+struct MetaGameHeader {
+  char tag[4];              // "GAME"
+  int32_t game_id;
+  int32_t level_seed;
+  float zoom;
+  int32_t world_theme_n;
+  int32_t agent_theme_n;
+  int32_t maze_w;
+  int32_t maze_h;
+  int32_t n_monsters;
+  int32_t pad;
+};
 
-    vy = clip_abs(vy, max_jump);
-    vx = clip_abs(vx, max_speed);
+enum {
+  META_FACING_RIGHT = 1 << 0,
+  META_LADDER = 1 << 1,
+  META_KILLED = 1 << 2,
+  META_KILLED_MONSTER = 1 << 3,
+  META_BUMPED_HEAD = 1 << 4,
+  META_COLLECTED_COIN = 1 << 5,
+  META_COLLECTED_GEM = 1 << 6,
+  META_POWER_UP = 1 << 7,
+};
 
-    int num_sub_steps = 2;
-    float pct = 1.0 / num_sub_steps;
+struct MetaFrame {
+  int32_t time_alive;
+  int32_t state_time;
+  float x, y, vx, vy;
+  float spring;
+  int32_t killed_animation_frame_cnt;
+  int32_t finished_level_frame_cnt;
+  uint16_t flags;           // META_FACING_RIGHT...
+  uint8_t n_coins;          // coins eaten in the game steps of this frame
+  uint8_t pad;
+  int16_t coins[META_MAX_COINS][2];
+};
 
-    for (int s = 0; s < num_sub_steps; s++) {
-      sub_step(vx * pct, vy * pct);
-      if (vx == 0 && vy == 0) {
-        break;
+enum {
+  META_MONSTER_FLYING = 1 << 0,
+  META_MONSTER_WALKING = 1 << 1,
+  META_MONSTER_JUMPING = 1 << 2,
+  META_MONSTER_DEAD = 1 << 3,
+};
+
+struct MetaMonster {
+  float x, y, vx, vy;
+  int32_t monster_dying_frame_cnt;
+  int16_t theme_n;
+  uint8_t flags;            // META_MONSTER_FLYING...
+  uint8_t anim_freq;
+};
+
+struct MetaIndexEntry {
+  int32_t game_id;
+  int32_t n_monsters;
+  uint64_t offset;          // of the MetaGameHeader
+  uint32_t n_frames;
+  int32_t length;           // time_alive at episode_over, -1 if the game never ended
+  float reward_sum;
+  uint32_t pad;
+  double seconds;           // since t_start, at episode_over
+};
+
+struct MetaTrailer {
+  uint64_t index_offset;
+  uint32_t n_games;
+  char magic[4];            // "CRIX"
+};
+
+static_assert(sizeof(MetaFileHeader) == 24, "MetaFileHeader layout");
+static_assert(sizeof(MetaGameHeader) == 40, "MetaGameHeader layout");
+static_assert(sizeof(MetaFrame) == 40 + 4 * META_MAX_COINS, "MetaFrame layout");
+static_assert(sizeof(MetaMonster) == 24, "MetaMonster layout");
+static_assert(sizeof(MetaIndexEntry) == 40, "MetaIndexEntry layout");
+static_assert(sizeof(MetaTrailer) == 16, "MetaTrailer layout");
+
+// Per-env writer state, the bytes themselves go through a MonitorLog.
+struct MetaLog {
+  std::shared_ptr<MonitorLog> out;
+  std::vector<MetaIndexEntry> index;
+  int16_t coins[META_MAX_COINS][2];
+  int n_coins = 0;
+
+  template<typename T>
+  void put(const T& record) { out->append((const char*)&record, sizeof(T)); }
+
+  void add_coin(int x, int y)
+  {
+    assert(n_coins < META_MAX_COINS && "more coins in one frame than MAX_ACTION_REPEAT game steps can eat");
+    coins[n_coins][0] = int16_t(x);
+    coins[n_coins][1] = int16_t(y);
+    n_coins++;
+  }
+
+  void write_header(double t_start, const char** tables[META_THEME_TABLES])
+  {
+    MetaFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "CRMETA", 6);
+    h.version = META_VERSION;
+    h.n_theme_tables = META_THEME_TABLES;
+    h.t_start = t_start;
+    put(h);
+    for (int t = 0; t < META_THEME_TABLES; t++) {
+      uint32_t count = 0;
+      for (const char **theme=tables[t]; *theme; ++theme)
+        count++;
+      put(count);
+      for (const char **theme=tables[t]; *theme; ++theme) {
+        char name[META_NAME_LEN];
+        memset(name, 0, sizeof(name));
+        strncpy(name, *theme, META_NAME_LEN - 1);
+        out->append(name, META_NAME_LEN);
       }
     }
+  }
 
-    if (support) {
-      if (action_dy > 0)
-        spring += sign(action_dy) * max_jump/4; // four jump heights
-      if (action_dy < 0)
-        spring = -0.01;
-      if (action_dy == 0 && spring < 0)
-        spring = 0;
+  void close()
+  {
+    MetaTrailer t;
+    memset(&t, 0, sizeof(t));
+    t.index_offset = out->size();
+    t.n_games = index.size();
+    memcpy(t.magic, "CRIX", 4);
+    if (!index.empty())
+      out->append((const char*)index.data(), index.size() * sizeof(MetaIndexEntry));
+    put(t);
+    out->close();
+    out.reset();
+  }
+};
 
-      spring = clip_abs(spring, max_jump);
-      vx = (1-mix_rate)*vx;
-      if (spring==0) vx += mix_rate*max_speed*action_dx;
-      if (fabs(vx) < mix_rate*max_speed) vx = 0;
+struct StaticLayer;
 
-    } else {
-      spring = 0;
-      float ac = maze->air_control;
-      vx = (1-ac*mix_rate)*vx + ac*mix_rate*action_dx;
-    }
+// One entry of vec_set_event_buffers() output. frame is the agent's time_alive after the
+// step it happened in; x, y the tile eaten, the monster killed, or the agent otherwise.
+struct Event {
+  int32_t frame;
+  float x, y;
+  uint8_t kind; // EventKind
+  uint8_t pad[3];
+};
 
-    if (vx < 0) {
-      is_facing_right = false;
-    } else if (vx > 0) {
-      is_facing_right = true;
+const int EVENT_RING_SIZE = 32; // per env and step, older events are overwritten
+
+// Events of one env since its last step outputs were written. Filled on the worker
+// stepping the env and drained by write_step_outputs(), so it needs no locking.
+struct EventRing {
+  Event ev[EVENT_RING_SIZE];
+  uint32_t n = 0;       // pushed since the last drain, ev holds the last EVENT_RING_SIZE
+  uint32_t stamped = 0; // the ones before this have their frame
+
+  void push(int kind, float x, float y)
+  {
+    Event& e = ev[n++ % EVENT_RING_SIZE];
+    e.frame = -1;
+    e.x = x;
+    e.y = y;
+    e.kind = kind;
+  }
+
+  void stamp(int frame)
+  {
+    if (n - stamped > (uint32_t)EVENT_RING_SIZE)
+      stamped = n - EVENT_RING_SIZE;
+    for (; stamped < n; stamped++)
+      ev[stamped % EVENT_RING_SIZE].frame = frame;
+  }
+
+  // Copies the events, oldest first, into out and empties the ring. Returns how many.
+  int drain(Event* out)
+  {
+    int cnt = min(n, (uint32_t)EVENT_RING_SIZE);
+    for (int i = 0; i < cnt; i++)
+      out[i] = ev[(n - cnt + i) % EVENT_RING_SIZE];
+    clear();
+    return cnt;
+  }
+
+  void clear()  { n = stamped = 0; }
+};
+
+struct Agent {
+  std::shared_ptr<Maze> maze;
+  int theme_n;
+  float x, y, vx, vy;
+  float spring = 0;
+  float zoom = 1.0;
+  float target_zoom = 1.0;
+  uint8_t render_buf[RES_W*RES_H*4];
+  uint8_t* audio_seg_map_buf = 0;
+  uint8_t* render_hires_buf = 0;
+  bool game_over = false;
+  float reward = 0;
+  float reward_sum = 0;
+  bool is_facing_right;
+  bool ladder_mode;
+  int action_dx = 0;
+  int action_dy = 0;
+  int time_alive;
+  bool is_killed = false;
+  bool is_preparing_to_jump = false;
+  bool killed_monster = false;
+  bool bumped_head = false;
+  int killed_animation_frame_cnt = 0;
+  int finished_level_frame_cnt = 0;
+  bool power_up_mode = false;
+  bool collected_coin = false;
+  bool collected_gem = false;
+  uint32_t frame_events = 0; // 1 << EventKind of the events of this frame, for the audio map
+  EventRing events;
+  std::vector<std::pair<int16_t, int16_t>> pickups; // coins and gems eaten, for monitor_save_coins()
+  bool collect_data;
+  bool symbolic_obs = false; // observations are written by write_symbolic_obs(), nothing is painted
+  bool support;
+  std::shared_ptr<MonitorLog> monitor_csv;
+  std::unique_ptr<MetaLog> monitor_bin;
+  double t0;
+  mutable ScaledThemes* agent_themes = 0; // last find_scaled_themes() results
+  mutable ScaledThemes* video_themes = 0;
+  mutable std::shared_ptr<StaticLayer> agent_layer; // the level under agent frames, see static_layer_sync()
+
+  ~Agent() {
+    if (render_hires_buf) {
+      delete[] render_hires_buf;
+      render_hires_buf = 0;
     }
+    if (audio_seg_map_buf) {
+      delete[] audio_seg_map_buf;
+      audio_seg_map_buf = 0;
+    }
+    if (monitor_bin) {
+      monitor_bin->close();
+      monitor_bin.reset();
+    }
+    if (monitor_csv) {
+      monitor_csv->close();
+      monitor_csv.reset();
+    }
+  }
+
+  void monitor_csv_open(int n_in_vec) {
+    t0 = get_time();
+    std::string prefix = env_file_prefix(monitor_dir, n_in_vec);
+    if (monitor_format != MONITOR_FORMAT_CSV) {
+      std::shared_ptr<MonitorLog> out = monitor_log_open(prefix + ".monitor.bin", "wb");
+      if (out) {
+        const char** tables[META_THEME_TABLES] = { bgthemes, gthemes, pthemes, ground_monsters, flying_monsters, walking_monsters };
+        monitor_bin.reset(new MetaLog);
+        monitor_bin->out = out;
+        monitor_bin->write_header(t0, tables);
+      }
+    }
+    if (monitor_format == MONITOR_FORMAT_BIN)
+      return;
+
+    std::string monitor_fn = prefix + ".monitor.csv";
+    monitor_csv = monitor_log_open(monitor_fn, "wt");
+    if (!monitor_csv)
+      return;
+    std::cout << "csv file location: " << monitor_fn.c_str() << std::endl;
+    monitor_csv->printf("# {\"t_start\": %0.2lf, \"gym_version\": \"coinrun\", \"env_id\": \"coinrun\"}\n", t0);
+    // monitor_csv->printf("r,l,t\n");
+
+    // save global generation parameters to be able to reproduce later
+    std::stringstream buffer;
+    buffer << "background_themes";
+    for (const char **theme=bgthemes; *theme; ++theme) {
+      buffer << "," << *theme;
+    }
+    buffer << std::endl << "ground_themes";
+    for (const char **theme=gthemes; *theme; ++theme) {
+      buffer << "," << *theme;
+    }
+    buffer << std::endl << "agent_themes";
+    for (const char **theme=pthemes; *theme; ++theme) {
+      buffer << "," << *theme;
+    }
+    buffer << std::endl << "ground_monsters";
+    for (const char **theme=ground_monsters; *theme; ++theme) {
+      buffer << "," << *theme;
+    }
+    buffer << std::endl << "flying_monsters";
+    for (const char **theme=flying_monsters; *theme; ++theme) {
+      buffer << "," << *theme;
+    }
+    buffer << std::endl << "walking_monsters";
+    for (const char **theme=walking_monsters; *theme; ++theme) {
+      buffer << "," << *theme;
+    }
+    buffer << std::endl;
+
+    monitor_csv_save_string(monitor_csv.get(), buffer.str().c_str());
+  }
+
+  void monitor_csv_episode_over() {
+    if (monitor_bin && !monitor_bin->index.empty()) {
+      MetaIndexEntry& game = monitor_bin->index.back();
+      game.length = time_alive;
+      game.reward_sum = reward_sum;
+      game.seconds = get_time() - t0;
+      monitor_bin->out->flush();
+    }
+    if (!monitor_csv)
+      return;
+    monitor_csv->printf("episode_over,%0.1f,%i,%0.1f\n", reward_sum, time_alive, get_time() - t0);
+    monitor_csv->flush();
+  }
+
+  void reset(int spawn_n) {
+    x = maze->spawnpos[0];
+    y = maze->spawnpos[1];
+    action_dx = 0;
+    action_dy = 0;
+    time_alive = 0;
+    reward_sum = 0;
+    vx = vy = spring = 0;
+    is_facing_right = true;
+  }
+
+  void event(int kind, float ex, float ey)
+  {
+    events.push(kind, ex, ey);
+    frame_events |= 1u << kind;
+  }
+
+  void eat_coin(int x, int y)
+  {
+    int obj = maze->get_elem(x, y);
+
+    if (is_lethal(obj)) {
+      if (!is_killed)
+        event(EVENT_KILLED, x, y);
+      maze->is_terminated = true;
+      is_killed = true;
+      killed_animation_frame_cnt = DEATH_ANIM_LENGTH;
+    }
+
+    if (is_coin(obj)) {
+      maze->edit_elem(x, y, SPACE);
+      maze->coins -= 1;
+      collected_coin = true;
+      event(EVENT_COIN, x, y);
+      if (power_up_mode)
+        power_up_mode = false;
+
+      if (maze->coins == 0) {
+        reward += 10.0f;
+        reward_sum += 10.0f;
+        maze->is_terminated = true;
+        finished_level_frame_cnt = FINISHED_LEVEL_ANIM_LENGTH;
+      } else {
+        reward += 1.0f;
+        reward_sum += 1.0f;
+      }
+    }
+
+    if (is_gem(obj)) {
+      maze->edit_elem(x, y, SPACE);
+      reward += 1.0f;
+      reward_sum += 1.0f;
+      power_up_mode = true;
+      collected_gem = true;
+      event(EVENT_GEM, x, y);
+    }
+
+    // the ring may drop events, the monitors must get every pickup
+    if ((is_coin(obj) || is_gem(obj)) && (monitor_csv || monitor_bin))
+      pickups.emplace_back(int16_t(x), int16_t(y));
+  }
+
+  template<int Cfg>
+  void penalize(float penalty)
+  {
+    if (Cfg & CFG_PENALTIES) {
+      reward -= penalty;
+      reward_sum -= penalty;
+    }
+  }
+
+  template<int Cfg>
+  void sub_step(float _vx, float _vy)
+  {
+    float ny = y + _vy;
+    float nx = x + _vx;
+
+    if (_vy < 0 && !maze->has_vertical_space(x, ny, false)) {
+      y = int(ny) + 1;
+      support = true;
+      vy = 0;
+
+    } else if (_vy < 0 && !maze->has_vertical_space(x, ny, true)) {
+      if (action_dy >= 0 && int(ny)!=int(y)) {
+        y = int(ny) + 1;
+        vy = 0;
+        support = true;
+      } else {  // action_dy < 0, come down from a crate
+        support = false;
+        y = ny;
+      }
+
+    } else if (_vy > 0 && !maze->has_vertical_space(x, ny + 1, false)) {
+      y = int(ny);
+      while (!maze->has_vertical_space(x, y, false)) {
+        y -= 1;
+      }
+      bumped_head = true;
+      event(EVENT_BUMPED_HEAD, x, y);
+      vy = 0;
+      penalize<Cfg>(BUMP_HEAD_PENALTY);
+
+    } else {
+      y = ny;
+    }
+
+    int ix = int(x);
+    int iy = int(y);
+    int inx = int(nx);
+
+    if (_vx < 0 && is_wall(maze->get_elem(inx, iy)) ) {
+      vx = 0;
+      x = int(inx) + 1;
+    } else if (_vx > 0 && is_wall(maze->get_elem(inx + 1, iy))) {
+      vx = 0;
+      x = int(inx);
+    } else {
+      x = nx;
+    }
+
+    eat_coin(ix, iy);
+    eat_coin(ix, iy+1);
+    eat_coin(ix+1, iy);
+    eat_coin(ix+1, iy+1);
+  }
+
+  template<int Cfg>
+  void step_coinrun()
+  {
+    support = false;
+    if (finished_level_frame_cnt > 0) {
+      action_dy = 0;
+      action_dx = 0;
+    }
+
+    int near_x = int(x + .5);
+    char test_is_ladder1 = maze->get_elem(near_x, int(y + 0.2));
+    char test_is_ladder2 = maze->get_elem(near_x, int(y - 0.2));
+
+    if (is_ladder(test_is_ladder1) || is_ladder(test_is_ladder2)) {
+      if (action_dy != 0)
+        ladder_mode = true;
+    } else {
+      ladder_mode = false;
+    }
+
+    float max_jump = maze->max_jump;
+    float max_speed = maze->max_speed;
+    float mix_rate = maze->mix_rate;
+
+    if (ladder_mode) {
+      vx = (1-LADDER_MIXRATE_X)*vx + LADDER_MIXRATE_X*max_speed*(action_dx + 0.2*(near_x - x));
+      vx = clip_abs(vx, LADDER_V);
+      vy = (1-LADDER_MIXRATE_Y)*vy + LADDER_MIXRATE_Y*max_speed*action_dy;
+      vy = clip_abs(vy, LADDER_V);
+
+    } else if (spring > 0 && vy==0 && action_dy==0) {
+      vy = max_jump;
+      penalize<Cfg>(JUMP_PENALTY);
+
+      spring = 0;
+      support = true;
+    } else {
+      vy -= maze->gravity;
+    }
+
+    vy = clip_abs(vy, max_jump);
+    vx = clip_abs(vx, max_speed);
+
+    int num_sub_steps = 2;
+    float pct = 1.0 / num_sub_steps;
+
+    for (int s = 0; s < num_sub_steps; s++) {
+      sub_step<Cfg>(vx * pct, vy * pct);
+      if (vx == 0 && vy == 0) {
+        break;
+      }
+    }
+
+    if (support) {
+      if (action_dy > 0)
+        spring += sign(action_dy) * max_jump/4; // four jump heights
+      if (action_dy < 0)
+        spring = -0.01;
+      if (action_dy == 0 && spring < 0)
+        spring = 0;
+
+      spring = clip_abs(spring, max_jump);
+      vx = (1-mix_rate)*vx;
+      if (spring==0) vx += mix_rate*max_speed*action_dx;
+      if (fabs(vx) < mix_rate*max_speed) vx = 0;
+
+    } else {
+      spring = 0;
+      float ac = maze->air_control;
+      vx = (1-ac*mix_rate)*vx + ac*mix_rate*action_dx;
+    }
+
+    if (vx < 0) {
+      is_facing_right = false;
+    } else if (vx > 0) {
+      is_facing_right = true;
+    }
+
+    if (spring != 0 && !(is_killed || ladder_mode || vy != 0)) {
+      penalize<Cfg>(SQUAT_PENALTY);
+      is_preparing_to_jump = true;
+    } else {
+      if (is_preparing_to_jump && vy != max_jump)
+        penalize<Cfg>(JITTER_SQUAT_PENALTY);
+      is_preparing_to_jump = false;
+    }
+  }
+
+  template<int Cfg>
+  void step()
+  {
+    time_alive += 1;
+    int timeout = 0;
+
+    timeout = LEVEL_TIMEOUT;
+    step_coinrun<Cfg>();
+
+    if (time_alive > timeout) {
+        maze->is_terminated = true;
+    }
+  }
+
+  int pose() const
+  {
+    if (is_killed) 
+      return POSE_HIT;
+    if (ladder_mode)
+      return (time_alive / 5 % 2 == 0) ? POSE_CLIMB1 : POSE_CLIMB2;
+    if (vy != 0)
+      return POSE_JUMP;
+    if (spring != 0)
+      return POSE_DUCK;
+    if (vx == 0)
+      return POSE_STAND;
+
+    return (time_alive / 5 % 2 == 0) ? POSE_WALK1 : POSE_WALK2;
+  }
+
+  const QImage& picture(const PlayerTheme *theme) const
+  {
+    return theme->pose(pose());
+  }
+};
+
+// -- batched agent physics --
+//
+// Agent::step() for up to AGENT_LANES agents at once. Every quantity of the scalar step
+// lives in a lane array and each branch of step_coinrun()/sub_step() becomes a select
+// between candidates computed for all lanes, with tiles gathered through per-lane grid
+// pointers, so the compiler can keep the lanes in SIMD registers. The expressions are the
+// scalar ones, float/double promotions included, and the Makefile builds with
+// -ffp-contract=off so neither path gets fused differently: results match Agent::step()
+// bit for bit.
+// Rare events (a head bump, any lethal/coin/gem tile touched, rewards) are handled one
+// lane at a time, in the same order the scalar step would.
+
+const int AGENT_LANES = 8;
+
+struct AgentLanes {
+  int n = 0;
+  Agent* agent[AGENT_LANES];
+  const uint8_t* walls[AGENT_LANES];
+  int stride[AGENT_LANES];
+
+  float x[AGENT_LANES], y[AGENT_LANES], vx[AGENT_LANES], vy[AGENT_LANES], spring[AGENT_LANES];
+  int action_dx[AGENT_LANES], action_dy[AGENT_LANES];
+  uint8_t ladder_mode[AGENT_LANES], support[AGENT_LANES];
+
+  float gravity[AGENT_LANES], max_jump[AGENT_LANES], max_speed[AGENT_LANES];
+  float mix_rate[AGENT_LANES], air_control[AGENT_LANES];
+
+  uint8_t tile(int l, int tx, int ty) const  { return walls[l][stride[l]*ty + tx]; }
+
+  bool has_vertical_space(int l, float px, float py, bool crate_counts) const
+  {
+    return !(is_wall(tile(l, px + .1, py), crate_counts) || is_wall(tile(l, px + .9, py), crate_counts));
+  }
+
+  void load(Agent* const* agents, int cnt);
+  void store();
+  template<int Cfg> void sub_step(const uint8_t* active);
+  template<int Cfg> void step();
+};
+
+void AgentLanes::load(Agent* const* agents, int cnt)
+{
+  assert(cnt <= AGENT_LANES);
+  n = cnt;
+  for (int l = 0; l < n; l++) {
+    Agent* a = agents[l];
+    Maze* maze = a->maze.get();
+    agent[l] = a;
+    walls[l] = maze->walls;
+    stride[l] = maze->stride;
+    x[l] = a->x;
+    y[l] = a->y;
+    vx[l] = a->vx;
+    vy[l] = a->vy;
+    spring[l] = a->spring;
+    action_dx[l] = a->action_dx;
+    action_dy[l] = a->action_dy;
+    ladder_mode[l] = a->ladder_mode;
+    gravity[l] = maze->gravity;
+    max_jump[l] = maze->max_jump;
+    max_speed[l] = maze->max_speed;
+    mix_rate[l] = maze->mix_rate;
+    air_control[l] = maze->air_control;
+  }
+}
+
+void AgentLanes::store()
+{
+  for (int l = 0; l < n; l++) {
+    Agent* a = agent[l];
+    a->x = x[l];
+    a->y = y[l];
+    a->vx = vx[l];
+    a->vy = vy[l];
+    a->spring = spring[l];
+    a->action_dx = action_dx[l];
+    a->action_dy = action_dy[l];
+    a->ladder_mode = ladder_mode[l];
+    a->support = support[l];
+  }
+}
+
+template<int Cfg>
+void AgentLanes::sub_step(const uint8_t* active)
+{
+  const float pct = 1.0 / 2;
+  uint8_t bump[AGENT_LANES];
+  float nx[AGENT_LANES];
+  float ny[AGENT_LANES];
+  float in_vx[AGENT_LANES];
+
+  for (int l = 0; l < n; l++) {
+    float _vx = vx[l] * pct;
+    float _vy = vy[l] * pct;
+    ny[l] = y[l] + _vy;
+    nx[l] = x[l] + _vx;
+    in_vx[l] = _vx;
+
+    bool down = _vy < 0;
+    bool solid = down && !has_vertical_space(l, x[l], ny[l], false);
+    bool crate = down && !solid && !has_vertical_space(l, x[l], ny[l], true);
+    bool land = solid || (crate && action_dy[l] >= 0 && int(ny[l]) != int(y[l]));
+    bool through = crate && !land; // action_dy < 0, come down from a crate
+    bump[l] = active[l] && _vy > 0 && !has_vertical_space(l, x[l], ny[l] + 1, false);
+
+    float landed_y = int(ny[l]) + 1;
+    if (active[l]) {
+      y[l] = land ? landed_y : ny[l];
+      vy[l] = land ? 0 : vy[l];
+      support[l] = land ? 1 : through ? 0 : support[l];
+    }
+  }
+
+  for (int l = 0; l < n; l++) {
+    if (!bump[l])
+      continue;
+    Agent* a = agent[l];
+    float by = int(ny[l]);
+    while (!has_vertical_space(l, x[l], by, false))
+      by -= 1;
+    y[l] = by;
+    a->bumped_head = true;
+    a->event(EVENT_BUMPED_HEAD, x[l], y[l]);
+    vy[l] = 0;
+    a->penalize<Cfg>(BUMP_HEAD_PENALTY);
+  }
+
+  int ix[AGENT_LANES];
+  int iy[AGENT_LANES];
+  uint8_t touched[AGENT_LANES];
+  for (int l = 0; l < n; l++) {
+    ix[l] = int(x[l]);
+    iy[l] = int(y[l]);
+    int inx = int(nx[l]);
+    bool wall_left = in_vx[l] < 0 && is_wall(tile(l, inx, iy[l]));
+    bool wall_right = !wall_left && in_vx[l] > 0 && is_wall(tile(l, inx + 1, iy[l]));
+    float stop_x = wall_left ? inx + 1 : inx;
+    if (active[l]) {
+      vx[l] = (wall_left || wall_right) ? 0 : vx[l];
+      x[l] = (wall_left || wall_right) ? stop_x : nx[l];
+    }
+    const uint8_t eatable = TILE_LETHAL | TILE_COIN | TILE_GEM;
+    touched[l] = active[l] && (
+      (TILE_PROPERTIES[tile(l, ix[l], iy[l])] |
+       TILE_PROPERTIES[tile(l, ix[l], iy[l]+1)] |
+       TILE_PROPERTIES[tile(l, ix[l]+1, iy[l])] |
+       TILE_PROPERTIES[tile(l, ix[l]+1, iy[l]+1)]) & eatable);
+  }
+
+  for (int l = 0; l < n; l++) {
+    if (!touched[l])
+      continue;
+    Agent* a = agent[l];
+    a->eat_coin(ix[l], iy[l]);
+    a->eat_coin(ix[l], iy[l]+1);
+    a->eat_coin(ix[l]+1, iy[l]);
+    a->eat_coin(ix[l]+1, iy[l]+1);
+  }
+}
+
+template<int Cfg>
+void AgentLanes::step()
+{
+  uint8_t jumped[AGENT_LANES];
+  for (int l = 0; l < n; l++) {
+    Agent* a = agent[l];
+    a->time_alive += 1;
+    support[l] = 0;
+    if (a->finished_level_frame_cnt > 0) {
+      action_dy[l] = 0;
+      action_dx[l] = 0;
+    }
+  }
+
+  for (int l = 0; l < n; l++) {
+    int near_x = int(x[l] + .5);
+    bool on_ladder = is_ladder(tile(l, near_x, int(y[l] + 0.2))) || is_ladder(tile(l, near_x, int(y[l] - 0.2)));
+    ladder_mode[l] = on_ladder ? (action_dy[l] != 0 || ladder_mode[l]) : false;
+
+    float ladder_vx = (1-LADDER_MIXRATE_X)*vx[l] + LADDER_MIXRATE_X*max_speed[l]*(action_dx[l] + 0.2*(near_x - x[l]));
+    ladder_vx = clip_abs(ladder_vx, LADDER_V);
+    float ladder_vy = (1-LADDER_MIXRATE_Y)*vy[l] + LADDER_MIXRATE_Y*max_speed[l]*action_dy[l];
+    ladder_vy = clip_abs(ladder_vy, LADDER_V);
+    bool jump = !ladder_mode[l] && spring[l] > 0 && vy[l]==0 && action_dy[l]==0;
+    float fall_vy = vy[l] - gravity[l];
+
+    vx[l] = ladder_mode[l] ? ladder_vx : vx[l];
+    vy[l] = ladder_mode[l] ? ladder_vy : jump ? max_jump[l] : fall_vy;
+    spring[l] = jump ? 0 : spring[l];
+    support[l] = jump ? 1 : support[l];
+    jumped[l] = jump;
+
+    vy[l] = clip_abs(vy[l], max_jump[l]);
+    vx[l] = clip_abs(vx[l], max_speed[l]);
+  }
+
+  for (int l = 0; (Cfg & CFG_PENALTIES) && l < n; l++) {
+    if (jumped[l])
+      agent[l]->penalize<Cfg>(JUMP_PENALTY);
+  }
+
+  uint8_t active[AGENT_LANES];
+  for (int l = 0; l < n; l++)
+    active[l] = 1;
+  for (int s = 0; s < 2; s++) {
+    sub_step<Cfg>(active);
+    for (int l = 0; l < n; l++)
+      active[l] = active[l] && !(vx[l] == 0 && vy[l] == 0);
+  }
+
+  for (int l = 0; l < n; l++) {
+    float mj = max_jump[l];
+    float ms = max_speed[l];
+    float mr = mix_rate[l];
+    int adx = action_dx[l];
+    int ady = action_dy[l];
+
+    float sp = spring[l];
+    float sp_up = sp + sign(ady) * mj/4; // four jump heights
+    sp = ady > 0 ? sp_up : sp;
+    sp = ady < 0 ? float(-0.01) : sp;
+    sp = (ady == 0 && sp < 0) ? 0 : sp;
+    sp = clip_abs(sp, mj);
+    float support_vx = (1-mr)*vx[l];
+    support_vx = sp==0 ? support_vx + mr*ms*adx : support_vx;
+    support_vx = fabs(support_vx) < mr*ms ? 0 : support_vx;
+
+    float ac = air_control[l];
+    float air_vx = (1-ac*mr)*vx[l] + ac*mr*adx;
+
+    spring[l] = support[l] ? sp : 0;
+    vx[l] = support[l] ? support_vx : air_vx;
+  }
+
+  for (int l = 0; l < n; l++) {
+    Agent* a = agent[l];
+    if (vx[l] < 0) {
+      a->is_facing_right = false;
+    } else if (vx[l] > 0) {
+      a->is_facing_right = true;
+    }
+
+    if (spring[l] != 0 && !(a->is_killed || ladder_mode[l] || vy[l] != 0)) {
+      a->penalize<Cfg>(SQUAT_PENALTY);
+      a->is_preparing_to_jump = true;
+    } else {
+      if (a->is_preparing_to_jump && vy[l] != max_jump[l])
+        a->penalize<Cfg>(JITTER_SQUAT_PENALTY);
+      a->is_preparing_to_jump = false;
+    }
+
+    if (a->time_alive > LEVEL_TIMEOUT)
+      a->maze->is_terminated = true;
+  }
+}
+
+// Steps cnt agents like calling Agent::step() on each of them in turn.
+template<int Cfg>
+static
+void agents_step(Agent* const* agents, int cnt)
+{
+  AgentLanes lanes;
+  for (int i = 0; i < cnt; i += AGENT_LANES) {
+    lanes.load(agents + i, min(AGENT_LANES, cnt - i));
+    lanes.template step<Cfg>();
+    lanes.store();
+  }
+}
+
+void Monsters::add(float mx, float my, bool flying, bool walking, int theme)
+{
+  const EnemyTheme& props = enemy_themel[theme];
+  n += 1;
+  x.push_back(mx);
+  y.push_back(my);
+  vx.push_back(0.01);
+  vy.push_back(0);
+  theme_n.push_back(theme);
+  pause.push_back(0);
+  monster_dying_frame_cnt.push_back(0);
+  is_flying.push_back(flying);
+  is_walking.push_back(walking);
+  is_dead.push_back(false);
+  max_speed.push_back(props.monster_max_speed);
+  max_jump_height.push_back(props.max_jump_height);
+  max_pause_time.push_back(props.max_pause_time);
+  is_jumping.push_back(props.is_jumping_monster);
+  can_be_killed.push_back(props.can_be_killed);
+}
+
+void Monsters::trails_reset()
+{
+  trail_head = MONSTER_TRAIL - 1;
+  trail_x.resize(MONSTER_TRAIL * n);
+  trail_y.resize(MONSTER_TRAIL * n);
+  for (int t=0; t<MONSTER_TRAIL; t++) {
+    memcpy(trail_x.data() + t*n, x.data(), n * sizeof(float));
+    memcpy(trail_y.data() + t*n, y.data(), n * sizeof(float));
+  }
+}
+
+// Once per step after the monsters have moved. Dead and ground monsters get a row too:
+// they no longer move, and their trails are never painted.
+void Monsters::push_trails()
+{
+  trail_head = (trail_head + 1) % MONSTER_TRAIL;
+  memcpy(trail_x.data() + trail_head*n, x.data(), n * sizeof(float));
+  memcpy(trail_y.data() + trail_head*n, y.data(), n * sizeof(float));
+}
+
+void Monsters::step(int i, Maze* maze, RandGen& rand_gen)
+{
+  if (!is_flying[i] && !is_walking[i])
+  return;
+  float& x = this->x[i];
+  float& y = this->y[i];
+  float& vx = this->vx[i];
+  float& vy = this->vy[i];
+  int& pause = this->pause[i];
+  float control = sign(vx);
+  int ix = int(x);
+  int iy = int(y);
+  int look_left  = maze->get_elem(ix-0, iy);
+  int look_right = maze->get_elem(ix+1, iy);
+  if (is_wall(look_left)) control = +1;
+  if (is_wall(look_right)) control = -1;
+  if (is_walking[i]) {
+    int feel_left  = maze->get_elem(ix-0, iy-1);
+    int feel_right = maze->get_elem(ix+1, iy-1);
+    if (!is_wall(feel_left)) control = +1;
+    if (!is_wall(feel_right)) control = -1;
+  }
+
+  vx = clip_abs(MONSTER_MIXRATE*control + (1-MONSTER_MIXRATE)*vx, max_speed[i]);
+
+  if (is_jumping[i]) {
+    if (vy == 0 && pause == 0) {
+      // time to jump!
+      vy = max_jump_height[i];
+    } else if (pause == 0) {
+      // falling due to gravity
+      vy -= 0.8 * maze->gravity;
+    }
+
+    float ny = y + vy;
+    if (vy < 0 && !maze->has_vertical_space(x, ny, false)) {
+      y = int(ny) + 1;
+      vy = 0;
+      // pause based on some random choice
+      pause = rand_gen.randint(0, max_pause_time[i]);
+    } 
+  }
+
+
+  if (pause > 0) {
+    pause -= 1;
+  } else {
+    x += vx;
+    y += vy;
+  }
+}
+
+struct VideoQueue;
+struct VideoFrame;
+struct VideoSink;
+
+// A generated level waiting to be swapped in by state_reset().
+struct PreparedLevel {
+  std::shared_ptr<Maze> maze;
+  int level_n = -1; // which of the env's levels, its seed comes from stream level_n
+  uint64_t rand_key = 0; // of the env it was made for, a loaded snapshot may change that
+  int level_seed = 0;
+  int agent_theme_n = 0;
+  int world_theme_n = 0;
+};
+
+struct State {
+  int state_n; // in vstate
+  std::shared_ptr<Maze> maze;
+  int world_theme_n;
+  State(const std::shared_ptr<VectorOfStates>& belongs_to):
+    belongs_to(belongs_to)  { }
+
+  QMutex state_mutex;
+   std::weak_ptr<VectorOfStates> belongs_to;
+   int time;
+   int game_id = -1;
+   Agent agent;
+
+  std::atomic<bool> agent_ready{false}; // queued for a step that hasn't completed yet
+  int home = 0; // stepping thread whose todo ring this env is queued on
+#ifdef COINRUN_STATS
+  uint64_t queued_ticks = 0; // when todo_push() queued it, for STAT_QUEUE_WAIT
+#endif
+  int action_repeat = 1; // game steps the queued action is held for, see vec_step_async_discrete_repeat(), at most MAX_ACTION_REPEAT
+
+  std::shared_ptr<VideoQueue> video;       // set when hires frames are painted asynchronously
+  std::shared_ptr<VideoSink> video_sink;   // set when hires frames are encoded in the engine
+  std::shared_ptr<VideoFrame> video_frame; // snapshot reused by synchronous painting
+
+  QMutex next_level_mutex;          // guards the five below, never held while generating
+  PreparedLevel next_level;         // made by the pregen thread, swapped in at game over
+  std::shared_ptr<Maze> spare_maze; // the level before, for the pregen thread to recycle
+  bool next_level_queued = false;
+  int levels_started = 0;           // the next reset plays level number levels_started
+  uint64_t rand_key = 0;            // set by vec_create(), see rand_stream_seed()
+
+  RandGen rand_gen;         // monster pauses, used under state_mutex
+  // Data augmentation blotches. Only painted agent frames draw from it, so how often the
+  // agent is painted (symbolic obs, rollouts without observations) doesn't touch rand_gen.
+  RandGen augment_rand_gen;
+};
+
+// -- pristine level cache --
+//
+// A level is fully determined by its seed, so with NUM_LEVELS > 0 the freshly generated
+// maze of every seed is kept, process-wide, and later resets of that seed copy it into
+// the env's existing Maze instead of running the generator again.
+
+struct PristineLevel {
+  int w, h;
+  std::vector<uint8_t> grid; // padded, as in Maze
+  int coins;
+  int spawnpos[2];
+  Monsters monsters;
+  int agent_theme_n;
+  int world_theme_n;
+
+  void restore(Maze* maze) const
+  {
+    assert(maze->w == w && maze->h == h);
+    memcpy(maze->grid, grid.data(), grid.size());
+    maze->coins = coins;
+    maze->spawnpos[0] = spawnpos[0];
+    maze->spawnpos[1] = spawnpos[1];
+    maze->init_physics();
+
+    maze->monsters = monsters; // copy assignment, reuses the arrays' capacity
+  }
+};
+
+static QReadWriteLock pristine_levels_lock;
+static std::map<int, std::shared_ptr<const PristineLevel>> pristine_levels;
+
+static
+std::shared_ptr<const PristineLevel> pristine_level_find(int level_seed)
+{
+  QReadLocker lock(&pristine_levels_lock);
+  auto f = pristine_levels.find(level_seed);
+  return f == pristine_levels.end() ? std::shared_ptr<const PristineLevel>() : f->second;
+}
+
+static
+void pristine_level_add(int level_seed, const Maze* maze, int agent_theme_n, int world_theme_n)
+{
+  std::shared_ptr<PristineLevel> level(new PristineLevel);
+  level->w = maze->w;
+  level->h = maze->h;
+  level->grid.assign(maze->grid, maze->grid + maze->grid_size());
+  level->coins = maze->coins;
+  level->spawnpos[0] = maze->spawnpos[0];
+  level->spawnpos[1] = maze->spawnpos[1];
+  level->monsters = maze->monsters;
+  level->agent_theme_n = agent_theme_n;
+  level->world_theme_n = world_theme_n;
+
+  QWriteLocker lock(&pristine_levels_lock);
+  pristine_levels.insert(std::make_pair(level_seed, level));
+}
+
+// The old Maze when nothing else holds on to it, otherwise a new one.
+static
+std::shared_ptr<Maze> reusable_maze(std::shared_ptr<Maze>& old, int w, int h)
+{
+  std::shared_ptr<Maze> maze;
+  maze.swap(old);
+  if (maze && maze.unique() && maze->w == w && maze->h == h) {
+    maze->is_terminated = false;
+    maze->is_new_level = true;
+    maze->coins = 0;
+    maze->edits.clear();
+    maze->level_grid.reset();
+    maze->layout_n = maze_layout_seq++;
+    return maze; // monsters are replaced by the generator or PristineLevel::restore
+  }
+  return std::shared_ptr<Maze>(new Maze(w, h));
+}
+
+static
+void monitor_bin_game_start(MetaLog* log, const std::shared_ptr<State>& state, int level_seed)
+{
+  const Agent& agent = state->agent;
+  const std::shared_ptr<Maze>& maze = state->maze;
+
+  MetaIndexEntry game;
+  memset(&game, 0, sizeof(game));
+  game.game_id = state->game_id;
+  game.n_monsters = maze->monsters.size();
+  game.offset = log->out->size();
+  game.length = -1;
+  log->index.push_back(game);
+  log->n_coins = 0;
+
+  MetaGameHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.tag, "GAME", 4);
+  h.game_id = state->game_id;
+  h.level_seed = level_seed;
+  h.zoom = agent.zoom;
+  h.world_theme_n = state->world_theme_n;
+  h.agent_theme_n = agent.theme_n;
+  h.maze_w = maze->w;
+  h.maze_h = maze->h;
+  h.n_monsters = game.n_monsters;
+  log->put(h);
+
+  std::string tiles((maze->w*maze->h + 7) / 8 * 8, '\0');
+  for (int y=0; y<maze->h; y++)
+    for (int x=0; x<maze->w; x++)
+      tiles[y*maze->w + x] = char(maze->get_elem(x, y));
+  log->out->append(tiles);
+}
+
+// Records the agent and monsters after a step, together with the coins it ate.
+static
+void monitor_bin_save_frame(const std::shared_ptr<State>& state, const Agent* agent)
+{
+  MetaLog* log = agent->monitor_bin.get();
+  if (!log || log->index.empty())
+    return;
+  const std::shared_ptr<Maze>& maze = agent->maze;
+
+  MetaFrame fr;
+  memset(&fr, 0, sizeof(fr));
+  fr.time_alive = agent->time_alive;
+  fr.state_time = state->time;
+  fr.x = agent->x;
+  fr.y = agent->y;
+  fr.vx = agent->vx;
+  fr.vy = agent->vy;
+  fr.spring = agent->spring;
+  fr.killed_animation_frame_cnt = agent->killed_animation_frame_cnt;
+  fr.finished_level_frame_cnt = agent->finished_level_frame_cnt;
+  fr.flags =
+    (agent->is_facing_right ? META_FACING_RIGHT : 0) |
+    (agent->ladder_mode ? META_LADDER : 0) |
+    (agent->is_killed ? META_KILLED : 0) |
+    (agent->killed_monster ? META_KILLED_MONSTER : 0) |
+    (agent->bumped_head ? META_BUMPED_HEAD : 0) |
+    (agent->collected_coin ? META_COLLECTED_COIN : 0) |
+    (agent->collected_gem ? META_COLLECTED_GEM : 0) |
+    (agent->power_up_mode ? META_POWER_UP : 0);
+  fr.n_coins = log->n_coins;
+  memcpy(fr.coins, log->coins, sizeof(fr.coins));
+  log->n_coins = 0;
+  log->put(fr);
+
+  const Monsters& ms = maze->monsters;
+  for (int i = 0; i < ms.n; i++) {
+    const EnemyTheme& theme = enemy_themel[ms.theme_n[i]];
+    MetaMonster mm;
+    mm.x = ms.x[i];
+    mm.y = ms.y[i];
+    mm.vx = ms.vx[i];
+    mm.vy = ms.vy[i];
+    mm.monster_dying_frame_cnt = ms.monster_dying_frame_cnt[i];
+    mm.theme_n = int16_t(ms.theme_n[i]);
+    mm.flags =
+      (ms.is_flying[i] ? META_MONSTER_FLYING : 0) |
+      (ms.is_walking[i] ? META_MONSTER_WALKING : 0) |
+      (ms.is_jumping[i] ? META_MONSTER_JUMPING : 0) |
+      (ms.is_dead[i] ? META_MONSTER_DEAD : 0);
+    mm.anim_freq = uint8_t(theme.anim_freq);
+    log->put(mm);
+  }
+  log->index.back().n_frames++;
+}
+
+static
+int level_seed_choose(RandGen& rand_gen)
+{
+  if (USE_LEVEL_SET) {
+    int level_index = rand_gen.randint(0, NUM_LEVELS);
+    return LEVEL_SEEDS[level_index];
+  } else if (NUM_LEVELS > 0) {
+    return rand_gen.randint(0, NUM_LEVELS);
+  } else {
+    return rand_gen.randint();
+  }
+}
+
+// Picks the seed of the env's level level_n and builds that level in (when possible)
+// the recycled maze. The seed depends only on rand_key and level_n, so whether the
+// pregen thread or the reset itself gets here first makes no difference.
+static
+void level_generate(PreparedLevel* level, uint64_t rand_key, int level_n, std::shared_ptr<Maze>& recycle)
+{
+  int w = 64;
+  int h = 13;
+  RandGen level_rand;
+  level_rand.seed(rand_stream_seed(rand_key, level_n));
+  level->level_n = level_n;
+  level->rand_key = rand_key;
+  level->level_seed = level_seed_choose(level_rand);
+  level->maze = reusable_maze(recycle, w, h);
+
+  // with a fixed level set the same few mazes come up over and over again
+  std::shared_ptr<const PristineLevel> pristine;
+  if (NUM_LEVELS > 0)
+    pristine = pristine_level_find(level->level_seed);
+  if (pristine) {
+    pristine->restore(level->maze.get());
+    level->agent_theme_n = pristine->agent_theme_n;
+    level->world_theme_n = pristine->world_theme_n;
+  } else {
+    // one generator per thread, its scratch vectors survive between resets
+    static thread_local RandomMazeGenerator maze_gen;
+    maze_gen.begin(level->level_seed, level->maze);
+
+    maze_gen.initial_floor_and_walls();
+
+    maze_gen.generate_coins_on_platforms();
+
+    level->agent_theme_n = maze_gen.randn(player_themesl.size());
+    level->world_theme_n = maze_gen.randn(ground_themes.size());
+    maze_gen.end();
+    if (NUM_LEVELS > 0)
+      pristine_level_add(level->level_seed, level->maze.get(), level->agent_theme_n, level->world_theme_n);
+  }
+}
+
+void state_reset(const std::shared_ptr<State>& state)
+{
+  assert(player_themesl.size() > 0 && "Please call init(threads) first");
+
+  Agent &agent = state->agent;
+  std::shared_ptr<Maze> old_maze;
+  old_maze.swap(state->maze);
+  if (agent.maze == old_maze)
+    agent.maze.reset();
+
+  PreparedLevel level;
+  int level_n;
+  uint64_t rand_key;
+  {
+    QMutexLocker lock(&state->next_level_mutex);
+    level_n = state->levels_started++;
+    rand_key = state->rand_key;
+    if (state->next_level.maze && state->next_level.level_n == level_n && state->next_level.rand_key == rand_key) {
+      level = std::move(state->next_level);
+      state->next_level = PreparedLevel();
+      state->spare_maze.swap(old_maze);
+    }
+  }
+  if (!level.maze)
+    level_generate(&level, rand_key, level_n, old_maze); // nothing prepared yet, generate inline
+
+  int level_seed = level.level_seed;
+  int w = level.maze->w;
+  int h = level.maze->h;
+  state->maze = level.maze;
+  agent.theme_n = level.agent_theme_n;
+  state->world_theme_n = level.world_theme_n;
+
+  float zoom = state->maze->default_zoom;
+  agent.maze = state->maze;
+  agent.zoom = zoom;
+  agent.target_zoom = zoom;
+
+  agent.reset(0);
+
+  state->maze->is_terminated = false;
+  state->agent.is_killed = false;
+  state->agent.is_preparing_to_jump = false;
+  state->agent.killed_monster = false;
+  state->agent.bumped_head = false;
+  state->agent.frame_events = 0;
+  state->agent.killed_animation_frame_cnt = 0;
+  state->agent.finished_level_frame_cnt = 0;
+  state->agent.power_up_mode = false;
+  state->time = 0;
+  state->game_id += 1;
+
+  if (agent.monitor_bin)
+    monitor_bin_game_start(agent.monitor_bin.get(), state, level_seed);
+  if (!agent.monitor_csv)
+    return;
+  agent.monitor_csv->printf("game_id,maze_seed,zoom,world_theme_n,agent_theme_n\n%i,%i,%g,%i,%i\n",
+    state->game_id, level_seed, agent.zoom, state->world_theme_n, agent.theme_n);
+  std::string dump;
+  dump.reserve(2*w*h + 2);
+  for (int y=0; y<h; y++) {
+    for (int x=0; x<w; x++) {
+      dump += char(state->maze->get_elem(x, y));
+      dump += ',';
+    }
+  }
+  dump += "\n\n";
+  agent.monitor_csv->append(dump);
+}
+
+// -- level pregeneration --
+//
+// Every env keeps one level generated ahead of time by a low priority thread, so
+// a game over costs the step only a swap instead of generator time.
+
+static QMutex level_pregen_mutex;
+static QWaitCondition level_pregen_wake;
+static std::deque<std::weak_ptr<State>> level_pregen_todo; // under level_pregen_mutex
+static std::shared_ptr<QThread> level_pregen;
+
+static
+void level_pregen_request(const std::shared_ptr<State>& state)
+{
+  if (!level_pregen)
+    return;
+  {
+    QMutexLocker lock(&state->next_level_mutex);
+    if (state->next_level_queued || state->next_level.maze)
+      return;
+    state->next_level_queued = true;
+  }
+  QMutexLocker lock(&level_pregen_mutex);
+  level_pregen_todo.push_back(state);
+  level_pregen_wake.wakeOne();
+}
+
+static
+void level_pregen_thread()
+{
+  while (1) {
+    std::shared_ptr<State> state;
+    {
+      QMutexLocker lock(&level_pregen_mutex);
+      while (level_pregen_todo.empty() && !shutdown_flag)
+        level_pregen_wake.wait(&level_pregen_mutex, 1000); // milliseconds
+      if (shutdown_flag)
+        return;
+      state = level_pregen_todo.front().lock();
+      level_pregen_todo.pop_front();
+    }
+    if (!state)
+      continue;
+
+    std::shared_ptr<Maze> recycle;
+    int level_n;
+    uint64_t rand_key;
+    {
+      QMutexLocker lock(&state->next_level_mutex);
+      recycle.swap(state->spare_maze);
+      level_n = state->levels_started;
+      rand_key = state->rand_key;
+    }
+    PreparedLevel level;
+    level_generate(&level, rand_key, level_n, recycle);
+    bool stale;
+    {
+      QMutexLocker lock(&state->next_level_mutex);
+      // the env may have reset meanwhile and made this level itself, then try the next;
+      // or loaded a snapshot of another env, whose levels come from another key
+      stale = level_n != state->levels_started || rand_key != state->rand_key;
+      if (stale) {
+        if (!state->spare_maze)
+          state->spare_maze = level.maze;
+      } else {
+        state->next_level = std::move(level);
+      }
+      state->next_level_queued = false;
+    }
+    if (stale)
+      level_pregen_request(state);
+  }
+}
+
+class LevelPregenThread : public QThread {
+public:
+  void run() { level_pregen_thread(); }
+};
+
+// -- snapshots --
+//
+// A snapshot holds what play changes in an env: the agent, the monsters, time, the
+// random streams and the tiles eaten. The level itself is shared with the maze it came
+// from (see Maze::edits), so forking a game costs a few hundred bytes, not a level.
+
+#define SNAPSHOT_AGENT_FIELDS(X) \
+  X(theme_n) X(x) X(y) X(vx) X(vy) X(spring) X(zoom) X(target_zoom) \
+  X(game_over) X(reward) X(reward_sum) X(is_facing_right) X(ladder_mode) \
+  X(action_dx) X(action_dy) X(time_alive) X(is_killed) X(is_preparing_to_jump) \
+  X(killed_monster) X(bumped_head) X(killed_animation_frame_cnt) \
+  X(finished_level_frame_cnt) X(power_up_mode) X(collected_coin) X(collected_gem) \
+  X(frame_events) X(support)
+
+#define SNAPSHOT_MAZE_FIELDS(X) \
+  X(coins) X(is_terminated) X(gravity) X(max_jump) X(air_control) X(max_dy) \
+  X(max_dx) X(default_zoom) X(max_speed) X(mix_rate)
+
+struct Snapshot {
+#define X(f) decltype(Agent::f) agent_##f;
+  SNAPSHOT_AGENT_FIELDS(X)
+#undef X
+#define X(f) decltype(Maze::f) maze_##f;
+  SNAPSHOT_MAZE_FIELDS(X)
+#undef X
+  int w, h;
+  int spawnpos[2];
+  std::shared_ptr<const std::vector<uint8_t>> level_grid;
+  std::vector<Maze::TileEdit> edits;
+  Monsters monsters;
+
+  int world_theme_n;
+  int time;
+  int levels_started;
+  uint64_t rand_key; // copied as well, so that a fork plays on exactly like the original
+  RandGen rand_gen;
+  RandGen augment_rand_gen;
+};
+
+// Both under state_mutex, between steps.
+static
+void state_snapshot_save(Snapshot* snap, State* state)
+{
+  Agent& agent = state->agent;
+  Maze* maze = state->maze.get();
+  if (!maze->level_grid) {
+    std::vector<uint8_t>* level_grid = new std::vector<uint8_t>(maze->grid, maze->grid + maze->grid_size());
+    for (size_t i = maze->edits.size(); i-- > 0; )
+      (*level_grid)[maze->edits[i].offset] = maze->edits[i].before;
+    maze->level_grid.reset(level_grid);
+  }
+
+#define X(f) snap->agent_##f = agent.f;
+  SNAPSHOT_AGENT_FIELDS(X)
+#undef X
+#define X(f) snap->maze_##f = maze->f;
+  SNAPSHOT_MAZE_FIELDS(X)
+#undef X
+  snap->w = maze->w;
+  snap->h = maze->h;
+  snap->spawnpos[0] = maze->spawnpos[0];
+  snap->spawnpos[1] = maze->spawnpos[1];
+  snap->level_grid = maze->level_grid;
+  snap->edits = maze->edits;
+  snap->monsters = maze->monsters;
+
+  snap->world_theme_n = state->world_theme_n;
+  snap->time = state->time;
+  {
+    QMutexLocker lock(&state->next_level_mutex);
+    snap->levels_started = state->levels_started;
+    snap->rand_key = state->rand_key;
+  }
+  snap->rand_gen = state->rand_gen;
+  snap->augment_rand_gen = state->augment_rand_gen;
+}
+
+static
+void state_snapshot_load(const std::shared_ptr<State>& state, const Snapshot& snap)
+{
+  Agent& agent = state->agent;
+  Maze* maze = state->maze.get();
+  size_t kept = 0;
+  if (maze->level_grid == snap.level_grid) {
+    // same level, only redo the edits after the point where the two games went apart
+    while (kept < maze->edits.size() && kept < snap.edits.size() &&
+      maze->edits[kept].offset == snap.edits[kept].offset &&
+      maze->edits[kept].after == snap.edits[kept].after)
+      kept++;
+    for (size_t i = maze->edits.size(); i-- > kept; )
+      maze->grid[maze->edits[i].offset] = maze->edits[i].before;
+  } else {
+    if (maze->w != snap.w || maze->h != snap.h) {
+      agent.maze.reset();
+      state->maze.reset(new Maze(snap.w, snap.h));
+      agent.maze = state->maze;
+      maze = state->maze.get();
+    }
+    memcpy(maze->grid, snap.level_grid->data(), maze->grid_size());
+    maze->level_grid = snap.level_grid;
+    maze->layout_n = maze_layout_seq++;
+    maze->is_new_level = true;
+  }
+  maze->edits.resize(kept);
+  for (size_t i = kept; i < snap.edits.size(); i++) {
+    maze->grid[snap.edits[i].offset] = snap.edits[i].after;
+    maze->edits.push_back(snap.edits[i]);
+  }
+
+#define X(f) agent.f = snap.agent_##f;
+  SNAPSHOT_AGENT_FIELDS(X)
+#undef X
+#define X(f) maze->f = snap.maze_##f;
+  SNAPSHOT_MAZE_FIELDS(X)
+#undef X
+  maze->spawnpos[0] = snap.spawnpos[0];
+  maze->spawnpos[1] = snap.spawnpos[1];
+  maze->monsters = snap.monsters;
+
+  state->world_theme_n = snap.world_theme_n;
+  state->time = snap.time;
+  state->rand_gen = snap.rand_gen;
+  state->augment_rand_gen = snap.augment_rand_gen;
+  {
+    QMutexLocker lock(&state->next_level_mutex);
+    state->levels_started = snap.levels_started;
+    state->rand_key = snap.rand_key;
+    if (state->next_level.maze &&
+        (state->next_level.level_n != state->levels_started || state->next_level.rand_key != state->rand_key)) {
+      if (!state->spare_maze)
+        state->spare_maze = state->next_level.maze;
+      state->next_level = PreparedLevel();
+    }
+  }
+  level_pregen_request(state);
+}
+
+// Snapshots are kept by handle, see vec_snapshot_save() in the C API below.
+static QMutex snapshots_mutex;
+static std::map<int, std::shared_ptr<Snapshot>> snapshots;
+static int snapshot_seq = 1;
+
+// -- static level layer --
+//
+// Walls, coins and every other tile only change through Maze::edit_elem(), so agent
+// frames don't paint them one by one. They are painted once per level into a layer
+// covering the whole level, patched cell by cell as edits come in (or are rewound by a
+// snapshot load), and a frame draws the visible crop of it. Lava scrolls, so it is
+// still painted every frame, after the layer. At agent frame zoom a cell is a whole
+// number of pixels, so tiles land where they would have landed painted one by one;
+// only the one pixel overlaps next to lava can come out differently.
+
+struct StaticLayer {
+  uint64_t layout_n = 0;             // Maze::layout_n painted
+  std::vector<Maze::TileEdit> edits; // Maze::edits painted over that
+  const void* themes = 0;            // what the tiles were painted with
+  int world_theme_n = -1;
+  int kx = 0, ky = 0;                // cell size in pixels
+  int tile_w = 0, tile_h = 0;        // tiles may overlap the cells right and below
+  int maze_w = 0, maze_h = 0;
+  int w = 0, h = 0;
+  std::vector<uint32_t> px;          // w x h, base where no tile is
+  std::vector<int> lava;             // cells y*maze_w + x, in painting order
+};
+
+static inline
+bool is_lava(int wkey)
+{
+  return wkey==LAVA_MIDDLE || wkey==LAVA_SURFACE;
+}
+
+// Pixels of the tile of cell (x, y). Rows go down the layer while y goes up the maze.
+static
+QRect static_layer_cell_rect(const StaticLayer* l, int x, int y)
+{
+  int x0 = l->kx * x;
+  int y0 = l->ky * (l->maze_h - 1 - y);
+  return QRect(x0, y0, min(l->tile_w, l->w - x0), min(l->tile_h, l->h - y0));
+}
+
+// The cells whose tiles overlap r: x in [*x0, *x1), y in [*y0, *y1).
+static
+void static_layer_cells(const StaticLayer* l, const QRect& r, int* x0, int* x1, int* y0, int* y1)
+{
+  *x0 = max(0, int(floor(double(r.left() - l->tile_w) / l->kx)) + 1);
+  *x1 = min(l->maze_w, (r.left() + r.width() - 1) / l->kx + 1);
+  int row0 = max(0, int(floor(double(r.top() - l->tile_h) / l->ky)) + 1);
+  int row1 = min(l->maze_h, (r.top() + r.height() - 1) / l->ky + 1);
+  *y0 = l->maze_h - row1;
+  *y1 = l->maze_h - row0;
+}
+
+// Brings l up to date with maze. paint(r) is called after r has been reset to base,
+// and draws the tiles of static_layer_cells(r) in painting order, clipped to r. A new
+// level, other themes or another cell size repaint everything, edits only their cells.
+template<typename PaintRect>
+static
+void static_layer_sync(
+  StaticLayer* l, Maze* maze, const void* themes, int world_theme_n,
+  int kx, int ky, int tile_w, int tile_h, uint32_t base, PaintRect paint)
+{
+  auto reset = [&](const QRect& r) {
+    for (int y = r.top(); y < r.top() + r.height(); y++)
+      std::fill(&l->px[size_t(y) * l->w + r.left()], &l->px[size_t(y) * l->w + r.left() + r.width()], base);
+    paint(r);
+  };
+
+  bool repaint = l->layout_n != maze->layout_n || l->themes != themes || l->world_theme_n != world_theme_n ||
+    l->kx != kx || l->ky != ky || l->tile_w != tile_w || l->tile_h != tile_h ||
+    l->maze_w != maze->w || l->maze_h != maze->h;
+  size_t kept = 0;
+  if (!repaint) {
+    while (kept < l->edits.size() && kept < maze->edits.size() &&
+      l->edits[kept].offset == maze->edits[kept].offset &&
+      l->edits[kept].after == maze->edits[kept].after)
+      kept++;
+    if (kept == l->edits.size() && kept == maze->edits.size())
+      return;
+    // the lava list stays valid unless lava itself was edited
+    for (const std::vector<Maze::TileEdit>* v: { &l->edits, &maze->edits })
+      for (size_t i = kept; i < v->size(); i++)
+        repaint |= is_lava((*v)[i].before) || is_lava((*v)[i].after);
+  }
+
+  if (repaint) {
+    l->layout_n = maze->layout_n;
+    l->themes = themes;
+    l->world_theme_n = world_theme_n;
+    l->kx = kx;
+    l->ky = ky;
+    l->tile_w = tile_w;
+    l->tile_h = tile_h;
+    l->maze_w = maze->w;
+    l->maze_h = maze->h;
+    l->w = kx * (maze->w - 1) + tile_w;
+    l->h = ky * (maze->h - 1) + tile_h;
+    l->px.resize(size_t(l->w) * l->h);
+    l->lava.clear();
+    for (int y = 0; y < maze->h; y++)
+      for (int x = 0; x < maze->w; x++)
+        if (is_lava(maze->get_elem(x, y)))
+          l->lava.push_back(y * maze->w + x);
+    l->edits = maze->edits;
+    reset(QRect(0, 0, l->w, l->h));
+    return;
+  }
+
+  // the grid is already final, so undone and new edits alike just repaint their cell
+  for (const std::vector<Maze::TileEdit>* v: { &l->edits, &maze->edits })
+    for (size_t i = kept; i < v->size(); i++) {
+      int offset = (*v)[i].offset;
+      reset(static_layer_cell_rect(l, offset % maze->stride - MAZE_PAD, offset / maze->stride - MAZE_PAD));
+    }
+  l->edits = maze->edits;
+}
+
+static
+StaticLayer* agent_static_layer(const Agent* agent)
+{
+  if (!agent->agent_layer)
+    agent->agent_layer.reset(new StaticLayer());
+  return agent->agent_layer.get();
+}
+
+// -- render --
+
+static
+int to_shade(float f)
+{
+  int shade = int(f * 255);
+  if (shade < 0) shade = 0;
+  if (shade > 255) shade = 255;
+  return shade;
+}
+
+template<int Cfg>
+static
+void paint_the_world_for_agent(
+  QPainter& p, const QRect& rect,
+  const std::shared_ptr<State>& state, const Agent* agent)
+{
+  // This function paints the 64x64 frame that is input for the agent. Some notable differences
+  // between this frame and the video frame are resolution (64x64 vs 1024x1024), monsters have
+  // trails in this frame so the agent knows their direction, a velocity patch is placed in the
+  // corner of the agent frame so it knows its own velocity. 
+
+  const double zoom = AGENT_FRAME_ZOOM;
+  const double bgzoom = 0.4;
+
+  bool lowres = rect.height() < 200;
+
+  std::shared_ptr<Maze> maze = agent->maze;
+
+  double kx = zoom * rect.width()  / double(64);  // not w!
+  double ky = zoom * rect.height() / double(64);
+  double dx = (-agent->x) * kx + rect.center().x()  - 0.5*kx;
+  double dy = (agent->y) * ky - rect.center().y()   - 0.5*ky;
+
+  ScaledThemes* themes = find_scaled_themes(agent->agent_themes, lowres, kx, ky);
+  const GroundTheme* ground_theme = choose_ground_theme(themes, state->world_theme_n);
+
+  p.setRenderHint(QPainter::Antialiasing, true);
+  p.setRenderHint(QPainter::SmoothPixmapTransform, true);
+  p.setRenderHint(QPainter::HighQualityAntialiasing, true);
+
+  for (int tile_x=-1; tile_x<=2; tile_x++) {
+    for (int tile_y=-1; tile_y<=1; tile_y++) {
+      double zx = rect.width()*zoom;   // / bgzoom;
+      double zy = rect.height()*zoom;  // / bgzoom);
+      QRectF bg_image = QRectF(0, 0, zx, zy);
+      bg_image.moveCenter(QPointF(
+        zx*tile_x + rect.center().x() + bgzoom*(dx + kx*maze->h/2),
+        zy*tile_y + rect.center().y() + bgzoom*(dy - ky*maze->h/2)
+        ));
+
+      p.fillRect(bg_image, QColor(30, 30, 30));
+      
+    }
+  }
+
+  int radius = int(1 + 64 / zoom);  // actually /2 works except near scroll limits
+  int ix = int(agent->x + .5);
+  int iy = int(agent->y + .5);
+  int x_start = max(ix - radius, 0);
+  int x_end = min(ix + radius + 1, maze->w);
+  int y_start = max(iy - radius, 0);
+  int y_end = min(iy + radius + 1, maze->h);
+  double WINH = rect.height();
+
+  // whole pixel cells at RES_W x RES_H and AGENT_FRAME_ZOOM, see static_layer_sync()
+  assert(kx == int(kx) && ky == int(ky));
+  StaticLayer* layer = agent_static_layer(agent);
+  static_layer_sync(layer, maze.get(), themes, state->world_theme_n, int(kx), int(ky), themes->tile_w, themes->tile_h, 0,
+    [&](const QRect& r) {
+      QImage img((uchar*)layer->px.data(), layer->w, layer->h, layer->w * 4, QImage::Format_ARGB32_Premultiplied);
+      QPainter lp(&img);
+      lp.setClipRect(r);
+      int x0, x1, y0, y1;
+      static_layer_cells(layer, r, &x0, &x1, &y0, &y1);
+      for (int y=y0; y<y1; ++y) {
+        for (int x=x0; x<x1; x++) {
+          int wkey = maze->get_elem(x, y);
+          if (wkey==SPACE || is_lava(wkey)) continue;
+
+          auto f = ground_theme->walls.find(wkey);
+          const QImage& tile = f == ground_theme->walls.end() ? ground_theme->default_wall : f->second;
+          lp.drawImage(QPoint(layer->kx * x, layer->ky * (layer->maze_h - 1 - y)), tile);
+        }
+      }
+    });
+  // at the offset of tile (0, 0) if painted by itself, tiles overlap by -0.1 to hide seams
+  QImage layer_img((const uchar*)layer->px.data(), layer->w, layer->h, layer->w * 4, QImage::Format_ARGB32_Premultiplied);
+  p.drawImage(QPointF(dx - 0.1, WINH - ky*(maze->h - 1) + dy - 0.1), layer_img);
+
+  for (int cell: layer->lava) {
+    int x = cell % maze->w;
+    int y = cell / maze->w;
+    if (x < x_start || x >= x_end || y < y_start || y >= y_end) continue;
+    int wkey = maze->get_elem(x, y);
+    auto f = ground_theme->walls.find(wkey);
+    const QImage& img = f == ground_theme->walls.end() ? ground_theme->default_wall : f->second;
+    QPointF dst(kx*x + dx - 0.1, WINH - ky*y + dy - 0.1);
+    float tr = state->time*0.1;
+    tr -= int(tr);
+    draw_scrolling_tile(p, dst, img, tr);
+  }
+
+  const PlayerTheme* active_theme = choose_player_theme(themes, agent->theme_n, agent->is_facing_right, agent->power_up_mode);
+  const QImage& img = agent->picture(active_theme);
+  p.drawImage(QPointF(kx * agent->x + dx, WINH - ky * (agent->y+1) + dy), img);
+
+  Monsters& ms = maze->monsters;
+  int monsters_count = ms.size();
+  for (int i=0; i<monsters_count; ++i) {
+    QPointF dst(kx*ms.x[i] + dx, WINH - ky*ms.y[i] + dy);
+
+    const EnemyTheme* theme = choose_enemy_theme(themes, ms.theme_n[i], ms.vx[i]>0);
+    if ((ms.is_flying[i] || ms.is_walking[i]) && !ms.is_dead[i]) {
+      for (int t=2; t<MONSTER_TRAIL; t+=2) {
+        QRectF dst = QRectF(kx*ms.prev_x(i, t) + dx, WINH - ky*ms.prev_y(i, t) + dy, kx, ky);
+        float ft = 1 - float(t)/MONSTER_TRAIL;
+        float smaller = 0.20;
+        float lower = -0.22;
+        float soar = -0.4;
+        dst.adjust(
+          (smaller-0.2*ft)*kx, (soar*ft-0.2*ft-lower+smaller)*ky,
+          (-smaller+0.2*ft)*kx, (soar*ft+0.2*ft-lower-smaller)*ky);
+        p.setBrush(QColor(255,255,255, t*127/MONSTER_TRAIL));
+        p.setPen(Qt::NoPen);
+        p.drawEllipse(dst);
+      }
+    }
+    if (ms.is_dead[i]) {
+      // the shrinking death animation is the one sprite that still gets resampled
+      int& dying_cnt = ms.monster_dying_frame_cnt[i];
+      dying_cnt = max(0, dying_cnt);
+      double monster_shrinkage = (MONSTER_DEATH_ANIM_LENGTH - dying_cnt) * 0.8 / MONSTER_DEATH_ANIM_LENGTH;
+      p.drawImage(QRectF(kx*ms.x[i] + dx, WINH - ky*ms.y[i] + dy + ky * monster_shrinkage, kx, ky * (1 - monster_shrinkage)), theme->dead);
+      dying_cnt -= 1;
+    } else if (theme->is_jumping_monster) {
+      p.drawImage(dst, ms.vy[i] == 0 ? theme->walk1 : theme->walk2);
+    } else {
+      p.drawImage(dst, state->time / theme->anim_freq % 2 == 0 ? theme->walk1 : theme->walk2);
+    }
+  }
+
+  if (Cfg & CFG_AUGMENT) {
+    float max_rand_dim = .25;
+    float min_rand_dim = .1;
+    int num_blotches = state->augment_rand_gen.randint(0, 6);
+
+    bool hard_blotches = false;
+
+    if (hard_blotches) {
+      max_rand_dim = .3;
+      min_rand_dim = .2;
+      num_blotches = state->augment_rand_gen.randint(0, 10);
+    }
+
+    for (int j = 0; j < num_blotches; j++) {
+      float rx = state->augment_rand_gen.rand01() * rect.width();
+      float ry = state->augment_rand_gen.rand01() * rect.height();
+      float rdx = (state->augment_rand_gen.rand01() * max_rand_dim + min_rand_dim) * rect.width();
+      float rdy = (state->augment_rand_gen.rand01() * max_rand_dim + min_rand_dim) * rect.height();
+
+      QRectF dst3 = QRectF(rx, ry, rdx, rdy);
+      p.fillRect(dst3, QColor(state->augment_rand_gen.randint(0, 255), state->augment_rand_gen.randint(0, 255), state->augment_rand_gen.randint(0, 255)));
+    }
+  }
+
+  if (Cfg & CFG_VEL_INFO) {
+    float infodim = rect.height() * .2;
+    QRectF dst2 = QRectF(0, 0, infodim, infodim);
+    int s0 = to_shade(agent->spring / maze->max_jump);
+    int s1 = to_shade(.5 * agent->vx / maze->max_speed + .5);
+    int s2 = to_shade(.5 * agent->vy / maze->max_jump + .5);
+    p.fillRect(dst2, QColor(s1, s1, s1));
+
+    QRectF dst3 = QRectF(infodim, 0, infodim, infodim);
+    p.fillRect(dst3, QColor(s2, s2, s2));
+  }
+}
+
+// -- fast agent renderer --
+//
+// Optional replacement for paint_the_world_for_agent, enabled by USE_FAST_AGENT_RENDER.
+// At 64x64 a tile covers exactly 5x5 pixels, so instead of setting up a QPainter and
+// going through its smooth scaling paths every step, every sprite is kept pre-scaled
+// to its on-screen size in premultiplied ARGB32 and blitted at the nearest integer
+// offset. Output layout matches QImage::Format_RGB32.
+
+struct FastSprite {
+  int w = 0;
+  int h = 0;
+  std::vector<uint32_t> px; // premultiplied ARGB32, row-major
+};
+
+struct FastGroundTheme {
+  FastSprite walls[256]; // indexed by tile char, default_wall for unthemed tiles
+};
+
+struct FastPlayerTheme {
+  FastSprite poses[POSE_COUNT];
+  FastSprite poses_power_up[POSE_COUNT];
+};
+
+struct FastEnemyTheme {
+  FastSprite walk1;
+  FastSprite walk2;
+  FastSprite dead;
+};
+
+static std::vector<FastGroundTheme> fast_ground_themes;
+static std::vector<FastPlayerTheme> fast_player_themesl;
+static std::vector<FastPlayerTheme> fast_player_themesr;
+static std::vector<FastEnemyTheme> fast_enemy_themel;
+static std::vector<FastEnemyTheme> fast_enemy_themer;
+
+static
+FastSprite fast_sprite(const QImage& img, int w, int h)
+{
+  FastSprite s;
+  s.w = w;
+  s.h = h;
+  s.px.resize(w * h);
+  QImage scaled = img.scaled(w, h, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+    .convertToFormat(QImage::Format_ARGB32_Premultiplied);
+  for (int y = 0; y < h; y++)
+    memcpy(&s.px[y * w], scaled.constScanLine(y), w * 4);
+  return s;
+}
+
+// same channel rotation the QPainter path applies to the player in power_up_mode
+static
+FastSprite fast_sprite_power_up(const FastSprite& src)
+{
+  FastSprite s = src;
+  for (uint32_t& p : s.px) {
+    uint32_t a = p >> 24, r = (p >> 16) & 0xff, g = (p >> 8) & 0xff, b = p & 0xff;
+    p = (a << 24) | (b << 16) | (r << 8) | g;
+  }
+  return s;
+}
+
+static
+void fast_sprites_load()
+{
+  int tw = iround(AGENT_FRAME_ZOOM * RES_W / 64);
+  int th = iround(AGENT_FRAME_ZOOM * RES_H / 64);
+
+  fast_ground_themes.resize(ground_themes_down.size());
+  for (size_t i = 0; i < ground_themes_down.size(); i++) {
+    const GroundTheme& g = ground_themes_down[i];
+    FastSprite def = fast_sprite(g.default_wall, tw, th);
+    for (int c = 0; c < 256; c++) {
+      auto f = g.walls.find(char(c));
+      fast_ground_themes[i].walls[c] = f == g.walls.end() ? def : fast_sprite(f->second, tw, th);
+    }
+  }
+
+  const std::vector<PlayerTheme>* src_players[2] = { &player_themesl_down, &player_themesr_down };
+  std::vector<FastPlayerTheme>* dst_players[2] = { &fast_player_themesl, &fast_player_themesr };
+  for (int side = 0; side < 2; side++) {
+    dst_players[side]->resize(src_players[side]->size());
+    for (size_t i = 0; i < src_players[side]->size(); i++) {
+      FastPlayerTheme& t = (*dst_players[side])[i];
+      for (int p = 0; p < POSE_COUNT; p++) {
+        t.poses[p] = fast_sprite((*src_players[side])[i].pose(p), tw, 2 * th);
+        t.poses_power_up[p] = fast_sprite_power_up(t.poses[p]);
+      }
+    }
+  }
+
+  const std::vector<EnemyTheme>* src_enemies[2] = { &enemy_themel_down, &enemy_themer_down };
+  std::vector<FastEnemyTheme>* dst_enemies[2] = { &fast_enemy_themel, &fast_enemy_themer };
+  for (int side = 0; side < 2; side++) {
+    dst_enemies[side]->resize(src_enemies[side]->size());
+    for (size_t i = 0; i < src_enemies[side]->size(); i++) {
+      const EnemyTheme& e = (*src_enemies[side])[i];
+      FastEnemyTheme& t = (*dst_enemies[side])[i];
+      t.walk1 = fast_sprite(e.walk1, tw, th);
+      t.walk2 = fast_sprite(e.walk2, tw, th);
+      t.dead = fast_sprite(e.dead, tw, th);
+    }
+  }
+}
+
+struct FastFrame {
+  uint32_t* px;
+  int w;
+  int h;
+};
+
+// premultiplied source-over onto an opaque destination, two channels per multiply
+static inline
+uint32_t fast_blend(uint32_t d, uint32_t s)
+{
+  uint32_t ia = 255 - (s >> 24);
+  uint32_t rb = (d & 0xff00ff) * ia;
+  uint32_t ag = ((d >> 8) & 0xff00ff) * ia;
+  rb = ((rb + ((rb >> 8) & 0xff00ff) + 0x800080) >> 8) & 0xff00ff;
+  ag = (ag + ((ag >> 8) & 0xff00ff) + 0x800080) & 0xff00ff00;
+  return s + (rb | ag);
+}
+
+// shift_x scrolls the sprite horizontally with wrap-around (used for lava)
+static
+void fast_blit(const FastFrame& f, const FastSprite& s, int ox, int oy, int shift_x = 0)
+{
+  int x0 = max(ox, 0) - ox;
+  int x1 = min(ox + s.w, f.w) - ox;
+  int y0 = max(oy, 0) - oy;
+  int y1 = min(oy + s.h, f.h) - oy;
+  for (int y = y0; y < y1; y++) {
+    const uint32_t* src = &s.px[y * s.w];
+    uint32_t* dst = f.px + (oy + y) * f.w + ox;
+    for (int x = x0; x < x1; x++) {
+      uint32_t p = src[(x + shift_x) % s.w];
+      dst[x] = fast_blend(dst[x], p);
+    }
+  }
+}
+
+// nearest-neighbour resize, only needed for the squashed dead-monster frames
+static
+void fast_blit_scaled(const FastFrame& f, const FastSprite& s, int ox, int oy, int w, int h)
+{
+  for (int y = max(oy, 0); y < min(oy + h, f.h); y++) {
+    const uint32_t* src = &s.px[((y - oy) * s.h / h) * s.w];
+    uint32_t* dst = f.px + y * f.w;
+    for (int x = max(ox, 0); x < min(ox + w, f.w); x++)
+      dst[x] = fast_blend(dst[x], src[(x - ox) * s.w / w]);
+  }
+}
+
+static
+void fast_fill_rect(const FastFrame& f, int x0, int y0, int x1, int y1, uint32_t color)
+{
+  for (int y = max(y0, 0); y < min(y1, f.h); y++) {
+    uint32_t* dst = f.px + y * f.w;
+    for (int x = max(x0, 0); x < min(x1, f.w); x++)
+      dst[x] = color;
+  }
+}
+
+static
+void fast_fill_ellipse(const FastFrame& f, double ex, double ey, double ew, double eh, uint32_t premul_color)
+{
+  double cx = ex + 0.5 * ew;
+  double cy = ey + 0.5 * eh;
+  double rx = 0.5 * fabs(ew);
+  double ry = 0.5 * fabs(eh);
+  if (rx <= 0 || ry <= 0)
+    return;
+  for (int y = max(int(floor(cy - ry)), 0); y < min(int(ceil(cy + ry)), f.h); y++) {
+    double ny = (y + 0.5 - cy) / ry;
+    uint32_t* dst = f.px + y * f.w;
+    for (int x = max(int(floor(cx - rx)), 0); x < min(int(ceil(cx + rx)), f.w); x++) {
+      double nx = (x + 0.5 - cx) / rx;
+      if (nx*nx + ny*ny <= 1.0)
+        dst[x] = fast_blend(dst[x], premul_color);
+    }
+  }
+}
+
+static inline
+uint32_t fast_gray(int shade)
+{
+  return 0xff000000 | (shade << 16) | (shade << 8) | shade;
+}
+
+template<int Cfg>
+static
+void paint_the_world_for_agent_fast(
+  uint32_t* buf, int res_w, int res_h,
+  const std::shared_ptr<State>& state, const Agent* agent)
+{
+  // Same scene and geometry as paint_the_world_for_agent(), see there.
+  FastFrame f = { buf, res_w, res_h };
+  const double zoom = AGENT_FRAME_ZOOM;
+  const FastGroundTheme& ground_theme = fast_ground_themes[state->world_theme_n];
+  const std::shared_ptr<Maze>& maze = agent->maze;
+
+  int center_x = (res_w - 1) / 2;  // QRect::center()
+  int center_y = (res_h - 1) / 2;
+  double kx = zoom * res_w / double(64);
+  double ky = zoom * res_h / double(64);
+  double dx = (-agent->x) * kx + center_x - 0.5*kx;
+  double dy = (agent->y) * ky - center_y - 0.5*ky;
+
+  for (int i = 0; i < res_w * res_h; i++)
+    buf[i] = fast_gray(30);
+
+  int radius = int(1 + 64 / zoom);
+  int ix = int(agent->x + .5);
+  int iy = int(agent->y + .5);
+  int x_start = max(ix - radius, 0);
+  int x_end = min(ix + radius + 1, maze->w);
+  int y_start = max(iy - radius, 0);
+  int y_end = min(iy + radius + 1, maze->h);
+  double WINH = res_h;
+
+  // tiles cover exactly their cell here, so the layer is opaque and just copied
+  assert(kx == int(kx) && ky == int(ky));
+  StaticLayer* layer = agent_static_layer(agent);
+  static_layer_sync(layer, maze.get(), &ground_theme, state->world_theme_n, int(kx), int(ky), int(kx), int(ky), fast_gray(30),
+    [&](const QRect& r) {
+      FastFrame lf = { layer->px.data(), layer->w, layer->h };
+      int x0, x1, y0, y1;
+      static_layer_cells(layer, r, &x0, &x1, &y0, &y1);
+      for (int y=y0; y<y1; ++y) {
+        for (int x=x0; x<x1; x++) {
+          int wkey = maze->get_elem(x, y);
+          if (wkey==SPACE || is_lava(wkey)) continue;
+          fast_blit(lf, ground_theme.walls[wkey & 0xff], layer->kx * x, layer->ky * (layer->maze_h - 1 - y));
+        }
+      }
+    });
+  int layer_x = iround(dx);
+  int layer_y = iround(WINH - ky*(maze->h - 1) + dy);
+  int copy_x0 = max(layer_x, 0);
+  int copy_x1 = min(layer_x + layer->w, res_w);
+  for (int y = max(layer_y, 0); y < min(layer_y + layer->h, res_h) && copy_x1 > copy_x0; y++)
+    memcpy(buf + y * res_w + copy_x0, &layer->px[size_t(y - layer_y) * layer->w + copy_x0 - layer_x], (copy_x1 - copy_x0) * 4);
+
+  for (int cell: layer->lava) {
+    int x = cell % maze->w;
+    int y = cell / maze->w;
+    if (x < x_start || x >= x_end || y < y_start || y >= y_end) continue;
+    const FastSprite& img = ground_theme.walls[maze->get_elem(x, y) & 0xff];
+    int ox = iround(kx*x + dx);
+    int oy = iround(WINH - ky*y + dy);
+    float tr = state->time*0.1;
+    tr -= int(tr);
+    tr *= -1;
+    fast_blit(f, img, ox, oy, iround(-tr*img.w) % img.w);
+  }
+
+  const FastPlayerTheme& player = (agent->is_facing_right ? fast_player_themesr : fast_player_themesl)[agent->theme_n];
+  const FastSprite& img = (agent->power_up_mode ? player.poses_power_up : player.poses)[agent->pose()];
+  fast_blit(f, img, iround(kx * agent->x + dx), iround(WINH - ky * (agent->y+1) + dy));
+
+  Monsters& ms = maze->monsters;
+  int monsters_count = ms.size();
+  for (int i=0; i<monsters_count; ++i) {
+    const EnemyTheme& props = enemy_themel[ms.theme_n[i]];
+    const FastEnemyTheme& theme = (ms.vx[i]>0 ? fast_enemy_themer : fast_enemy_themel)[ms.theme_n[i]];
+    int ox = iround(kx*ms.x[i] + dx);
+    int oy = iround(WINH - ky*ms.y[i] + dy);
+
+    if ((ms.is_flying[i] || ms.is_walking[i]) && !ms.is_dead[i]) {
+      for (int t=2; t<MONSTER_TRAIL; t+=2) {
+        double ex = kx*ms.prev_x(i, t) + dx;
+        double ey = WINH - ky*ms.prev_y(i, t) + dy;
+        float ft = 1 - float(t)/MONSTER_TRAIL;
+        float smaller = 0.20;
+        float lower = -0.22;
+        float soar = -0.4;
+        double x1 = ex + (smaller-0.2*ft)*kx;
+        double y1 = ey + (soar*ft-0.2*ft-lower+smaller)*ky;
+        double x2 = ex + kx + (-smaller+0.2*ft)*kx;
+        double y2 = ey + ky + (soar*ft+0.2*ft-lower-smaller)*ky;
+        uint32_t a = t*127/MONSTER_TRAIL;
+        fast_fill_ellipse(f, x1, y1, x2 - x1, y2 - y1, (a << 24) | (a << 16) | (a << 8) | a);
+      }
+    }
+
+    if (ms.is_dead[i]) {
+      int& dying_cnt = ms.monster_dying_frame_cnt[i];
+      dying_cnt = max(0, dying_cnt);
+      double monster_shrinkage = (MONSTER_DEATH_ANIM_LENGTH - dying_cnt) * 0.8 / MONSTER_DEATH_ANIM_LENGTH;
+      int top = iround(WINH - ky*ms.y[i] + dy + ky * monster_shrinkage);
+      int bottom = iround(WINH - ky*ms.y[i] + dy + ky);
+      if (bottom > top)
+        fast_blit_scaled(f, theme.dead, ox, top, theme.dead.w, bottom - top);
+      dying_cnt -= 1;
+    } else if (props.is_jumping_monster) {
+      fast_blit(f, ms.vy[i] == 0 ? theme.walk1 : theme.walk2, ox, oy);
+    } else {
+      fast_blit(f, state->time / props.anim_freq % 2 == 0 ? theme.walk1 : theme.walk2, ox, oy);
+    }
+  }
+
+  if (Cfg & CFG_AUGMENT) {
+    float max_rand_dim = .25;
+    float min_rand_dim = .1;
+    int num_blotches = state->augment_rand_gen.randint(0, 6);
+
+    for (int j = 0; j < num_blotches; j++) {
+      float rx = state->augment_rand_gen.rand01() * res_w;
+      float ry = state->augment_rand_gen.rand01() * res_h;
+      float rdx = (state->augment_rand_gen.rand01() * max_rand_dim + min_rand_dim) * res_w;
+      float rdy = (state->augment_rand_gen.rand01() * max_rand_dim + min_rand_dim) * res_h;
+      uint32_t r = state->augment_rand_gen.randint(0, 255);
+      uint32_t g = state->augment_rand_gen.randint(0, 255);
+      uint32_t b = state->augment_rand_gen.randint(0, 255);
+      fast_fill_rect(f, iround(rx), iround(ry), iround(rx + rdx), iround(ry + rdy),
+        0xff000000 | (r << 16) | (g << 8) | b);
+    }
+  }
+
+  if (Cfg & CFG_VEL_INFO) {
+    int infodim = iround(res_h * .2);
+    int s1 = to_shade(.5 * agent->vx / maze->max_speed + .5);
+    int s2 = to_shade(.5 * agent->vy / maze->max_jump + .5);
+    fast_fill_rect(f, 0, 0, infodim, infodim, fast_gray(s1));
+    fast_fill_rect(f, infodim, 0, 2 * infodim, infodim, fast_gray(s2));
+  }
+}
+
+// Everything paint_the_world_for_video_data() reads, copied out of a State, so the
+// frame can be painted later on a render thread while the env keeps stepping.
+struct VideoMonster {
+  float x, y, vx, vy;
+  int theme_n;
+  bool is_dead;
+  int monster_dying_frame_cnt;
+};
+
+struct VideoFrame {
+  int game_id;
+  int time;
+  int world_theme_n;
+  int maze_h;
+  float agent_x, agent_y;
+  float zoom;
+  int theme_n;
+  int pose;
+  bool is_facing_right;
+  bool crouching;   // pulls the power-up bubble down
+  bool power_up_mode;
+  bool death_fade;
+  int killed_animation_frame_cnt;
+  int x_start, x_end, y_start, y_end; // visible part of the maze
+  std::vector<int> tiles;            // row-major, (x_end-x_start) per row
+  std::vector<VideoMonster> monsters;
+  std::vector<uint8_t> pixels;       // Format_RGB32 VIDEORES x VIDEORES, when painted asynchronously
+};
+
+// Advances the video zoom and copies the draw state into f. Like painting used to,
+// this clamps the dying frame count of dead monsters.
+static
+void video_frame_snapshot(VideoFrame* f, const std::shared_ptr<State>& state, Agent* agent)
+{
+  agent->zoom = 0.9*agent->zoom + 0.1*agent->target_zoom;
+  const std::shared_ptr<Maze>& maze = agent->maze;
+
+  f->game_id = state->game_id;
+  f->time = state->time;
+  f->world_theme_n = state->world_theme_n;
+  f->maze_h = maze->h;
+  f->agent_x = agent->x;
+  f->agent_y = agent->y;
+  f->zoom = agent->zoom;
+  f->theme_n = agent->theme_n;
+  f->pose = agent->pose();
+  f->is_facing_right = agent->is_facing_right;
+  f->crouching = agent->spring != 0 && !(agent->is_killed || agent->ladder_mode || agent->vy != 0);
+  f->power_up_mode = agent->power_up_mode;
+  f->death_fade = agent->is_killed && agent->collect_data;
+  f->killed_animation_frame_cnt = agent->killed_animation_frame_cnt;
+
+  int radius = int(1 + 64 / f->zoom);  // actually /2 works except near scroll limits
+  int ix = int(agent->x + .5);
+  int iy = int(agent->y + .5);
+  f->x_start = max(ix - radius, 0);
+  f->x_end = min(ix + radius + 1, maze->w);
+  f->y_start = max(iy - radius, 0);
+  f->y_end = min(iy + radius + 1, maze->h);
+  f->tiles.clear();
+  for (int y=f->y_start; y<f->y_end; ++y)
+    for (int x=f->x_start; x<f->x_end; x++)
+      f->tiles.push_back(maze->get_elem(x, y));
+
+  Monsters& ms = maze->monsters;
+  f->monsters.resize(ms.size());
+  for (int i=0; i<ms.size(); ++i) {
+    if (ms.is_dead[i])
+      ms.monster_dying_frame_cnt[i] = max(0, ms.monster_dying_frame_cnt[i]);
+    VideoMonster& vm = f->monsters[i];
+    vm.x = ms.x[i];
+    vm.y = ms.y[i];
+    vm.vx = ms.vx[i];
+    vm.vy = ms.vy[i];
+    vm.theme_n = ms.theme_n[i];
+    vm.is_dead = ms.is_dead[i];
+    vm.monster_dying_frame_cnt = ms.monster_dying_frame_cnt[i];
+  }
+}
+
+// The coins and gems eaten by the agent's last move go to every monitor of the env, right
+// after the move and before a game over resets the level, where eat_coin used to write
+// them itself. They reach the bin log's next frame, a game start drops them there.
+static
+void monitor_save_coins(Agent& a)
+{
+  for (const std::pair<int16_t, int16_t>& c: a.pickups) {
+    if (a.monitor_csv)
+      a.monitor_csv->printf("eat_coin,%i,%i\n\n", int(c.first), int(c.second));
+    if (a.monitor_bin && a.collect_data) // frames, which carry the coins, only then
+      a.monitor_bin->add_coin(c.first, c.second);
+  }
+  a.pickups.clear();
+}
+
+// Appends this frame's agent and monster state to monitor.csv, later converted to json
+// metadata. Must run before video_frame_snapshot() touches monster_dying_frame_cnt.
+static
+void monitor_csv_save_frame(const std::shared_ptr<State>& state, const Agent* agent)
+{
+  if (!agent->monitor_csv)
+    return;
+  std::shared_ptr<Maze> maze = agent->maze;
+  std::stringstream buffer;
+
+  // save frame and agent information
+  buffer << "time_alive,agent_x,agent_y,agent_vx,agent_vy,agent_facing_right,agent_ladder,agent_spring,is_killed,killed_animation_frame_cnt,finished_level_frame_cnt,killed_monster,bumped_head,collected_coin,collected_gem,power_up_mode" << std::endl;
+  buffer << agent->time_alive << "," << agent->x << "," << agent->y << "," << agent->vx << "," << agent->vy << ",";
+  buffer << agent->is_facing_right << "," << agent->ladder_mode << "," << agent->spring << ",";
+  buffer << agent->is_killed << "," << agent->killed_animation_frame_cnt << "," << agent->finished_level_frame_cnt << ",";
+  buffer << agent->killed_monster << "," << agent->bumped_head << "," << agent->collected_coin << ",";
+  buffer << agent->collected_gem << "," << agent->power_up_mode << std::endl;
+
+  const Monsters& ms = maze->monsters;
+  int monsters_count = ms.size();
+  // save general monster information
+  buffer << "state_time,monsters_count,m_id,m_x,m_y,m_vx,m_vy,m_theme,m_flying,m_walking,m_jumping,m_dead,m_anim_freq,monster_dying_frame_cnt" << std::endl;
+  buffer << state->time << "," << monsters_count << ",";
+  for (int i=0; i<monsters_count; ++i) {
+    const EnemyTheme& theme = enemy_themel[ms.theme_n[i]];
+
+    // save individual monster information, flags as bool so they print as 0/1
+    buffer << i << "," << ms.x[i] << "," << ms.y[i] << "," << ms.vx[i] << "," << ms.vy[i] << "," << ms.theme_n[i] << ",";
+    buffer << bool(ms.is_flying[i]) << "," << bool(ms.is_walking[i]) << "," << theme.is_jumping_monster << ",";
+    buffer << bool(ms.is_dead[i]) << "," << theme.anim_freq << "," << ms.monster_dying_frame_cnt[i] << ",";
+  }
+  buffer << std::endl;
+
+  monitor_csv_save_string(agent->monitor_csv.get(), buffer.str().c_str());
+}
+
+// One drawImage() of a hires frame. Unscaled sprites are drawn at dst's top left, the
+// whole image or just its src part, scaled ones fill dst with the whole image.
+struct VideoSprite {
+  const QImage* img;
+  QRectF dst;
+  QRectF src; // empty for the whole image
+  bool scaled;
+};
+
+static
+void video_sprite_at(std::vector<VideoSprite>* out, const QPointF& dst, const QImage& img, const QRectF& src = QRectF())
+{
+  VideoSprite s;
+  s.img = &img;
+  s.dst = QRectF(dst, src.isEmpty() ? QSizeF(img.width(), img.height()) : src.size());
+  s.src = src;
+  s.scaled = false;
+  out->push_back(s);
+}
+
+static
+void video_sprite_scaled(std::vector<VideoSprite>* out, const QRectF& dst, const QImage& img)
+{
+  VideoSprite s;
+  s.img = &img;
+  s.dst = dst;
+  s.scaled = true;
+  out->push_back(s);
+}
+
+// The sprites of a hires frame in painting order, from the background up. Kept apart
+// from the painter so the GL backend draws exactly the same list.
+static
+void video_frame_sprites(
+  std::vector<VideoSprite>* out, const QRect& rect,
+  const VideoFrame& f, ScaledThemes*& themes_memo)
+{
+  out->clear();
+  double zoom = f.zoom;
+  const double bgzoom = 0.4;
+
+  bool lowres = rect.height() < 200;
+
+  double kx = zoom * rect.width()  / double(64);  // not w!
+  double ky = zoom * rect.height() / double(64);
+  double dx = (-f.agent_x) * kx + rect.center().x()  - 0.5*kx;
+  double dy = -rect.center().y()  + 5.0*ky;
+
+  ScaledThemes* themes = find_scaled_themes(themes_memo, lowres, kx, ky);
+  const GroundTheme* ground_theme = choose_ground_theme(themes, f.world_theme_n);
+
+  for (int tile_x=-1; tile_x<=2; tile_x++) {
+    for (int tile_y=-1; tile_y<=1; tile_y++) {
+      double zx = rect.width()*zoom;   // / bgzoom;
+      double zy = rect.height()*zoom;  // / bgzoom);
+      QRectF bg_image = QRectF(0, 0, zx, zy);
+      bg_image.moveCenter(QPointF(
+        zx*tile_x + rect.center().x() + bgzoom*(dx + kx*f.maze_h/2),
+        zy*tile_y + rect.center().y() + bgzoom*(dy - ky*f.maze_h/2)
+        ));
+
+      video_sprite_scaled(out, bg_image, bg_images[f.world_theme_n]);
+    }
+  }
+
+  double WINH = rect.height();
+  const int* tile = f.tiles.data();
+
+  for (int y=f.y_start; y<f.y_end; ++y) {
+    for (int x=f.x_start; x<f.x_end; x++) {
+      int wkey = *tile++;
+      if (wkey==SPACE) continue;
+
+      auto it = ground_theme->walls.find(wkey);
+      const QImage& img = it == ground_theme->walls.end() ? ground_theme->default_wall : it->second;
+      QPointF dst(kx*x + dx - 0.1, WINH - ky*y + dy - 0.1); // tiles are tile_w wide, overlapping to hide seams
+
+      if (wkey==LAVA_MIDDLE || wkey==LAVA_SURFACE) {
+        // same split as draw_scrolling_tile()
+        float tr = f.time*0.1;
+        tr -= int(tr);
+        int w = img.width();
+        int s = iround(tr * w) % w;
+        video_sprite_at(out, dst, img, QRectF(s, 0, w - s, img.height()));
+        if (s > 0)
+          video_sprite_at(out, QPointF(dst.x() + w - s, dst.y()), img, QRectF(0, 0, s, img.height()));
+      } else {
+        video_sprite_at(out, dst, img);
+      }
+    }
+  }
+
+  for (const VideoMonster& m: f.monsters) {
+    QPointF dst(kx*m.x + dx, WINH - ky*m.y + dy);
+
+    const EnemyTheme* theme = choose_enemy_theme(themes, m.theme_n, m.vx > 0);
+    if (m.is_dead) {
+      double monster_shrinkage = (MONSTER_DEATH_ANIM_LENGTH - m.monster_dying_frame_cnt) * 0.8 / MONSTER_DEATH_ANIM_LENGTH;
+      video_sprite_scaled(out, QRectF(kx*m.x + dx, WINH - ky*m.y + dy + ky * monster_shrinkage, kx, ky * (1 - monster_shrinkage)), theme->dead);
+    } else if (theme->is_jumping_monster) {
+      video_sprite_at(out, dst, m.vy == 0 ? theme->walk1 : theme->walk2);
+    } else {
+      video_sprite_at(out, dst, f.time / theme->anim_freq % 2 == 0 ? theme->walk1 : theme->walk2);
+    }
+  }
+
+  const PlayerTheme* active_theme = choose_player_theme(themes, f.theme_n, f.is_facing_right, false);
+  const QImage& img = f.death_fade ?
+    choose_death_fade(themes, f.theme_n, f.is_facing_right, f.killed_animation_frame_cnt) :
+    active_theme->pose(f.pose);
+  video_sprite_at(out, QPointF(kx * f.agent_x + dx, WINH - ky * (f.agent_y+1) + dy), img);
+
+  if (f.power_up_mode) {
+    QPointF bubble_dst(kx * f.agent_x + dx - 7, WINH - ky * (f.agent_y+1) + dy + 8);
+    if (f.crouching) {
+      // pull bubble down when Mugen crouches
+      bubble_dst += QPointF(0.0, 8.0);
+    } 
+    video_sprite_at(out, bubble_dst, themes->power_up_shield);
+  } 
+}
+
+static
+void paint_the_world_for_video_data(
+  QPainter& p, const QRect& rect,
+  const VideoFrame& f, ScaledThemes*& themes_memo)
+{
+  static thread_local std::vector<VideoSprite> sprites;
+  video_frame_sprites(&sprites, rect, f, themes_memo);
+
+  p.setRenderHint(QPainter::Antialiasing, true);
+  p.setRenderHint(QPainter::SmoothPixmapTransform, true);
+  p.setRenderHint(QPainter::HighQualityAntialiasing, true);
+
+  for (const VideoSprite& s: sprites) {
+    if (s.scaled)
+      p.drawImage(s.dst, *s.img);
+    else if (s.src.isEmpty())
+      p.drawImage(s.dst.topLeft(), *s.img);
+    else
+      p.drawImage(s.dst.topLeft(), *s.img, s.src);
+  }
+}
+
+static
+void paint_audio_seg_map_buf(
+  uint8_t* buf, const std::shared_ptr<State>& state, const Agent* agent)
+{
+  STATS_SCOPE(STAT_AUDIO);
+
+  // events of the frame, see agent_frame_events()
+  for (int i=0; i<AUDIO_MAP_SIZE; ++i) {
+    buf[i] = (agent->frame_events >> i) & 1;
+  }
+  buf[EVENT_POWER_UP_MODE] = agent->power_up_mode;
+}
+
+// Once per game frame, after the agent moved: adds the events of its motion, at the
+// cadence of their sounds, and gives everything that happened in the frame its number.
+static
+void agent_frame_events(Agent& a)
+{
+  a.frame_events &= ~((1u << EVENT_LADDER_CLIMBING) | (1u << EVENT_JUMP) | (1u << EVENT_WALK));
+  if (a.ladder_mode && a.time_alive % 5 == 0) {
+    a.event(EVENT_LADDER_CLIMBING, a.x, a.y);
+  } else if (a.vy == a.maze->max_jump) {
+    a.event(EVENT_JUMP, a.x, a.y);
+  } else if (a.vx != 0 && a.vy == 0 && a.spring == 0 && a.time_alive % 5 == 0) {
+    a.event(EVENT_WALK, a.x, a.y);
+  }
+  a.events.stamp(a.time_alive);
+}
+
+// -- thread placement --
+//
+// With PIN_THREADS, stepping thread t runs on core worker_cpus[t] and the envs it is the
+// home of are built there, so their pages sit on that core's NUMA node.
+
+static std::vector<int> worker_cpus; // empty when not pinning
+
+static
+void thread_pin(int cpu)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) // 0 is the calling thread
+    fprintf(stderr, "cannot pin thread to cpu %i: %s\n", cpu, strerror(errno));
+#else
+  (void)cpu;
+#endif
+}
+
+// Picks the cores of this process's stepping threads, socket by socket. If the
+// launcher already bound the process to a few cores those are used, otherwise the
+// machine is split between processes by LOCAL_RANK.
+static
+void worker_cpus_choose(int threads)
+{
+  worker_cpus.clear();
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (!PIN_THREADS || threads <= 0 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return;
+  std::vector<std::pair<int, int>> cpus; // (socket, cpu)
+  for (int c = 0; c < CPU_SETSIZE; c++) {
+    if (!CPU_ISSET(c, &allowed))
+      continue;
+    int socket = 0;
+    FILE* f = fopen(stdprintf("/sys/devices/system/cpu/cpu%i/topology/physical_package_id", c).c_str(), "r");
+    if (f) {
+      if (fscanf(f, "%i", &socket) != 1)
+        socket = 0;
+      fclose(f);
+    }
+    cpus.push_back(std::make_pair(socket, c));
+  }
+  if (cpus.empty())
+    return;
+  std::sort(cpus.begin(), cpus.end());
+  int first = 0;
+  if ((long)cpus.size() >= sysconf(_SC_NPROCESSORS_ONLN))
+    first = LOCAL_RANK * threads;
+  for (int t = 0; t < threads; t++)
+    worker_cpus.push_back(cpus[(first + t) % cpus.size()].second);
+#endif
+}
+
+// -- vecenv --
+
+// Bounded lock-free multi-producer/multi-consumer ring (D. Vyukov's design).
+// Capacity is rounded up to a power of two. push() fails when full, pop() when empty.
+template<typename T>
+class MPMCRing {
+public:
+  void init(int capacity)
+  {
+    size_t cap = 1;
+    while (cap < (size_t)capacity)
+      cap *= 2;
+    cells.reset(new Cell[cap]);
+    mask = cap - 1;
+    for (size_t i = 0; i < cap; i++)
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    enqueue_pos.store(0, std::memory_order_relaxed);
+    dequeue_pos.store(0, std::memory_order_relaxed);
+  }
+
+  bool push(const T& v)
+  {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (1) {
+      Cell& c = cells[pos & mask];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    Cell& c = cells[pos & mask];
+    c.data = v;
+    c.seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T* v)
+  {
+    return pop_batch(v, 1) == 1;
+  }
+
+  // Claims up to max consecutive entries with a single CAS on the read cursor.
+  int pop_batch(T* out, int max)
+  {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    int n;
+    while (1) {
+      n = 0;
+      while (n < max) {
+        size_t seq = cells[(pos + n) & mask].seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(pos + n + 1) != 0)
+          break;
+        n++;
+      }
+      if (n == 0) {
+        size_t seq = cells[pos & mask].seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+          return 0; // empty
+        pos = dequeue_pos.load(std::memory_order_relaxed);  // lost a race, retry
+        continue;
+      }
+      if (dequeue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+        break;
+    }
+    for (int i = 0; i < n; i++) {
+      Cell& c = cells[(pos + i) & mask];
+      out[i] = std::move(c.data);
+      c.data = T();
+      c.seq.store(pos + i + mask + 1, std::memory_order_release);
+    }
+    return n;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+  std::unique_ptr<Cell[]> cells;
+  size_t mask = 0;
+  char pad0[64];  // keep producer and consumer cursors on separate cache lines
+  std::atomic<size_t> enqueue_pos;
+  char pad1[64];
+  std::atomic<size_t> dequeue_pos;
+};
+
+const int MAX_CLAIM_BATCH = 16;
+
+// Output arrays for one step of a vector, laid out like the vec_wait arguments.
+struct StepOutputs {
+  uint8_t* obs_rgb = 0;
+  uint8_t* obs_hires_rgb = 0;
+  uint8_t* obs_audio_seg_map = 0;
+  float* rew = 0;
+  bool* done = 0;
+  bool* new_level = 0;
+
+  // symbolic observations, see write_symbolic_obs()
+  uint8_t* obs_tiles = 0;
+  float* obs_agent = 0;
+  float* obs_monsters = 0;
+
+  // see vec_set_event_buffers()
+  Event* events = 0;
+  int32_t* event_counts = 0;
+};
+
+class VectorOfStates {
+public:
+  int nenvs;
+  int handle;
+  bool symbolic_obs = false; // created with OBS_SYMBOLIC
+  int step_cfg = 0;          // step_config() at vec_create()
+  QMutex states_mutex;
+  std::vector<std::shared_ptr<State>> states; // nenvs
+  // Indices into states waiting to be stepped, one ring per stepping thread. Each env
+  // is always queued on the ring of its home thread, other threads only take from it
+  // once their own ring is empty.
+  std::vector<std::unique_ptr<MPMCRing<int>>> todo;
+  int claim_batch = 1; // how many envs a worker takes off todo at once
 
-    if (spring != 0 && !(is_killed || ladder_mode || vy != 0)) {
-      reward -= SQUAT_PENALTY;
-      reward_sum -= SQUAT_PENALTY;
-      is_preparing_to_jump = true;
-    } else {
-      if (is_preparing_to_jump && vy != max_jump) {
-        reward -= JITTER_SQUAT_PENALTY;
-        reward_sum -= JITTER_SQUAT_PENALTY;
-      }
-      is_preparing_to_jump = false;
-    }
+  void todo_push(int e)
+  {
+#ifdef COINRUN_STATS
+    states[e]->queued_ticks = stats_ticks();
+#endif
+    bool ok = todo[states[e]->home]->push(e);
+    assert(ok && "env stepped twice without vec_wait");
+    (void)ok;
   }
 
-  void step()
+  int todo_claim(int worker, int* batch)
   {
-    time_alive += 1;
-    int timeout = 0;
-
-    timeout = LEVEL_TIMEOUT;
-    step_coinrun();
+    int rings = todo.size();
+    for (int k = 0; k < rings; k++) {
+      int cnt = todo[(worker + k) % rings]->pop_batch(batch, claim_batch);
+      if (cnt > 0)
+        return cnt;
+    }
+    return 0;
+  }
 
-    if (time_alive > timeout) {
-        maze->is_terminated = true;
+  // Set by vec_set_buffers: workers write finished steps straight into these
+  // caller-owned arrays, and vec_wait only has to synchronize.
+  bool has_registered_outputs = false;
+  StepOutputs registered_outputs;
+
+  // Set by vec_rollout() before it queues the envs: a worker steps each env it claims
+  // rollout_steps times, with actions rollout_actions[t*nenvs + e], into rollout_outputs.
+  int rollout_steps = 0;
+  const int32_t* rollout_actions = 0;
+  StepOutputs rollout_outputs;
+
+  // Steps queued but not yet completed. The worker that brings this to zero wakes
+  // whoever is sleeping in vec_wait on this vector, and nobody else.
+  std::atomic<int> steps_outstanding{0};
+  QMutex completion_mutex;
+  QWaitCondition step_completed;
+
+  // Set by the first vec_step_async_subset(). Workers then also list every env they
+  // finish in completed, in completion order, and wake vec_wait_any() each time. They
+  // claim one env at a time then, so an env is listed as soon as its own step is done.
+  // async_busy (caller thread only) marks envs stepped but not yet collected.
+  bool async_steps = false;
+  std::vector<int> completed; // under completion_mutex
+  std::vector<char> async_busy;
+
+  void steps_done(const int* batch, int n)
+  {
+    if (async_steps) {
+      QMutexLocker lock(&completion_mutex);
+      completed.insert(completed.end(), batch, batch + n);
+      steps_outstanding.fetch_sub(n);
+      step_completed.wakeAll();
+      return;
+    }
+    if (steps_outstanding.fetch_sub(n) == n) {
+      QMutexLocker lock(&completion_mutex);
+      step_completed.wakeAll();
     }
   }
 
-  QImage picture(PlayerTheme *theme) const
+  // A symbolic vector has no other observations than those of vec_set_symbolic_buffers().
+  void check_symbolic_buffers() const
   {
-    if (is_killed) 
-      return theme->hit;
-    if (ladder_mode)
-      return (time_alive / 5 % 2 == 0) ? theme->climb1 : theme->climb2;
-    if (vy != 0)
-      return theme->jump;
-    if (spring != 0)
-      return theme->duck;
-    if (vx == 0)
-      return theme->stand;
+    assert((!symbolic_obs || registered_outputs.obs_tiles) &&
+      "OBS_SYMBOLIC vector without vec_set_symbolic_buffers()");
+  }
 
-    return (time_alive / 5 % 2 == 0) ? theme->walk1 : theme->walk2;
+  void wait_steps_done()
+  {
+    QMutexLocker lock(&completion_mutex);
+    while (steps_outstanding.load() > 0)
+      step_completed.wait(&completion_mutex, 1000); // milliseconds
   }
 };
 
-void Monster::step(const std::shared_ptr<Maze>& maze)
+static QMutex h2s_mutex;
+static std::map<int, std::shared_ptr<VectorOfStates>> h2s;
+static int handle_seq = 100;
+
+// Workers pick up a ticket for a VectorOfStates that has pending steps and drain its
+// todo ring in batches. Only idle workers touch idle_mutex.
+static MPMCRing<std::shared_ptr<VectorOfStates>> work_tickets;
+static std::atomic<int> sleeping_workers(0);
+static std::vector<std::shared_ptr<QThread>> all_threads;
+static QMutex idle_mutex;
+static QWaitCondition wait_for_actions;
+
+static std::shared_ptr<VectorOfStates> vstate_find(int handle)
 {
-  if (!is_flying && !is_walking)
-  return;
-  float control = sign(vx);
-  int ix = int(x);
-  int iy = int(y);
-  int look_left  = maze->get_elem(ix-0, iy);
-  int look_right = maze->get_elem(ix+1, iy);
-  if (is_wall(look_left)) control = +1;
-  if (is_wall(look_right)) control = -1;
-  if (is_walking) {
-    int feel_left  = maze->get_elem(ix-0, iy-1);
-    int feel_right = maze->get_elem(ix+1, iy-1);
-    if (!is_wall(feel_left)) control = +1;
-    if (!is_wall(feel_right)) control = -1;
+  QMutexLocker lock(&h2s_mutex);
+  auto f = h2s.find(handle);
+  if (f == h2s.end()) {
+    fprintf(stderr, "cannot find vstate handle %i\n", handle);
+    assert(0);
   }
+  return f->second;
+}
 
-  float monster_max_speed = enemy_themel[theme_n].monster_max_speed;
-  vx = clip_abs(MONSTER_MIXRATE*control + (1-MONSTER_MIXRATE)*vx, monster_max_speed);
+static
+void copy_render_buf(int e, uint8_t* obs_rgb, uint8_t* buf, int res_w, int res_h)
+{
+  for (int y = 0; y<res_h; y++) {
+    for (int x = 0; x<res_w; x++) {
+      uint8_t* p = obs_rgb + e*res_h*res_w*3 + y*res_w*3 + x*3;
 
-  bool is_jumping_monster = enemy_themel[theme_n].is_jumping_monster;
-  if (is_jumping_monster) {
-    if (vy == 0 && pause == 0) {
-      // time to jump!
-      vy = enemy_themel[theme_n].max_jump_height;
-    } else if (pause == 0) {
-      // falling due to gravity
-      vy -= 0.8 * maze->gravity;
+      p[0] = buf[y*res_w*4 + x*4 + 2];
+      p[1] = buf[y*res_w*4 + x*4 + 1];
+      p[2] = buf[y*res_w*4 + x*4 + 0];
     }
-
-    float ny = y + vy;
-    if (vy < 0 && !maze->has_vertical_space(x, ny, false)) {
-      y = int(ny) + 1;
-      vy = 0;
-      // pause based on some random choice
-      pause = global_rand_gen.randint(0, enemy_themel[theme_n].max_pause_time);
-    } 
   }
+}
 
+static
+void copy_audio_buf(int e, uint8_t* obs_audio, uint8_t* buf, int dim)
+{
+  for (int x = 0; x<dim; x++) {
+    uint8_t* p = obs_audio + e*dim + x;
 
-  if (pause > 0) {
-    pause -= 1;
-  } else {
-    x += vx;
-    y += vy;
-  }
-  for (int t=1; t<MONSTER_TRAIL; t++) {
-    prev_x[t-1] = prev_x[t];
-    prev_y[t-1] = prev_y[t];
+    p[0] = buf[x];
   }
-  prev_x[MONSTER_TRAIL-1] = x;
-  prev_y[MONSTER_TRAIL-1] = y;
 }
 
-struct State {
-  int state_n; // in vstate
-  std::shared_ptr<Maze> maze;
-  int world_theme_n;
-  State(const std::shared_ptr<VectorOfStates>& belongs_to):
-    belongs_to(belongs_to)  { }
-
-  QMutex state_mutex;
-   std::weak_ptr<VectorOfStates> belongs_to;
-   int time;
-   int game_id = -1;
-   Agent agent;
-
-  QMutex step_mutex;
-   bool step_in_progress = false;
-   bool agent_ready = false;
-};
+// -- symbolic observations --
+//
+// For vectors created with OBS_SYMBOLIC, instead of the 64x64 frame every env gets:
+//   tiles     uint8 [SYMBOLIC_TILES_H][SYMBOLIC_TILES_W], the tile chars around the agent,
+//             top row first like the frame, WALL_MIDDLE outside the level
+//   agent     float [SYMBOLIC_AGENT_DIM]: x, y, vx, vy, spring, facing_right, ladder_mode,
+//             power_up_mode, is_killed, time_alive
+//   monsters  float [SYMBOLIC_MONSTERS][SYMBOLIC_MONSTER_DIM], nearest first: present,
+//             dx, dy (relative to the agent), vx, vy, theme_n, is_flying, is_walking,
+//             is_dead, can_be_killed; unused rows are all zero
+
+enum { OBS_PIXELS = 0, OBS_SYMBOLIC = 1 };
+const int SYMBOLIC_TILES_W = 17;
+const int SYMBOLIC_TILES_H = 13;
+const int SYMBOLIC_AGENT_DIM = 10;
+const int SYMBOLIC_MONSTERS = 8;
+const int SYMBOLIC_MONSTER_DIM = 10;
 
-void state_reset(const std::shared_ptr<State>& state)
+static
+void write_symbolic_obs(int e, const StepOutputs& out, const State* state)
 {
-  assert(player_themesl.size() > 0 && "Please call init(threads) first");
-
-  int level_seed = 0;
-
-  if (USE_LEVEL_SET) {
-    int level_index = global_rand_gen.randint(0, NUM_LEVELS);
-    level_seed = LEVEL_SEEDS[level_index];
-  } else if (NUM_LEVELS > 0) {
-    level_seed = global_rand_gen.randint(0, NUM_LEVELS);
-  } else {
-    level_seed = global_rand_gen.randint();
+  const Agent& a = state->agent;
+  const Maze* maze = state->maze.get();
+
+  uint8_t* tiles = out.obs_tiles + e*SYMBOLIC_TILES_W*SYMBOLIC_TILES_H;
+  int x0 = int(a.x + .5) - SYMBOLIC_TILES_W/2;
+  int y1 = int(a.y + .5) + SYMBOLIC_TILES_H/2;
+  for (int row = 0; row < SYMBOLIC_TILES_H; row++) {
+    int ty = y1 - row;
+    for (int col = 0; col < SYMBOLIC_TILES_W; col++) {
+      int tx = x0 + col;
+      bool inside = tx >= 0 && tx < maze->w && ty >= 0 && ty < maze->h;
+      tiles[row*SYMBOLIC_TILES_W + col] = inside ? maze->walls[maze->stride*ty + tx] : WALL_MIDDLE;
+    }
   }
 
-  RandomMazeGenerator maze_gen;
-  maze_gen.rand_gen.seed(level_seed);
-
-  int w = 64;
-  int h = 13;
-  state->maze.reset(new Maze(w, h));
-  maze_gen.maze = state->maze;
-
-  maze_gen.initial_floor_and_walls();
-
-  maze_gen.generate_coins_on_platforms();
-
-  Agent &agent = state->agent;
-  float zoom = state->maze->default_zoom;
-  agent.maze = state->maze;
-  agent.zoom = zoom;
-  agent.target_zoom = zoom;
-
-  agent.theme_n = maze_gen.randn(player_themesl.size());
-  state->world_theme_n = maze_gen.randn(ground_themes.size());
-
-  agent.reset(0);
-
-  state->maze->is_terminated = false;
-  state->agent.is_killed = false;
-  state->agent.is_preparing_to_jump = false;
-  state->agent.killed_monster = false;
-  state->agent.bumped_head = false;
-  state->agent.killed_animation_frame_cnt = 0;
-  state->agent.finished_level_frame_cnt = 0;
-  state->agent.power_up_mode = false;
-  state->time = 0;
-  state->game_id += 1;
-
-  std::stringstream buffer;
-  buffer << "game_id,maze_seed,zoom,world_theme_n,agent_theme_n" << std::endl;
-  buffer << state->game_id << "," << level_seed << "," << agent.zoom << "," << state->world_theme_n << "," << agent.theme_n << std::endl;
-  for (int y=0; y<h; y++) {
-    for (int x=0; x<w; x++) {
-      int wkey = state->maze->get_elem(x, y);
-      char wkey_ch = wkey;
-      buffer << wkey_ch << ",";
+  float* f = out.obs_agent + e*SYMBOLIC_AGENT_DIM;
+  f[0] = a.x;
+  f[1] = a.y;
+  f[2] = a.vx;
+  f[3] = a.vy;
+  f[4] = a.spring;
+  f[5] = a.is_facing_right;
+  f[6] = a.ladder_mode;
+  f[7] = a.power_up_mode;
+  f[8] = a.is_killed;
+  f[9] = a.time_alive;
+
+  // insertion into a short sorted list, levels have a few dozen monsters at most
+  const Monsters& ms = maze->monsters;
+  int nearest[SYMBOLIC_MONSTERS];
+  float nearest_d2[SYMBOLIC_MONSTERS];
+  int cnt = 0;
+  for (int i = 0; i < ms.n; i++) {
+    float d2 = sqr(ms.x[i] - a.x) + sqr(ms.y[i] - a.y);
+    if (cnt == SYMBOLIC_MONSTERS && d2 >= nearest_d2[cnt-1])
+      continue;
+    int k = cnt < SYMBOLIC_MONSTERS ? cnt++ : cnt - 1;
+    for (; k > 0 && nearest_d2[k-1] > d2; k--) {
+      nearest[k] = nearest[k-1];
+      nearest_d2[k] = nearest_d2[k-1];
     }
+    nearest[k] = i;
+    nearest_d2[k] = d2;
+  }
+  float* m = out.obs_monsters + e*SYMBOLIC_MONSTERS*SYMBOLIC_MONSTER_DIM;
+  memset(m, 0, SYMBOLIC_MONSTERS*SYMBOLIC_MONSTER_DIM*sizeof(float));
+  for (int k = 0; k < cnt; k++, m += SYMBOLIC_MONSTER_DIM) {
+    int i = nearest[k];
+    m[0] = 1;
+    m[1] = ms.x[i] - a.x;
+    m[2] = ms.y[i] - a.y;
+    m[3] = ms.vx[i];
+    m[4] = ms.vy[i];
+    m[5] = ms.theme_n[i];
+    m[6] = ms.is_flying[i];
+    m[7] = ms.is_walking[i];
+    m[8] = ms.is_dead[i];
+    m[9] = ms.can_be_killed[i];
   }
-  buffer << std::endl;
-
-  monitor_csv_save_string(agent.monitor_csv, buffer.str().c_str());
 }
 
-// -- render --
-
+// Moves the results of a completed step into slot e of out, and clears the
+// per-step accumulators.
 static
-int to_shade(float f)
+void write_step_outputs(int e, const StepOutputs& out, State* state)
 {
-  int shade = int(f * 255);
-  if (shade < 0) shade = 0;
-  if (shade > 255) shade = 255;
-  return shade;
+  STATS_SCOPE(STAT_OUTPUTS);
+  Agent& a = state->agent;
+  if (a.collect_data) {
+    if (a.render_hires_buf && !state->video_sink && out.obs_hires_rgb)
+      copy_render_buf(e, out.obs_hires_rgb, a.render_hires_buf, VIDEORES, VIDEORES);
+    if (out.obs_audio_seg_map)
+      copy_audio_buf(e, out.obs_audio_seg_map, a.audio_seg_map_buf, AUDIO_MAP_SIZE);
+  }
+  if (a.symbolic_obs && out.obs_tiles)
+    write_symbolic_obs(e, out, state);
+  else if (!a.symbolic_obs && out.obs_rgb)
+    copy_render_buf(e, out.obs_rgb, a.render_buf, RES_W, RES_H);
+
+  if (out.events)
+    out.event_counts[e] = a.events.drain(out.events + size_t(e) * EVENT_RING_SIZE);
+  else
+    a.events.clear();
+
+  out.rew[e] = a.reward;
+  out.done[e] = a.game_over;
+  out.new_level[e] = state->maze->is_new_level;
+  a.reward = 0;
+  a.game_over = false;
+  state->maze->is_new_level = false;
 }
 
+template<int Cfg>
 static
-void paint_the_world_for_agent(
-  QPainter& p, const QRect& rect,
-  const std::shared_ptr<State>& state, const Agent* agent)
+void paint_agent_render_buf(uint8_t* buf, int res_w, int res_h, const std::shared_ptr<State>& todo_state, const Agent* a)
 {
-  // This function paints the 64x64 frame that is input for the agent. Some notable differences
-  // between this frame and the video frame are resolution (64x64 vs 1024x1024), monsters have
-  // trails in this frame so the agent knows their direction, a velocity patch is placed in the
-  // corner of the agent frame so it knows its own velocity. 
+  STATS_SCOPE(STAT_PAINT_AGENT);
+  if (USE_FAST_AGENT_RENDER) {
+    paint_the_world_for_agent_fast<Cfg>((uint32_t*)buf, res_w, res_h, todo_state, a);
+    return;
+  }
+  QImage img((uchar*)buf, res_w, res_h, res_w * 4, QImage::Format_RGB32);
+  QPainter p(&img);
+  paint_the_world_for_agent<Cfg>(p, QRect(0, 0, res_w, res_h), todo_state, a);
+}
 
-  const double zoom = 5.0;
-  const double bgzoom = 0.4;
+#ifdef COINRUN_GL
+// -- offscreen GL video painting --
+//
+// With VIDEO_GL, hires frames are drawn with OpenGL instead of QPainter. Every painting
+// thread gets its own headless EGL context (no window system, so no QGuiApplication
+// either) rendering into a framebuffer object. The themes of a ScaledThemes are packed
+// into one atlas texture the first time a frame uses them, the sprite list of
+// video_frame_sprites() becomes one instanced quad per sprite, drawn with one call per
+// run of sprites sharing a texture (the background, then usually everything else),
+// and the frame is read back through a pixel buffer object. A zoom or resolution change
+// brings other ScaledThemes, so only the textures of the last GL_THEMES_KEPT of them
+// stay uploaded.
+//
+// Unscaled sprites land on the rounded offsets the raster engine uses and sample texel
+// centers, so they match QPainter up to blending rounding; scaled ones (background,
+// dying monsters) are filtered bilinearly and differ a little more.
+
+#define GL_FUNCS(F) \
+  F(PFNGLGENFRAMEBUFFERSPROC, GenFramebuffers) \
+  F(PFNGLBINDFRAMEBUFFERPROC, BindFramebuffer) \
+  F(PFNGLFRAMEBUFFERRENDERBUFFERPROC, FramebufferRenderbuffer) \
+  F(PFNGLCHECKFRAMEBUFFERSTATUSPROC, CheckFramebufferStatus) \
+  F(PFNGLGENRENDERBUFFERSPROC, GenRenderbuffers) \
+  F(PFNGLBINDRENDERBUFFERPROC, BindRenderbuffer) \
+  F(PFNGLRENDERBUFFERSTORAGEPROC, RenderbufferStorage) \
+  F(PFNGLGENBUFFERSPROC, GenBuffers) \
+  F(PFNGLBINDBUFFERPROC, BindBuffer) \
+  F(PFNGLBUFFERDATAPROC, BufferData) \
+  F(PFNGLMAPBUFFERRANGEPROC, MapBufferRange) \
+  F(PFNGLUNMAPBUFFERPROC, UnmapBuffer) \
+  F(PFNGLGENVERTEXARRAYSPROC, GenVertexArrays) \
+  F(PFNGLBINDVERTEXARRAYPROC, BindVertexArray) \
+  F(PFNGLVERTEXATTRIBPOINTERPROC, VertexAttribPointer) \
+  F(PFNGLENABLEVERTEXATTRIBARRAYPROC, EnableVertexAttribArray) \
+  F(PFNGLVERTEXATTRIBDIVISORPROC, VertexAttribDivisor) \
+  F(PFNGLDRAWARRAYSINSTANCEDPROC, DrawArraysInstanced) \
+  F(PFNGLCREATESHADERPROC, CreateShader) \
+  F(PFNGLSHADERSOURCEPROC, ShaderSource) \
+  F(PFNGLCOMPILESHADERPROC, CompileShader) \
+  F(PFNGLGETSHADERIVPROC, GetShaderiv) \
+  F(PFNGLGETSHADERINFOLOGPROC, GetShaderInfoLog) \
+  F(PFNGLDELETESHADERPROC, DeleteShader) \
+  F(PFNGLCREATEPROGRAMPROC, CreateProgram) \
+  F(PFNGLATTACHSHADERPROC, AttachShader) \
+  F(PFNGLLINKPROGRAMPROC, LinkProgram) \
+  F(PFNGLGETPROGRAMIVPROC, GetProgramiv) \
+  F(PFNGLUSEPROGRAMPROC, UseProgram) \
+  F(PFNGLGETUNIFORMLOCATIONPROC, GetUniformLocation) \
+  F(PFNGLUNIFORM2FPROC, Uniform2f) \
+  F(PFNGLBLENDFUNCSEPARATEPROC, BlendFuncSeparate)
+
+struct GLFuncs {
+#define GL_FUNC_MEMBER(type, name) type name;
+  GL_FUNCS(GL_FUNC_MEMBER)
+#undef GL_FUNC_MEMBER
+};
 
-  bool lowres = rect.height() < 200;
-  GroundTheme* ground_theme = choose_ground_theme(state->world_theme_n, lowres);
+static GLFuncs gl;
+static QMutex gl_mutex;                       // guards the display and gl while loading
+static EGLDisplay gl_display = EGL_NO_DISPLAY;
+static bool gl_loaded = false;                // display tried and gl loaded, whether or not it worked
+
+static const char* VIDEO_VERTEX_SHADER =
+  "#version 330 core\n"
+  "layout(location = 0) in vec2 corner;\n"
+  "layout(location = 1) in vec4 dst;\n" // x, y, w, h in pixels, y down
+  "layout(location = 2) in vec4 src;\n" // u0, v0, u1, v1
+  "uniform vec2 res;\n"
+  "out vec2 uv;\n"
+  "void main() {\n"
+  "  uv = mix(src.xy, src.zw, corner);\n"
+  "  gl_Position = vec4((dst.xy + corner*dst.zw) / res * 2.0 - 1.0, 0.0, 1.0);\n"
+  "}\n";
+
+static const char* VIDEO_FRAGMENT_SHADER =
+  "#version 330 core\n"
+  "in vec2 uv;\n"
+  "uniform sampler2D tex;\n"
+  "out vec4 color;\n"
+  "void main() {\n"
+  "  color = texture(tex, uv);\n"
+  "}\n";
+
+const int GL_THEMES_KEPT = 4;
+
+// Where an image lives: its texture and the image's corner in texture coordinates.
+struct GLImage {
+  GLuint tex;
+  float u0, v0, du, dv; // du, dv per image pixel
+  const ScaledThemes* themes; // drawn when it was uploaded, the texture goes with them
+};
 
-  std::shared_ptr<Maze> maze = agent->maze;
+// The GL state of one painting thread, made current on that thread only. Rows go top
+// down both in textures and in the framebuffer, so the readback needs no flip.
+struct GLVideoRenderer {
+  EGLContext ctx = EGL_NO_CONTEXT;
+  GLuint program = 0;
+  GLint res_loc = -1;
+  GLuint vao = 0, quad = 0, instances = 0;
+  GLuint fbo = 0, color = 0;
+  int fb_w = 0, fb_h = 0;
+  GLuint pbo[2] = {0, 0};
+  int next_pbo = 0;
+  GLint max_texture_size = 0;
+  std::map<qint64, GLImage> images;              // by QImage::cacheKey()
+  std::vector<const ScaledThemes*> packed;       // themes in an atlas, last drawn last
+  std::vector<float> instance_data;
+  std::vector<VideoSprite> sprites;
+
+  ~GLVideoRenderer()
+  {
+    if (ctx == EGL_NO_CONTEXT)
+      return;
+    eglMakeCurrent(gl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(gl_display, ctx); // and every object in it
+  }
+};
 
-  double kx = zoom * rect.width()  / double(64);  // not w!
-  double ky = zoom * rect.height() / double(64);
-  double dx = (-agent->x) * kx + rect.center().x()  - 0.5*kx;
-  double dy = (agent->y) * ky - rect.center().y()   - 0.5*ky;
+// Opens the headless display and loads the functions, once per process.
+static
+bool gl_load()
+{
+  QMutexLocker lock(&gl_mutex);
+  if (gl_loaded)
+    return gl_display != EGL_NO_DISPLAY;
+  gl_loaded = true;
+
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+  EGLDisplay d = EGL_NO_DISPLAY;
+  if (get_platform_display)
+    d = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, 0);
+  if (d == EGL_NO_DISPLAY)
+    d = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (d == EGL_NO_DISPLAY || !eglInitialize(d, 0, 0)) {
+    fprintf(stderr, "coinrun: no EGL display, hires frames are painted with QPainter\n");
+    return false;
+  }
 
-  p.setRenderHint(QPainter::Antialiasing, true);
-  p.setRenderHint(QPainter::SmoothPixmapTransform, true);
-  p.setRenderHint(QPainter::HighQualityAntialiasing, true);
+#define GL_FUNC_LOAD(type, name) \
+  gl.name = (type) eglGetProcAddress("gl" #name); \
+  if (!gl.name) { \
+    fprintf(stderr, "coinrun: no gl" #name "(), hires frames are painted with QPainter\n"); \
+    return false; \
+  }
+  GL_FUNCS(GL_FUNC_LOAD)
+#undef GL_FUNC_LOAD
 
-  for (int tile_x=-1; tile_x<=2; tile_x++) {
-    for (int tile_y=-1; tile_y<=1; tile_y++) {
-      double zx = rect.width()*zoom;   // / bgzoom;
-      double zy = rect.height()*zoom;  // / bgzoom);
-      QRectF bg_image = QRectF(0, 0, zx, zy);
-      bg_image.moveCenter(QPointF(
-        zx*tile_x + rect.center().x() + bgzoom*(dx + kx*maze->h/2),
-        zy*tile_y + rect.center().y() + bgzoom*(dy - ky*maze->h/2)
-        ));
+  gl_display = d;
+  return true;
+}
 
-      p.fillRect(bg_image, QColor(30, 30, 30));
-      
-    }
+static
+GLuint gl_shader_compile(GLenum kind, const char* text)
+{
+  GLuint s = gl.CreateShader(kind);
+  gl.ShaderSource(s, 1, &text, 0);
+  gl.CompileShader(s);
+  GLint ok = 0;
+  gl.GetShaderiv(s, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    gl.GetShaderInfoLog(s, sizeof(log), 0, log);
+    fprintf(stderr, "coinrun: video shader does not compile, hires frames are painted with QPainter: %s\n", log);
+    gl.DeleteShader(s);
+    return 0;
   }
+  return s;
+}
 
-  int radius = int(1 + 64 / zoom);  // actually /2 works except near scroll limits
-  int ix = int(agent->x + .5);
-  int iy = int(agent->y + .5);
-  int x_start = max(ix - radius, 0);
-  int x_end = min(ix + radius + 1, maze->w);
-  int y_start = max(iy - radius, 0);
-  int y_end = min(iy + radius + 1, maze->h);
-  double WINH = rect.height();
-
-  for (int y=y_start; y<y_end; ++y) {
-    for (int x=x_start; x<x_end; x++) {
-      int wkey = maze->get_elem(x, y);
-      if (wkey==SPACE) continue;
+static bool gl_framebuffer_resize(GLVideoRenderer* r, int w, int h);
 
-      auto f = ground_theme->walls.find(wkey);
-      QImage img = f == ground_theme->walls.end() ? ground_theme->default_wall : f->second;
-      QRectF dst = QRectF(kx*x + dx, WINH - ky*y + dy, kx + .5, ky + .5);
-      dst.adjust(-0.1, -0.1, +0.1, +0.1); // here an attempt to fix subpixel seams that appear on the image, especially lowres
-      
-      if (wkey==LAVA_MIDDLE || wkey==LAVA_SURFACE) {
-        QRectF d1 = dst;
-        QRectF d2 = dst;
-        QRectF sr(QPointF(0,0), img.size());
-        QRectF sr1 = sr;
-        QRectF sr2 = sr;
-        float tr = state->time*0.1;
-        tr -= int(tr);
-        tr *= -1;
-        d1.translate(tr*dst.width(), 0);
-        d2.translate(dst.width() + tr*dst.width(), 0);
-        sr1.translate(-tr*img.width(), 0);
-        sr2.translate(-img.width() - tr*img.width(), 0);
-        d1 &= dst;
-        d2 &= dst;
-        d1.adjust(0, 0, +0.5, 0);
-        d2.adjust(-0.5, 0, 0, 0);
-        sr1 &= sr;
-        sr2 &= sr;
-        if (!sr1.isEmpty())
-          p.drawImage(d1, img, sr1);
-        if (!sr2.isEmpty())
-          p.drawImage(d2, img, sr2);
-      } else {
-        p.drawImage(dst, img);
-      }
-    }
+// Null when there is no usable GL 3.3, the caller then paints with QPainter.
+static
+GLVideoRenderer* gl_renderer_create()
+{
+  if (!gl_load())
+    return 0;
+
+  EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE };
+  EGLint context_attribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE };
+  EGLConfig config;
+  EGLint n = 0;
+  std::unique_ptr<GLVideoRenderer> r(new GLVideoRenderer());
+  if (eglBindAPI(EGL_OPENGL_API) &&
+      eglChooseConfig(gl_display, config_attribs, &config, 1, &n) && n == 1)
+    r->ctx = eglCreateContext(gl_display, config, EGL_NO_CONTEXT, context_attribs);
+  if (r->ctx == EGL_NO_CONTEXT || !eglMakeCurrent(gl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, r->ctx)) {
+    fprintf(stderr, "coinrun: cannot create a GL 3.3 context (EGL error 0x%x), hires frames are painted with QPainter\n", eglGetError());
+    return 0;
   }
 
-  PlayerTheme* active_theme = choose_player_theme(agent->theme_n, agent->is_facing_right, lowres);
-  QImage img = agent->picture(active_theme);
-  if (agent->power_up_mode) {
-    for (int x = 0; x < img.width(); x++) {
-      for (int y = 0; y < img.height(); y++) {
-        QColor pixel_color = img.pixelColor(x, y);
-        pixel_color.setRgb(pixel_color.blue(), pixel_color.red(), pixel_color.green(), pixel_color.alpha());
-        img.setPixelColor(x, y, pixel_color);
-      }
-    }
+  GLuint vs = gl_shader_compile(GL_VERTEX_SHADER, VIDEO_VERTEX_SHADER);
+  GLuint fs = vs ? gl_shader_compile(GL_FRAGMENT_SHADER, VIDEO_FRAGMENT_SHADER) : 0;
+  if (!fs) {
+    if (vs)
+      gl.DeleteShader(vs);
+    return 0;
   }
-  QRectF dst = QRectF(kx * agent->x + dx, WINH - ky * (agent->y+1) + dy, kx, 2 * ky);
-  p.drawImage(dst, img);  
-  
-  int monsters_count = maze->monsters.size();
-  for (int i=0; i<monsters_count; ++i) {
-    const std::shared_ptr<Monster>& m = maze->monsters[i];
-    QRectF dst = QRectF(kx*m->x + dx, WINH - ky*m->y + dy, kx, ky);
+  r->program = gl.CreateProgram();
+  gl.AttachShader(r->program, vs);
+  gl.AttachShader(r->program, fs);
+  gl.LinkProgram(r->program);
+  gl.DeleteShader(vs);
+  gl.DeleteShader(fs);
+  GLint linked = 0;
+  gl.GetProgramiv(r->program, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    fprintf(stderr, "coinrun: video shaders do not link, hires frames are painted with QPainter\n");
+    return 0;
+  }
+  gl.UseProgram(r->program);
+  r->res_loc = gl.GetUniformLocation(r->program, "res");
+
+  // a unit quad, stretched over dst by the instance attributes
+  static const float corners[8] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+  gl.GenVertexArrays(1, &r->vao);
+  gl.BindVertexArray(r->vao);
+  gl.GenBuffers(1, &r->quad);
+  gl.BindBuffer(GL_ARRAY_BUFFER, r->quad);
+  gl.BufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+  gl.VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+  gl.EnableVertexAttribArray(0);
+  gl.GenBuffers(1, &r->instances);
+  gl.EnableVertexAttribArray(1);
+  gl.EnableVertexAttribArray(2);
+  gl.VertexAttribDivisor(1, 1);
+  gl.VertexAttribDivisor(2, 1);
+
+  gl.GenFramebuffers(1, &r->fbo);
+  gl.GenRenderbuffers(1, &r->color);
+  gl.GenBuffers(2, r->pbo);
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &r->max_texture_size);
+
+  // premultiplied source over, keeping the cleared alpha like an RGB32 QImage
+  glEnable(GL_BLEND);
+  gl.BlendFuncSeparate(GL_ONE, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
+
+  // frames are VIDEORES square, a driver that can't hold one fails here and not mid-run
+  if (!gl_framebuffer_resize(r.get(), VIDEORES, VIDEORES) || glGetError() != GL_NO_ERROR) {
+    fprintf(stderr, "coinrun: cannot set up a %ix%i GL framebuffer, hires frames are painted with QPainter\n", VIDEORES, VIDEORES);
+    return 0;
+  }
+  return r.release();
+}
 
-    EnemyTheme* theme = choose_enemy_theme(m, i, lowres);
-    if ((m->is_flying || m->is_walking) && !m->is_dead) {
-      for (int t=2; t<MONSTER_TRAIL; t+=2) {
-        QRectF dst = QRectF(kx*m->prev_x[t] + dx, WINH - ky*m->prev_y[t] + dy, kx, ky);
-        float ft = 1 - float(t)/MONSTER_TRAIL;
-        float smaller = 0.20;
-        float lower = -0.22;
-        float soar = -0.4;
-        dst.adjust(
-          (smaller-0.2*ft)*kx, (soar*ft-0.2*ft-lower+smaller)*ky,
-          (-smaller+0.2*ft)*kx, (soar*ft+0.2*ft-lower-smaller)*ky);
-        p.setBrush(QColor(255,255,255, t*127/MONSTER_TRAIL));
-        p.setPen(Qt::NoPen);
-        p.drawEllipse(dst);
-      }
-    }
-    QImage monster_image;
-    if (m->is_dead) {
-      monster_image = theme->dead;
-      m->monster_dying_frame_cnt = max(0, m->monster_dying_frame_cnt);
-      double monster_shrinkage = (MONSTER_DEATH_ANIM_LENGTH - m->monster_dying_frame_cnt) * 0.8 / MONSTER_DEATH_ANIM_LENGTH;
-      dst = QRectF(kx*m->x + dx, WINH - ky*m->y + dy + ky * monster_shrinkage, kx, ky * (1 - monster_shrinkage));
-      m->monster_dying_frame_cnt -= 1;
-    } else if (theme->is_jumping_monster) {
-      monster_image = m->vy == 0 ? theme->walk1 : theme->walk2;
-    } else {
-      monster_image = state->time / theme->anim_freq % 2 == 0 ? theme->walk1 : theme->walk2;
-    }
-    p.drawImage(dst, monster_image);
+// The renderer of the calling thread, created on first use; null if GL is unusable.
+static
+GLVideoRenderer* gl_renderer()
+{
+  static thread_local std::unique_ptr<GLVideoRenderer> r;
+  static thread_local bool tried = false;
+  if (!tried) {
+    tried = true;
+    r.reset(gl_renderer_create());
   }
+  return r.get();
+}
 
-  if (USE_DATA_AUGMENTATION) {
-    float max_rand_dim = .25;
-    float min_rand_dim = .1;
-    int num_blotches = global_rand_gen.randint(0, 6);
+static
+GLuint gl_texture_upload(int w, int h, const uint8_t* premultiplied_bgra)
+{
+  GLuint tex;
+  glGenTextures(1, &tex);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_BGRA, GL_UNSIGNED_BYTE, premultiplied_bgra);
+  return tex;
+}
 
-    bool hard_blotches = false;
+// Images outside any atlas (backgrounds, faded hit poses) get a texture of their own,
+// which belongs to the themes being drawn.
+static
+const GLImage& gl_image(GLVideoRenderer* r, const QImage& img, const ScaledThemes* themes)
+{
+  std::map<qint64, GLImage>::iterator it = r->images.find(img.cacheKey());
+  if (it != r->images.end())
+    return it->second;
+  QImage c = img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+  int w = c.width();
+  int h = c.height();
+  std::vector<uint8_t> pixels(size_t(w) * h * 4);
+  for (int y = 0; y < h; y++)
+    memcpy(&pixels[size_t(y) * w * 4], c.constScanLine(y), w * 4);
+  GLImage g;
+  g.tex = gl_texture_upload(w, h, pixels.data());
+  g.u0 = 0;
+  g.v0 = 0;
+  g.du = 1.0f / w;
+  g.dv = 1.0f / h;
+  g.themes = themes;
+  return r->images[img.cacheKey()] = g;
+}
 
-    if (hard_blotches) {
-      max_rand_dim = .3;
-      min_rand_dim = .2;
-      num_blotches = global_rand_gen.randint(0, 10);
+// Packs every sprite of themes into shelves of one texture, a pixel apart so bilinear
+// scaling doesn't bleed in the neighbours. What doesn't fit in the largest texture is
+// left to gl_image().
+static
+void gl_atlas_pack(GLVideoRenderer* r, const ScaledThemes* themes)
+{
+  std::vector<const QImage*> imgs;
+  for (const GroundTheme& g: themes->ground) {
+    for (const std::pair<const char, QImage>& pair: g.walls)
+      imgs.push_back(&pair.second);
+    imgs.push_back(&g.default_wall);
+  }
+  for (const std::vector<PlayerTheme>* v: { &themes->playerl, &themes->playerr, &themes->playerl_power_up, &themes->playerr_power_up })
+    for (const PlayerTheme& t: *v)
+      for (const QImage* img: { &t.stand, &t.front, &t.walk1, &t.walk2, &t.climb1, &t.climb2, &t.jump, &t.duck, &t.hit })
+        imgs.push_back(img);
+  for (const std::vector<EnemyTheme>* v: { &themes->enemyl, &themes->enemyr })
+    for (const EnemyTheme& t: *v)
+      for (const QImage* img: { &t.walk1, &t.walk2, &t.dead })
+        imgs.push_back(img);
+  imgs.push_back(&themes->power_up_shield);
+
+  std::sort(imgs.begin(), imgs.end(), [](const QImage* a, const QImage* b) { return a->height() > b->height(); });
+  int64_t area = 0;
+  for (const QImage* img: imgs)
+    area += int64_t(img->width() + 1) * (img->height() + 1);
+  int atlas_w = 256;
+  while (atlas_w < r->max_texture_size && int64_t(atlas_w) * atlas_w < area)
+    atlas_w *= 2;
+  atlas_w = min(atlas_w, r->max_texture_size);
+
+  struct Place { const QImage* img; int x, y; };
+  std::vector<Place> places;
+  std::map<qint64, bool> placed; // copies of one image share the key
+  int x = 0, y = 0, shelf_h = 0;
+  for (const QImage* img: imgs) {
+    if (r->images.count(img->cacheKey()) || placed[img->cacheKey()] || img->width() > atlas_w)
+      continue;
+    if (x + img->width() > atlas_w) {
+      x = 0;
+      y += shelf_h + 1;
+      shelf_h = 0;
     }
+    if (y + img->height() > r->max_texture_size)
+      break;
+    places.push_back(Place{img, x, y});
+    placed[img->cacheKey()] = true;
+    x += img->width() + 1;
+    shelf_h = max(shelf_h, img->height());
+  }
+  int atlas_h = y + shelf_h;
+  if (places.empty() || atlas_h == 0)
+    return;
 
-    for (int j = 0; j < num_blotches; j++) {
-      float rx = global_rand_gen.rand01() * rect.width();
-      float ry = global_rand_gen.rand01() * rect.height();
-      float rdx = (global_rand_gen.rand01() * max_rand_dim + min_rand_dim) * rect.width();
-      float rdy = (global_rand_gen.rand01() * max_rand_dim + min_rand_dim) * rect.height();
+  std::vector<uint8_t> pixels(size_t(atlas_w) * atlas_h * 4, 0);
+  for (const Place& p: places) {
+    QImage c = p.img->convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    for (int row = 0; row < c.height(); row++)
+      memcpy(&pixels[(size_t(p.y + row) * atlas_w + p.x) * 4], c.constScanLine(row), c.width() * 4);
+  }
+  GLuint tex = gl_texture_upload(atlas_w, atlas_h, pixels.data());
+  for (const Place& p: places) {
+    GLImage g;
+    g.tex = tex;
+    g.u0 = float(p.x) / atlas_w;
+    g.v0 = float(p.y) / atlas_h;
+    g.du = 1.0f / atlas_w;
+    g.dv = 1.0f / atlas_h;
+    g.themes = themes;
+    r->images[p.img->cacheKey()] = g;
+  }
+}
 
-      QRectF dst3 = QRectF(rx, ry, rdx, rdy);
-      p.fillRect(dst3, QColor(global_rand_gen.randint(0, 255), global_rand_gen.randint(0, 255), global_rand_gen.randint(0, 255)));
+// Deletes the textures that came with themes, the atlas and the images of their frames.
+static
+void gl_themes_evict(GLVideoRenderer* r, const ScaledThemes* themes)
+{
+  std::vector<GLuint> tex;
+  for (std::map<qint64, GLImage>::iterator it = r->images.begin(); it != r->images.end(); ) {
+    if (it->second.themes != themes) {
+      ++it;
+      continue;
     }
+    if (std::find(tex.begin(), tex.end(), it->second.tex) == tex.end())
+      tex.push_back(it->second.tex);
+    it = r->images.erase(it);
   }
+  if (!tex.empty())
+    glDeleteTextures(tex.size(), tex.data());
+}
 
-  if (PAINT_VEL_INFO) {
-    float infodim = rect.height() * .2;
-    QRectF dst2 = QRectF(0, 0, infodim, infodim);
-    int s0 = to_shade(agent->spring / maze->max_jump);
-    int s1 = to_shade(.5 * agent->vx / maze->max_speed + .5);
-    int s2 = to_shade(.5 * agent->vy / maze->max_jump + .5);
-    p.fillRect(dst2, QColor(s1, s1, s1));
+// Makes sure the sprites of themes are packed, and evicts the themes drawn longest ago
+// when more than GL_THEMES_KEPT have textures here.
+static
+void gl_themes_use(GLVideoRenderer* r, const ScaledThemes* themes)
+{
+  if (!r->packed.empty() && r->packed.back() == themes)
+    return;
+  std::vector<const ScaledThemes*>::iterator it = std::find(r->packed.begin(), r->packed.end(), themes);
+  if (it != r->packed.end()) {
+    r->packed.erase(it);
+    r->packed.push_back(themes);
+    return;
+  }
+  if ((int)r->packed.size() == GL_THEMES_KEPT) {
+    gl_themes_evict(r, r->packed.front());
+    r->packed.erase(r->packed.begin());
+  }
+  gl_atlas_pack(r, themes);
+  r->packed.push_back(themes);
+}
 
-    QRectF dst3 = QRectF(infodim, 0, infodim, infodim);
-    p.fillRect(dst3, QColor(s2, s2, s2));
+// False if the framebuffer is not complete at this size.
+static
+bool gl_framebuffer_resize(GLVideoRenderer* r, int w, int h)
+{
+  if (r->fb_w == w && r->fb_h == h)
+    return true;
+  r->fb_w = w;
+  r->fb_h = h;
+  gl.BindRenderbuffer(GL_RENDERBUFFER, r->color);
+  gl.RenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+  gl.BindFramebuffer(GL_FRAMEBUFFER, r->fbo);
+  gl.FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, r->color);
+  if (gl.CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    return false;
+  for (int i = 0; i < 2; i++) {
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, r->pbo[i]);
+    gl.BufferData(GL_PIXEL_PACK_BUFFER, size_t(w) * h * 4, 0, GL_STREAM_READ);
   }
+  glViewport(0, 0, w, h);
+  gl.Uniform2f(r->res_loc, w, h);
+  return true;
 }
 
 static
-void paint_the_world_for_video_data(
-  QPainter& p, const QRect& rect,
-  const std::shared_ptr<State>& state, const Agent* agent)
+void gl_draw_run(GLVideoRenderer* r, GLuint tex, int first, int count)
 {
-  const_cast<Agent*>(agent)->zoom = 0.9*agent->zoom + 0.1*agent->target_zoom;
-  double zoom = agent->zoom;
-  const double bgzoom = 0.4;
+  const int stride = 8 * sizeof(float);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  gl.VertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, stride, (const void*)(size_t(first) * stride));
+  gl.VertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, (const void*)(size_t(first) * stride + 4 * sizeof(float)));
+  gl.DrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+}
 
-  bool lowres = rect.height() < 200;
-  GroundTheme* ground_theme = choose_ground_theme(state->world_theme_n, lowres);
+// Draws f and starts reading it back. Returns the pixel buffer to hand to
+// gl_video_frame_read(), which alternates so one frame can be read while the next is drawn.
+static
+int gl_video_frame_draw(GLVideoRenderer* r, int res_w, int res_h, const VideoFrame& f, ScaledThemes*& themes_memo)
+{
+  video_frame_sprites(&r->sprites, QRect(0, 0, res_w, res_h), f, themes_memo);
+  gl_themes_use(r, themes_memo);
+  bool fb_ok = gl_framebuffer_resize(r, res_w, res_h);
+  assert(fb_ok && "GL framebuffer incomplete");
+  (void)fb_ok;
+
+  std::vector<float>& d = r->instance_data;
+  std::vector<GLuint> tex(r->sprites.size());
+  d.resize(r->sprites.size() * 8);
+  for (size_t i = 0; i < r->sprites.size(); i++) {
+    const VideoSprite& s = r->sprites[i];
+    const GLImage& g = gl_image(r, *s.img, themes_memo);
+    QRectF src = s.src.isEmpty() ? QRectF(0, 0, s.img->width(), s.img->height()) : s.src;
+    float* p = &d[i * 8];
+    if (s.scaled) {
+      p[0] = s.dst.x();
+      p[1] = s.dst.y();
+    } else {
+      // the raster engine blends unscaled images at the rounded offset
+      p[0] = floor(s.dst.x() + 0.5);
+      p[1] = floor(s.dst.y() + 0.5);
+    }
+    p[2] = s.dst.width();
+    p[3] = s.dst.height();
+    p[4] = g.u0 + src.x() * g.du;
+    p[5] = g.v0 + src.y() * g.dv;
+    p[6] = g.u0 + (src.x() + src.width()) * g.du;
+    p[7] = g.v0 + (src.y() + src.height()) * g.dv;
+    tex[i] = g.tex;
+  }
 
-  std::shared_ptr<Maze> maze = agent->maze;
+  gl.BindFramebuffer(GL_FRAMEBUFFER, r->fbo);
+  glClearColor(0, 0, 0, 1);
+  glClear(GL_COLOR_BUFFER_BIT);
+  gl.BindBuffer(GL_ARRAY_BUFFER, r->instances);
+  gl.BufferData(GL_ARRAY_BUFFER, d.size() * sizeof(float), d.data(), GL_STREAM_DRAW);
+  int first = 0;
+  for (int i = 1; i <= int(tex.size()); i++) {
+    if (i < int(tex.size()) && tex[i] == tex[first])
+      continue;
+    gl_draw_run(r, tex[first], first, i - first);
+    first = i;
+  }
 
+  int slot = r->next_pbo;
+  r->next_pbo ^= 1;
+  gl.BindBuffer(GL_PIXEL_PACK_BUFFER, r->pbo[slot]);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(0, 0, res_w, res_h, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+  glFlush();
+  return slot;
+}
 
-  double kx = zoom * rect.width()  / double(64);  // not w!
-  double ky = zoom * rect.height() / double(64);
-  double dx = (-agent->x) * kx + rect.center().x()  - 0.5*kx;
-  double dy = -rect.center().y()  + 5.0*ky;
-  double alien_y = rect.height() - ky * (agent->y+1) + dy;
+// Waits for the readback started by gl_video_frame_draw() and copies it into buf, in
+// the Format_RGB32 layout QPainter would have left.
+static
+void gl_video_frame_read(GLVideoRenderer* r, int slot, uint8_t* buf)
+{
+  size_t size = size_t(r->fb_w) * r->fb_h * 4;
+  gl.BindBuffer(GL_PIXEL_PACK_BUFFER, r->pbo[slot]);
+  const void* p = gl.MapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+  assert(p);
+  memcpy(buf, p, size);
+  gl.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+}
+#endif
 
-  p.setRenderHint(QPainter::Antialiasing, true);
-  p.setRenderHint(QPainter::SmoothPixmapTransform, true);
-  p.setRenderHint(QPainter::HighQualityAntialiasing, true);
+static
+void paint_video_data_render_buf(uint8_t* buf, int res_w, int res_h, const VideoFrame& f, ScaledThemes*& themes_memo)
+{
+#ifdef COINRUN_GL
+  GLVideoRenderer* r = VIDEO_GL ? gl_renderer() : 0;
+  if (r) {
+    gl_video_frame_read(r, gl_video_frame_draw(r, res_w, res_h, f, themes_memo), buf);
+    return;
+  }
+#endif
+  QImage img((uchar*)buf, res_w, res_h, res_w * 4, QImage::Format_RGB32);
+  QPainter p(&img);
+  paint_the_world_for_video_data(p, QRect(0, 0, res_w, res_h), f, themes_memo);
+}
 
-  for (int tile_x=-1; tile_x<=2; tile_x++) {
-    for (int tile_y=-1; tile_y<=1; tile_y++) {
-      double zx = rect.width()*zoom;   // / bgzoom;
-      double zy = rect.height()*zoom;  // / bgzoom);
-      QRectF bg_image = QRectF(0, 0, zx, zy);
-      bg_image.moveCenter(QPointF(
-        zx*tile_x + rect.center().x() + bgzoom*(dx + kx*maze->h/2),
-        zy*tile_y + rect.center().y() + bgzoom*(dy - ky*maze->h/2)
-        ));
+// -- video sink --
+//
+// Streams the hires frames of one env straight to disk instead of handing them to
+// Python, one file per game so they line up with the game_id records in the env's
+// monitor.csv. Y4M is written directly (4:4:4, BT.601 studio range), ffmpeg gets
+// raw RGB32 through a pipe and encodes h264.
 
-      p.drawImage(bg_image, bg_images[state->world_theme_n]);
-    }
+enum { VIDEO_SINK_OFF = 0, VIDEO_SINK_Y4M = 1, VIDEO_SINK_FFMPEG = 2 };
+const int VIDEO_SINK_FPS = 30;
+
+static int video_sink_kind = VIDEO_SINK_OFF;
+static std::string video_sink_dir;
+
+// Quoted for the shell that popen() runs ffmpeg with: inside single quotes everything
+// is literal except the quote itself, which closes the quotes, is escaped and reopens.
+static
+std::string shell_quote(const std::string& s)
+{
+  std::string q = "'";
+  for (char c: s) {
+    if (c == '\'')
+      q += "'\\''";
+    else
+      q += c;
   }
+  return q + "'";
+}
 
-  int radius = int(1 + 64 / zoom);  // actually /2 works except near scroll limits
-  int ix = int(agent->x + .5);
-  int iy = int(agent->y + .5);
-  int x_start = max(ix - radius, 0);
-  int x_end = min(ix + radius + 1, maze->w);
-  int y_start = max(iy - radius, 0);
-  int y_end = min(iy + radius + 1, maze->h);
-  double WINH = rect.height();
+struct VideoSink {
+  std::string prefix; // output path without the game suffix
+  int game_id = -1;
+  FILE* f = 0;
+  std::vector<uint8_t> yuv;
 
-  for (int y=y_start; y<y_end; ++y) {
-    for (int x=x_start; x<x_end; x++) {
-      int wkey = maze->get_elem(x, y);
-      if (wkey==SPACE) continue;
+  ~VideoSink() { close(); }
 
-      auto f = ground_theme->walls.find(wkey);
-      QImage img = f == ground_theme->walls.end() ? ground_theme->default_wall : f->second;
-      QRectF dst = QRectF(kx*x + dx, WINH - ky*y + dy, kx + .5, ky + .5);
-      dst.adjust(-0.1, -0.1, +0.1, +0.1); // here an attempt to fix subpixel seams that appear on the image, especially lowres
-      
-      if (wkey==LAVA_MIDDLE || wkey==LAVA_SURFACE) {
-        QRectF d1 = dst;
-        QRectF d2 = dst;
-        QRectF sr(QPointF(0,0), img.size());
-        QRectF sr1 = sr;
-        QRectF sr2 = sr;
-        float tr = state->time*0.1;
-        tr -= int(tr);
-        tr *= -1;
-        d1.translate(tr*dst.width(), 0);
-        d2.translate(dst.width() + tr*dst.width(), 0);
-        sr1.translate(-tr*img.width(), 0);
-        sr2.translate(-img.width() - tr*img.width(), 0);
-        d1 &= dst;
-        d2 &= dst;
-        d1.adjust(0, 0, +0.5, 0);
-        d2.adjust(-0.5, 0, 0, 0);
-        sr1 &= sr;
-        sr2 &= sr;
-        if (!sr1.isEmpty())
-          p.drawImage(d1, img, sr1);
-        if (!sr2.isEmpty())
-          p.drawImage(d2, img, sr2);
-      } else {
-        p.drawImage(dst, img);
+  void close()
+  {
+    if (!f)
+      return;
+    if (video_sink_kind == VIDEO_SINK_FFMPEG)
+      pclose(f);
+    else
+      fclose(f);
+    f = 0;
+  }
+
+  void open(int new_game_id)
+  {
+    close();
+    game_id = new_game_id;
+    if (video_sink_kind == VIDEO_SINK_FFMPEG) {
+      std::string fn = prefix + stdprintf(".game%05i.mp4", game_id);
+      std::string cmd = stdprintf(
+        "ffmpeg -y -loglevel error -f rawvideo -pix_fmt rgb32 -s:v %ix%i -r %i -i - "
+        "-vcodec libx264 -pix_fmt yuv420p -crf 10 %s",
+        VIDEORES, VIDEORES, VIDEO_SINK_FPS, shell_quote(fn).c_str());
+      f = popen(cmd.c_str(), "w");
+    } else {
+      std::string fn = prefix + stdprintf(".game%05i.y4m", game_id);
+      f = fopen(fn.c_str(), "wb");
+      if (f)
+        fprintf(f, "YUV4MPEG2 W%i H%i F%i:1 Ip A1:1 C444\n", VIDEORES, VIDEORES, VIDEO_SINK_FPS);
+    }
+    if (!f)
+      fprintf(stderr, "coinrun: cannot open video sink %s for game %i\n", prefix.c_str(), game_id);
+  }
+
+  // rgb32 is a VIDEORES x VIDEORES Format_RGB32 frame of game new_game_id.
+  void write(const uint8_t* rgb32, int new_game_id)
+  {
+    if (new_game_id != game_id)
+      open(new_game_id);
+    if (!f)
+      return;
+    int n = VIDEORES*VIDEORES;
+    if (video_sink_kind == VIDEO_SINK_FFMPEG) {
+      // an ffmpeg that died shows as a short write (SIGPIPE is ignored, see
+      // initialize_set_video_sink()), the rest of the game is then dropped
+      if (fwrite(rgb32, 4, n, f) != size_t(n)) {
+        fprintf(stderr, "coinrun: ffmpeg stopped taking frames for %s game %i: %s\n", prefix.c_str(), game_id, strerror(errno));
+        close();
       }
+      return;
     }
+    yuv.resize(3*n);
+    uint8_t* py = yuv.data();
+    uint8_t* pu = py + n;
+    uint8_t* pv = pu + n;
+    for (int i = 0; i < n; i++) {
+      int b = rgb32[4*i + 0];
+      int g = rgb32[4*i + 1];
+      int r = rgb32[4*i + 2];
+      py[i] = uint8_t((( 66*r + 129*g +  25*b + 128) >> 8) + 16);
+      pu[i] = uint8_t(((-38*r -  74*g + 112*b + 128) >> 8) + 128);
+      pv[i] = uint8_t(((112*r -  94*g -  18*b + 128) >> 8) + 128);
+    }
+    fputs("FRAME\n", f);
+    fwrite(yuv.data(), 1, yuv.size(), f);
   }
+};
 
-  
-  // save states to monitor.csv for converting to json metadata
-  std::stringstream buffer;
+// -- asynchronous video --
+//
+// With VIDEO_THREADS > 0 a step only snapshots the video frame and hands it to a
+// render thread; the hires buffer in the step outputs is left alone, and finished
+// frames go to the env's VideoSink, or wait in its VideoQueue until vec_video_drain()
+// picks them up. Every
+// env always goes to the same render thread, so its frames come out in step order.
+
+const int VIDEO_MAX_PENDING = 8; // per env, queued or painted but not drained yet
+
+struct VideoQueue {
+  int render_thread;
+  QMutex mutex;
+  QWaitCondition changed;
+  int pending = 0;
+  std::deque<std::unique_ptr<VideoFrame>> done;
+  std::vector<std::unique_ptr<VideoFrame>> spare; // drained frames, reused with their pixel buffers
+  ScaledThemes* themes = 0; // find_scaled_themes() memo, only used by the render thread
+  std::shared_ptr<VideoSink> sink;
+};
 
-  // save frame and agent information
-  buffer << "time_alive,agent_x,agent_y,agent_vx,agent_vy,agent_facing_right,agent_ladder,agent_spring,is_killed,killed_animation_frame_cnt,finished_level_frame_cnt,killed_monster,bumped_head,collected_coin,collected_gem,power_up_mode" << std::endl;
-  buffer << agent->time_alive << "," << agent->x << "," << agent->y << "," << agent->vx << "," << agent->vy << ",";
-  buffer << agent->is_facing_right << "," << agent->ladder_mode << "," << agent->spring << ",";
-  buffer << agent->is_killed << "," << agent->killed_animation_frame_cnt << "," << agent->finished_level_frame_cnt << ",";
-  buffer << agent->killed_monster << "," << agent->bumped_head << "," << agent->collected_coin << ",";
-  buffer << agent->collected_gem << "," << agent->power_up_mode << std::endl;
+struct RenderJob {
+  std::shared_ptr<VideoQueue> queue;
+  std::unique_ptr<VideoFrame> frame;
+};
 
-  int monsters_count = maze->monsters.size();
-  // save general monster information
-  buffer << "state_time,monsters_count,m_id,m_x,m_y,m_vx,m_vy,m_theme,m_flying,m_walking,m_jumping,m_dead,m_anim_freq,monster_dying_frame_cnt" << std::endl;
-  buffer << state->time << "," << monsters_count << ",";
-  for (int i=0; i<monsters_count; ++i) {
-    const std::shared_ptr<Monster>& m = maze->monsters[i];
-    QRectF dst = QRectF(kx*m->x + dx, WINH - ky*m->y + dy, kx, ky);
-
-    EnemyTheme* theme = choose_enemy_theme(m, i, lowres);
-
-    // save individual monster information, do this before monster_dying_frame_cnt may decrease
-    buffer << i << "," << m->x << "," << m->y << "," << m->vx << "," << m->vy << "," << m->theme_n << ",";
-    buffer << m->is_flying << "," << m->is_walking << "," << theme->is_jumping_monster << ",";
-    buffer << m->is_dead << "," << theme->anim_freq << "," << m->monster_dying_frame_cnt << ",";
-  
-    QImage monster_image;
-    if (m->is_dead) {
-      monster_image = theme->dead;
-      m->monster_dying_frame_cnt = max(0, m->monster_dying_frame_cnt);
-      double monster_shrinkage = (MONSTER_DEATH_ANIM_LENGTH - m->monster_dying_frame_cnt) * 0.8 / MONSTER_DEATH_ANIM_LENGTH;
-      dst = QRectF(kx*m->x + dx, WINH - ky*m->y + dy + ky * monster_shrinkage, kx, ky * (1 - monster_shrinkage));
-    } else if (theme->is_jumping_monster) {
-      monster_image = m->vy == 0 ? theme->walk1 : theme->walk2;
-    } else {
-      monster_image = state->time / theme->anim_freq % 2 == 0 ? theme->walk1 : theme->walk2;
+struct RenderQueue {
+  QMutex mutex;
+  QWaitCondition wake;
+  std::deque<RenderJob> jobs;
+};
+
+static std::vector<std::unique_ptr<RenderQueue>> render_queues;
+static std::vector<std::shared_ptr<QThread>> render_threads;
+
+// Blocks while the env already has VIDEO_MAX_PENDING undrained frames.
+static
+void video_submit(const std::shared_ptr<State>& state, Agent* a)
+{
+  const std::shared_ptr<VideoQueue>& q = state->video;
+  std::unique_ptr<VideoFrame> f;
+  {
+    QMutexLocker lock(&q->mutex);
+    while (q->pending >= VIDEO_MAX_PENDING && !shutdown_flag && !state->belongs_to.expired())
+      q->changed.wait(&q->mutex, 1000); // milliseconds
+    q->pending++;
+    if (!q->spare.empty()) {
+      f = std::move(q->spare.back());
+      q->spare.pop_back();
     }
-    p.drawImage(dst, monster_image);
   }
-  buffer << std::endl;
+  if (!f)
+    f.reset(new VideoFrame);
+  video_frame_snapshot(f.get(), state, a);
+
+  RenderJob job;
+  job.queue = q;
+  job.frame = std::move(f);
+  RenderQueue* rq = render_queues[q->render_thread].get();
+  QMutexLocker lock(&rq->mutex);
+  rq->jobs.push_back(std::move(job));
+  rq->wake.wakeOne();
+}
 
+// Hands a painted frame back to its env, or writes it out and recycles it.
+static
+void video_job_finish(RenderJob& job)
+{
+  VideoFrame* f = job.frame.get();
+  if (job.queue->sink)
+    job.queue->sink->write(f->pixels.data(), f->game_id);
+
+  QMutexLocker lock(&job.queue->mutex);
+  if (job.queue->sink) {
+    job.queue->pending--;
+    job.queue->spare.push_back(std::move(job.frame));
+  } else {
+    job.queue->done.push_back(std::move(job.frame));
+  }
+  job.queue->changed.wakeAll();
+}
 
-  PlayerTheme* active_theme = choose_player_theme(agent->theme_n, agent->is_facing_right, lowres);
-  QImage img = agent->picture(active_theme);
-  if (agent->is_killed && agent->collect_data) {
-    for (int x = 0; x < img.width(); x++) {
-      for (int y = 0; y < img.height(); y++) {
-        QColor pixel_color = img.pixelColor(x, y);
-        int hue = pixel_color.hue();
-        int saturation = max(pixel_color.saturation()-(DEATH_ANIM_LENGTH + 1 - agent->killed_animation_frame_cnt)*12, 0);
-        int value = max(pixel_color.value(), 0);
-        int alpha = max(pixel_color.alpha()-(DEATH_ANIM_LENGTH + 1 - agent->killed_animation_frame_cnt)*12, 0);
+static
+void video_render_thread(int n)
+{
+  RenderQueue* rq = render_queues[n].get();
+  // With GL a frame is read back only once the next one is drawn, or the queue runs
+  // dry, so the copy overlaps the drawing. drawn is that frame.
+  RenderJob drawn;
+  int drawn_pbo = 0;
+#ifdef COINRUN_GL
+  GLVideoRenderer* gl = VIDEO_GL ? gl_renderer() : 0;
+#endif
+  while (1) {
+    RenderJob job;
+    {
+      QMutexLocker lock(&rq->mutex);
+      while (rq->jobs.empty() && !shutdown_flag && !drawn.frame)
+        rq->wake.wait(&rq->mutex, 1000); // milliseconds
+      if (!rq->jobs.empty()) {
+        job = std::move(rq->jobs.front());
+        rq->jobs.pop_front();
+      }
+    }
+    if (!job.frame && !drawn.frame)
+      return;
 
-        pixel_color.setHsv(hue, saturation, value, alpha);
-        img.setPixelColor(x, y, pixel_color);
+#ifdef COINRUN_GL
+    if (gl) {
+      int pbo = 0;
+      if (job.frame) {
+        job.frame->pixels.resize(VIDEORES*VIDEORES*4);
+        pbo = gl_video_frame_draw(gl, VIDEORES, VIDEORES, *job.frame, job.queue->themes);
+      }
+      if (drawn.frame) {
+        gl_video_frame_read(gl, drawn_pbo, drawn.frame->pixels.data());
+        video_job_finish(drawn);
       }
+      drawn = std::move(job);
+      drawn_pbo = pbo;
+      continue;
     }
+#endif
+
+    VideoFrame* f = job.frame.get();
+    f->pixels.resize(VIDEORES*VIDEORES*4);
+    paint_video_data_render_buf(f->pixels.data(), VIDEORES, VIDEORES, *f, job.queue->themes);
+    video_job_finish(job);
   }
-  QRectF dst = QRectF(kx * agent->x + dx, WINH - ky * (agent->y+1) + dy, kx, 2 * ky);
-  p.drawImage(dst, img);  
+}
 
-  if (agent->power_up_mode) {
-    QRectF bubble_dst = QRectF(kx * agent->x + dx - 7, WINH - ky * (agent->y+1) + dy + 8, kx * 1.15, 2.1 * ky);
-    if (agent->spring != 0 && !(agent->is_killed || agent->ladder_mode || agent->vy != 0)) {
-      // pull bubble down when Mugen crouches
-      bubble_dst.translate(0.0, 8.0);
-    } 
-    p.drawImage(bubble_dst, power_up_shield);
-  } 
+class VideoRenderThread : public QThread {
+public:
+  int n;
+  VideoRenderThread(int n)
+      : n(n) {}
+  void run() { video_render_thread(n); }
+};
 
-  monitor_csv_save_string(agent->monitor_csv, buffer.str().c_str());
+// Moves every live monster, then tests them all against the agent. Kills and deaths are
+// applied in monster order, so rewards add up exactly as when each monster was tested
+// right after its own step (nothing a monster step reads is changed by a collision).
+static
+void monsters_step_and_collide(Maze* maze, Agent& a, RandGen& rand_gen)
+{
+  Monsters& ms = maze->monsters;
+  for (int i = 0; i < ms.n; i++)
+    if (!ms.is_dead[i])
+      ms.step(i, maze, rand_gen); // monster steps
+  ms.push_trails();
+
+  const int CHUNK = 64;
+  uint8_t kill[CHUNK];
+  uint8_t hit[CHUNK];
+  const float ax = a.x;
+  const float ay = a.y;
+  const uint8_t vulnerable = !a.power_up_mode;
+  for (int base = 0; base < ms.n; base += CHUNK) {
+    int cnt = min(CHUNK, ms.n - base);
+    const float* mx = &ms.x[base];
+    const float* my = &ms.y[base];
+    const uint8_t* dead = &ms.is_dead[base];
+    const uint8_t* killable = &ms.can_be_killed[base];
+    uint8_t any = 0;
+    for (int k = 0; k < cnt; k++) {
+      // no branches here, the compiler can run this across monsters at once
+      uint8_t alive = !dead[k];
+      uint8_t stomp = (fabs(mx[k] - ax) < 0.6) & (ay - my[k] < 1.0) & (ay - my[k] > 0.0) & killable[k];
+      uint8_t touch = fabs(mx[k] - ax) + fabs(my[k] - ay) < 1.0;
+      kill[k] = alive & stomp;
+      hit[k] = alive & !stomp & touch & vulnerable;
+      any |= kill[k] | hit[k];
+    }
+    if (!any)
+      continue;
+    for (int k = 0; k < cnt; k++) {
+      if (kill[k]) {
+        // monster killed by alien
+        ms.is_dead[base + k] = true;
+        ms.monster_dying_frame_cnt[base + k] = MONSTER_DEATH_ANIM_LENGTH - 1;
+        a.reward += KILL_MONSTER_REWARD;
+        a.reward_sum += KILL_MONSTER_REWARD;
+        a.killed_monster = true;
+        a.event(EVENT_KILLED_MONSTER, mx[k], my[k]);
+      } else if (hit[k]) {
+        // agent is killed by monster
+        if (!a.is_killed)
+          a.event(EVENT_KILLED, ax, ay);
+        maze->is_terminated = true;  // no effect on agent score
+        a.is_killed = true;
+        a.killed_animation_frame_cnt = DEATH_ANIM_LENGTH;
+        a.reward -= DIE_PENALTY;
+        a.reward_sum -= DIE_PENALTY;
+      }
+    }
+  }
 }
 
+// Paints, or queues for painting, the hires frame of the step that just happened,
+// and writes its monitor.csv record.
 static
-void paint_audio_seg_map_buf(
-  uint8_t* buf, const std::shared_ptr<State>& state, const Agent* agent)
+void paint_video_data(const std::shared_ptr<State>& state, Agent* a)
 {
-
-  std::shared_ptr<Maze> maze = agent->maze;
-
-  for (int i=0; i<AUDIO_MAP_SIZE; ++i) {
-    buf[i] = 0;
+  STATS_SCOPE(STAT_PAINT_VIDEO);
+  monitor_csv_save_frame(state, a);
+  if (state->video) {
+    video_submit(state, a);
+    return;
   }
+  if (!state->video_frame)
+    state->video_frame.reset(new VideoFrame);
+  video_frame_snapshot(state->video_frame.get(), state, a);
+  paint_video_data_render_buf(a->render_hires_buf, VIDEORES, VIDEORES, *state->video_frame, a->video_themes);
+  if (state->video_sink)
+    state->video_sink->write(a->render_hires_buf, state->video_frame->game_id);
+}
 
-  if (agent->power_up_mode) {
-    buf[AUDIO_LABEL_MAP.at("power_up_mode")] = 1;
-  }
-  if (agent->collected_gem) {
-    buf[AUDIO_LABEL_MAP.at("gem")] = 1;
-  }
-  if (agent->is_killed && agent->killed_animation_frame_cnt == DEATH_ANIM_LENGTH) {
-    buf[AUDIO_LABEL_MAP.at("killed")] = 1;
-  }
-  if (agent->killed_monster) {
-    buf[AUDIO_LABEL_MAP.at("killed_monster")] = 1;
-  }
-  if (agent->bumped_head) {
-    buf[AUDIO_LABEL_MAP.at("bumped_head")] = 1;
-  }
-  if (agent->collected_coin) {
-    buf[AUDIO_LABEL_MAP.at("coin")] = 1;
-  }
+// Whether the last frame of a step paints the agent frame and the hires frame (with
+// its audio map). out is where the step's results go; null means vec_wait() copies them
+// out later and may want any of them. A video sink gets every frame regardless.
+static
+bool step_paints_agent(const Agent& a, const StepOutputs* out)
+{
+  return !a.symbolic_obs && (!out || out->obs_rgb);
+}
+
+static
+bool step_paints_video(const std::shared_ptr<State>& state, const StepOutputs* out)
+{
+  return !out || out->obs_hires_rgb || state->video_sink;
+}
 
+// When collecting data, a few frames of the alien being dead (or falling into the last
+// coin) are played out before the level resets.
+static
+bool step_state_is_playback(const Agent& a)
+{
+  return a.collect_data && (a.killed_animation_frame_cnt > 1 || a.finished_level_frame_cnt > 1);
+}
 
-  if (agent->ladder_mode && agent->time_alive % 5 == 0) {
-    buf[AUDIO_LABEL_MAP.at("ladder_climbing")] = 1;
-  } else if (agent->vy == maze->max_jump) {
-    buf[AUDIO_LABEL_MAP.at("jump")] = 1;
-  } else if (agent->vx != 0 && agent->vy == 0 && agent->spring == 0 && agent->time_alive % 5 == 0) {
-    buf[AUDIO_LABEL_MAP.at("walk")] = 1;
+template<int Cfg>
+static
+void step_state_playback(const std::shared_ptr<State>& todo_state, bool last, const StepOutputs* out)
+{
+  // playing out a few frames of the alien being dead
+  // we only do this when we are collecting data, not during training
+  Agent& a = todo_state->agent;
+  a.killed_animation_frame_cnt -= 1;
+  a.finished_level_frame_cnt -=1;
+  if (a.finished_level_frame_cnt > 1) {
+    // lets alien fall into the coin at end of level
+    // if alien is killed, it is frozen
+    a.step<Cfg>();
   }
+  monitor_save_coins(a);
+  agent_frame_events(a);
+  if (!last)
+    return;
+  monitor_bin_save_frame(todo_state, &a);
+  if (step_paints_video(todo_state, out))
+    paint_video_data(todo_state, &a);
+  else
+    monitor_csv_save_frame(todo_state, &a);
+  if (step_paints_agent(a, out))
+    paint_agent_render_buf<Cfg>(a.render_buf, RES_W, RES_H, todo_state, &a);
+  if (!out || out->obs_audio_seg_map)
+    paint_audio_seg_map_buf(a.audio_seg_map_buf, todo_state, &a);
 }
 
-// -- vecenv --
+// A normal step up to the agent moving. Returns whether the agent moves at all.
+static
+bool step_state_before_agent(const std::shared_ptr<State>& todo_state)
+{
+  Agent& a = todo_state->agent;
+  todo_state->time += 1;
+  bool game_over = todo_state->maze->is_terminated;
 
-class VectorOfStates {
-public:
-  int nenvs;
-  int handle;
-  QMutex states_mutex;
-  std::vector<std::shared_ptr<State>> states; // nenvs
-};
+  {
+    STATS_SCOPE(STAT_MONSTERS);
+    monsters_step_and_collide(todo_state->maze.get(), a, todo_state->rand_gen);
+  }
 
-static QMutex h2s_mutex;
-static QWaitCondition wait_for_actions;
-static QWaitCondition wait_for_step_completed;
-static std::map<int, std::shared_ptr<VectorOfStates>> h2s;
-static std::list<std::shared_ptr<State>> workers_todo;
-static int handle_seq = 100;
+  if (game_over)
+    a.monitor_csv_episode_over();
+  a.game_over = game_over;
+  return !a.is_killed;
+}
 
-static std::shared_ptr<VectorOfStates> vstate_find(int handle)
+// The rest of a normal step, once the agent has moved. Only the last of repeated steps
+// paints anything, and only what out wants. It also is the one monitor frame of the
+// step, so the flags of the repeats before it are kept until then.
+template<int Cfg>
+static
+void step_state_after_agent(const std::shared_ptr<State>& todo_state, bool last, const StepOutputs* out)
 {
-  QMutexLocker lock(&h2s_mutex);
-  auto f = h2s.find(handle);
-  if (f == h2s.end()) {
-    fprintf(stderr, "cannot find vstate handle %i\n", handle);
-    assert(0);
+  Agent& a = todo_state->agent;
+  monitor_save_coins(a);
+  if (a.game_over) {
+    STATS_SCOPE(STAT_RESET);
+    state_reset(todo_state);
+    level_pregen_request(todo_state);
   }
-  return f->second;
+
+  agent_frame_events(a);
+  if (!last)
+    return;
+  if (a.collect_data) {
+    // frames go to both monitors only when collecting data, games, episodes and coins always do
+    monitor_bin_save_frame(todo_state, &a);
+    if (step_paints_video(todo_state, out))
+      paint_video_data(todo_state, &a);
+    else
+      monitor_csv_save_frame(todo_state, &a);
+    if (!out || out->obs_audio_seg_map)
+      paint_audio_seg_map_buf(a.audio_seg_map_buf, todo_state, &a);
+  }
+  if (step_paints_agent(a, out))
+    paint_agent_render_buf<Cfg>(a.render_buf, RES_W, RES_H, todo_state, &a);
+  a.collected_coin = false;
+  a.collected_gem = false;
+  a.killed_monster = false;
+  a.bumped_head = false;
+  a.frame_events = 0;
 }
 
+template<int Cfg>
 static
-void copy_render_buf(int e, uint8_t* obs_rgb, uint8_t* buf, int res_w, int res_h)
+void step_state(const std::shared_ptr<State>& todo_state, const StepOutputs* out)
 {
-  for (int y = 0; y<res_h; y++) {
-    for (int x = 0; x<res_w; x++) {
-      uint8_t* p = obs_rgb + e*res_h*res_w*3 + y*res_w*3 + x*3;
-
-      p[0] = buf[y*res_w*4 + x*4 + 2];
-      p[1] = buf[y*res_w*4 + x*4 + 1];
-      p[2] = buf[y*res_w*4 + x*4 + 0];
+  assert(todo_state->agent_ready);
+  {
+    QMutexLocker lock(&todo_state->state_mutex);
+    std::shared_ptr<VectorOfStates> belongs_to = todo_state->belongs_to.lock();
+    if (!belongs_to)
+      return;
+    Agent& a = todo_state->agent;
+    for (int r = 1; ; r++) {
+      // rewards add up in a.reward, a game over ends the repeat early
+      bool last = r >= todo_state->action_repeat;
+      if (step_state_is_playback(a)) {
+        step_state_playback<Cfg>(todo_state, last, out);
+      } else {
+        if (step_state_before_agent(todo_state)) {
+          STATS_SCOPE(STAT_AGENT);
+          a.step<Cfg>(); // agent steps
+        }
+        last |= a.game_over;
+        step_state_after_agent<Cfg>(todo_state, last, out);
+      }
+      if (last)
+        break;
     }
+
+    if (out)
+      write_step_outputs(todo_state->state_n, *out, todo_state.get());
   }
+
+  todo_state->agent_ready = false;
 }
 
+// Steps the envs a worker claimed. With BATCHED_PHYSICS all of them are locked for the
+// duration, and the agents of the normal steps are moved together by agents_step(),
+// one repeat at a time. Per env the order of everything, random draws included, is
+// that of step_state(). Results go to out, if not null.
+template<int Cfg>
 static
-void copy_audio_buf(int e, uint8_t* obs_audio, uint8_t* buf, int dim)
+void step_states(const std::shared_ptr<VectorOfStates>& vstate, const int* batch, int cnt, const StepOutputs* out)
 {
-  for (int x = 0; x<dim; x++) {
-    uint8_t* p = obs_audio + e*dim + x;
+  if (!BATCHED_PHYSICS || cnt < 2) {
+    for (int i = 0; i < cnt; i++)
+      step_state<Cfg>(vstate->states[batch[i]], out);
+    return;
+  }
 
-    p[0] = buf[x];
+  bool playback[MAX_CLAIM_BATCH];
+  bool last[MAX_CLAIM_BATCH];
+  bool finished[MAX_CLAIM_BATCH];
+  Agent* moving[MAX_CLAIM_BATCH];
+  int active = cnt;
+  for (int i = 0; i < cnt; i++) {
+    const std::shared_ptr<State>& todo_state = vstate->states[batch[i]];
+    assert(todo_state->agent_ready);
+    todo_state->state_mutex.lock();
+    finished[i] = false;
+  }
+
+  for (int r = 1; active > 0; r++) {
+    int moving_cnt = 0;
+    for (int i = 0; i < cnt; i++) {
+      if (finished[i])
+        continue;
+      const std::shared_ptr<State>& todo_state = vstate->states[batch[i]];
+      last[i] = r >= todo_state->action_repeat;
+      playback[i] = step_state_is_playback(todo_state->agent);
+      if (playback[i])
+        step_state_playback<Cfg>(todo_state, last[i], out);
+      else if (step_state_before_agent(todo_state))
+        moving[moving_cnt++] = &todo_state->agent;
+    }
+
+    {
+      STATS_SCOPE(STAT_AGENT);
+      agents_step<Cfg>(moving, moving_cnt);
+    }
+
+    for (int i = 0; i < cnt; i++) {
+      const std::shared_ptr<State>& todo_state = vstate->states[batch[i]];
+      if (finished[i])
+        continue;
+      if (!playback[i]) {
+        last[i] |= todo_state->agent.game_over;
+        step_state_after_agent<Cfg>(todo_state, last[i], out);
+      }
+      if (!last[i])
+        continue;
+      if (out)
+        write_step_outputs(todo_state->state_n, *out, todo_state.get());
+      todo_state->state_mutex.unlock();
+      todo_state->agent_ready = false;
+      finished[i] = true;
+      active--;
+    }
   }
 }
 
+// Slot t of time-major [T][nenvs][...] output buffers, null pointers stay null.
+static
+StepOutputs step_outputs_at(const StepOutputs& base, int t, int nenvs)
+{
+  size_t n = size_t(t) * nenvs;
+  StepOutputs out;
+  out.obs_rgb = base.obs_rgb ? base.obs_rgb + n*RES_H*RES_W*3 : 0;
+  out.obs_hires_rgb = base.obs_hires_rgb ? base.obs_hires_rgb + n*VIDEORES*VIDEORES*3 : 0;
+  out.obs_audio_seg_map = base.obs_audio_seg_map ? base.obs_audio_seg_map + n*AUDIO_MAP_SIZE : 0;
+  out.rew = base.rew + n;
+  out.done = base.done + n;
+  out.new_level = base.new_level + n;
+  out.obs_tiles = base.obs_tiles ? base.obs_tiles + n*SYMBOLIC_TILES_H*SYMBOLIC_TILES_W : 0;
+  out.obs_agent = base.obs_agent ? base.obs_agent + n*SYMBOLIC_AGENT_DIM : 0;
+  out.obs_monsters = base.obs_monsters ? base.obs_monsters + n*SYMBOLIC_MONSTERS*SYMBOLIC_MONSTER_DIM : 0;
+  out.events = base.events ? base.events + n*EVENT_RING_SIZE : 0;
+  out.event_counts = base.event_counts ? base.event_counts + n : 0;
+  return out;
+}
+
+// The envs a worker claimed from a vec_rollout() go through all their steps with that
+// worker, so each stays in one core's cache and nobody waits for the todo ring.
+template<int Cfg>
 static
-void paint_agent_render_buf(uint8_t* buf, int res_w, int res_h, const std::shared_ptr<State>& todo_state, const Agent* a)
+void rollout_states(const std::shared_ptr<VectorOfStates>& vstate, const int* batch, int cnt)
 {
-  QImage img((uchar*)buf, res_w, res_h, res_w * 4, QImage::Format_RGB32);
-  QPainter p(&img);
-  paint_the_world_for_agent(p, QRect(0, 0, res_w, res_h), todo_state, a);
+  for (int t = 0; t < vstate->rollout_steps; t++) {
+    for (int i = 0; t > 0 && i < cnt; i++) {
+      const std::shared_ptr<State>& state = vstate->states[batch[i]];
+      int32_t action = vstate->rollout_actions[size_t(t) * vstate->nenvs + batch[i]];
+      state->agent.action_dx = DISCRETE_ACTIONS[2 * action + 0];
+      state->agent.action_dy = DISCRETE_ACTIONS[2 * action + 1];
+      state->agent_ready = true;
+    }
+    StepOutputs out = step_outputs_at(vstate->rollout_outputs, t, vstate->nenvs);
+    step_states<Cfg>(vstate, batch, cnt, &out);
+  }
 }
 
+// Steps the envs a worker claimed from vstate, with the code compiled for its flags.
+template<int Cfg>
 static
-void paint_video_data_render_buf(uint8_t* buf, int res_w, int res_h, const std::shared_ptr<State>& todo_state, const Agent* a)
+void step_claimed(const std::shared_ptr<VectorOfStates>& vstate, const int* batch, int cnt)
 {
-  QImage img((uchar*)buf, res_w, res_h, res_w * 4, QImage::Format_RGB32);
-  QPainter p(&img);
-  paint_the_world_for_video_data(p, QRect(0, 0, res_w, res_h), todo_state, a);
+  if (vstate->rollout_steps > 0)
+    rollout_states<Cfg>(vstate, batch, cnt);
+  else
+    step_states<Cfg>(vstate, batch, cnt, vstate->has_registered_outputs ? &vstate->registered_outputs : 0);
 }
 
+// One step_claimed<>() for every combination of StepConfig flags, by step_config().
+static void (* const step_claimed_cfg[])(const std::shared_ptr<VectorOfStates>&, const int*, int) = {
+  step_claimed<0>, step_claimed<1>, step_claimed<2>, step_claimed<3>,
+  step_claimed<4>, step_claimed<5>, step_claimed<6>, step_claimed<7>,
+};
+static_assert(sizeof(step_claimed_cfg) / sizeof(step_claimed_cfg[0]) == 2 * CFG_AUGMENT, "one per StepConfig combination");
+
 static
 void stepping_thread(int n)
 {
+  if (!worker_cpus.empty())
+    thread_pin(worker_cpus[n]);
+  std::shared_ptr<VectorOfStates> vstate;
+  int batch[MAX_CLAIM_BATCH];
   while (1) {
-    std::shared_ptr<State> todo_state;
-    std::list<std::shared_ptr<State>> my_todo;
-    while (1) {
-      if (shutdown_flag)
-        return;
-      QMutexLocker sleeplock(&h2s_mutex);
-      if (workers_todo.empty()) {
-        wait_for_actions.wait(&h2s_mutex, 1000); // milliseconds
-        continue;
+    if (shutdown_flag)
+      return;
+    if (!work_tickets.pop(&vstate)) {
+      QMutexLocker sleeplock(&idle_mutex);
+      sleeping_workers.fetch_add(1);
+      bool got_ticket = work_tickets.pop(&vstate);
+      if (!got_ticket) {
+        STATS_SCOPE(STAT_IDLE);
+        wait_for_actions.wait(&idle_mutex, 1000); // milliseconds
       }
-      my_todo.splice(my_todo.begin(), workers_todo, workers_todo.begin());
-      break;
-    }
-    todo_state = my_todo.front();
-
-    {
-      QMutexLocker lock(&todo_state->step_mutex);
-      assert(todo_state->agent_ready);
-      todo_state->step_in_progress = true;
-    }
-
-    {
-      QMutexLocker lock(&todo_state->state_mutex);
-      std::shared_ptr<VectorOfStates> belongs_to = todo_state->belongs_to.lock();
-      if (!belongs_to)
+      sleeping_workers.fetch_sub(1);
+      if (!got_ticket)
         continue;
-      Agent& a = todo_state->agent;
-      if (a.collect_data && (a.killed_animation_frame_cnt > 1 || a.finished_level_frame_cnt > 1)) {
-        // playing out a few frames of the alien being dead
-        // we only do this when we are collecting data, not during training
-        a.killed_animation_frame_cnt -= 1;
-        a.finished_level_frame_cnt -=1;
-        if (a.finished_level_frame_cnt > 1) {
-          // lets alien fall into the coin at end of level
-          // if alien is killed, it is frozen
-          a.step();
-        }
-        paint_video_data_render_buf(a.render_hires_buf, VIDEORES, VIDEORES, todo_state, &a);
-        paint_agent_render_buf(a.render_buf, RES_W, RES_H, todo_state, &a);
-        paint_audio_seg_map_buf(a.audio_seg_map_buf, todo_state, &a);
-      } else {
-        todo_state->time += 1;
-        bool game_over = todo_state->maze->is_terminated;
-
-        for (const std::shared_ptr<Monster>& m: todo_state->maze->monsters) {
-          if (!m->is_dead) {
-            m->step(todo_state->maze); // monster steps
-            Agent& a = todo_state->agent;
-            if (fabs(m->x - a.x) < 0.6 && (a.y - m->y < 1.0) && (a.y - m->y > 0.0) && enemy_themel[m->theme_n].can_be_killed) {
-              // monster killed by alien
-              m->is_dead = true;
-              m->monster_dying_frame_cnt = MONSTER_DEATH_ANIM_LENGTH - 1;
-              a.reward += KILL_MONSTER_REWARD;
-              a.reward_sum += KILL_MONSTER_REWARD;
-              a.killed_monster = true;
-            } else if (fabs(m->x - a.x) + fabs(m->y - a.y) < 1.0 && !a.power_up_mode) {
-              // agent is killed by monster
-              todo_state->maze->is_terminated = true;  // no effect on agent score
-              a.is_killed = true;
-              a.killed_animation_frame_cnt = DEATH_ANIM_LENGTH;
-              a.reward -= DIE_PENALTY;
-              a.reward_sum -= DIE_PENALTY;
-            }
-          }
-        }
-
-        if (game_over)
-          a.monitor_csv_episode_over();
-        a.game_over = game_over;
-        if (!a.is_killed) 
-          a.step(); // agent steps
-
-        if (game_over) {
-          state_reset(todo_state);
-        }
+    }
 
-        if (a.collect_data) {
-          paint_video_data_render_buf(a.render_hires_buf, VIDEORES, VIDEORES, todo_state, &a);
-          paint_audio_seg_map_buf(a.audio_seg_map_buf, todo_state, &a);
-        }
-        paint_agent_render_buf(a.render_buf, RES_W, RES_H, todo_state, &a);
-        a.collected_coin = false;
-        a.collected_gem = false;
-        a.killed_monster = false;
-        a.bumped_head = false;
+    while (1) {
+      int cnt;
+      {
+        STATS_SCOPE(STAT_CLAIM);
+        cnt = vstate->todo_claim(n, batch);
       }
+      if (cnt == 0)
+        break;
+#ifdef COINRUN_STATS
+      uint64_t claimed = stats_ticks();
+      for (int i = 0; i < cnt; i++)
+        stats_add(STAT_QUEUE_WAIT, claimed - vstate->states[batch[i]]->queued_ticks);
+#endif
+      step_claimed_cfg[vstate->step_cfg](vstate, batch, cnt);
+      vstate->steps_done(batch, cnt);
     }
+    vstate.reset();
+  }
+}
 
-    {
-      QMutexLocker lock(&todo_state->step_mutex);
-      assert(todo_state->agent_ready);
-      assert(todo_state->step_in_progress);
-      todo_state->agent_ready = false;
-      todo_state->step_in_progress = false;
-    }
 
-    wait_for_step_completed.wakeAll();
+// Hands out enough tickets for n freshly queued envs to keep the pool busy.
+static
+void submit_work(const std::shared_ptr<VectorOfStates>& vstate, int n)
+{
+  int nthreads = max(1, (int)all_threads.size());
+  int tickets = min(nthreads, (n + vstate->claim_batch - 1) / vstate->claim_batch);
+  for (int t = 0; t < tickets; t++) {
+    while (!work_tickets.push(vstate))
+      QThread::yieldCurrentThread();
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_workers.load() > 0) {
+    QMutexLocker lock(&idle_mutex);
+    wait_for_actions.wakeAll();
   }
 }
 
@@ -2021,7 +5916,42 @@ public:
   void run() { stepping_thread(n); }
 };
 
-static std::vector<std::shared_ptr<QThread>> all_threads;
+// Builds and resets envs [begin, end) of a new vector.
+static
+void vec_build_states(const std::shared_ptr<VectorOfStates>& vstate, int begin, int end, int lump_n, uint64_t vec_n)
+{
+  int nenvs = vstate->states.size();
+  int homes = vstate->todo.size();
+  for (int n = begin; n < end; n++) {
+    vstate->states[n] = std::shared_ptr<State>(new State(vstate));
+    vstate->states[n]->state_n = n;
+    vstate->states[n]->home = int(int64_t(n) * homes / nenvs); // consecutive envs share a thread
+    uint64_t env_n = n + uint64_t(lump_n) * nenvs;
+    vstate->states[n]->rand_key = env_rand_key(process_rand_seed, LOCAL_RANK, vec_n, env_n);
+    vstate->states[n]->rand_gen.seed(rand_stream_seed(vstate->states[n]->rand_key, RAND_STREAM_ENV));
+    vstate->states[n]->augment_rand_gen.seed(rand_stream_seed(vstate->states[n]->rand_key, RAND_STREAM_AUGMENT));
+    if (
+        (monitor_csv_policy == 1 && n == 0) ||
+        (monitor_csv_policy == 2))
+    {
+      vstate->states[n]->agent.monitor_csv_open(n + lump_n * nenvs);
+    }
+    state_reset(vstate->states[n]);
+  }
+}
+
+// First touch: runs vec_build_states() for the envs of one home thread on its core.
+class StatesBuildThread : public QThread {
+public:
+  std::shared_ptr<VectorOfStates> vstate;
+  int cpu, begin, end, lump_n;
+  uint64_t vec_n;
+  void run()
+  {
+    thread_pin(cpu);
+    vec_build_states(vstate, begin, end, lump_n, vec_n);
+  }
+};
 
 // ------ C Interface ---------
 
@@ -2030,13 +5960,35 @@ int get_NUM_ACTIONS()  { return NUM_ACTIONS; }
 int get_RES_W()  { return RES_W; }
 int get_RES_H()  { return RES_H; }
 int get_VIDEORES()  { return VIDEORES; }
+int get_VIDEO_MAX_PENDING()  { return VIDEO_MAX_PENDING; }
 int get_AUDIO_MAP_SIZE()  { return AUDIO_MAP_SIZE; }
+int get_SYMBOLIC_TILES_W()  { return SYMBOLIC_TILES_W; }
+int get_SYMBOLIC_TILES_H()  { return SYMBOLIC_TILES_H; }
+int get_SYMBOLIC_AGENT_DIM()  { return SYMBOLIC_AGENT_DIM; }
+int get_SYMBOLIC_MONSTERS()  { return SYMBOLIC_MONSTERS; }
+int get_SYMBOLIC_MONSTER_DIM()  { return SYMBOLIC_MONSTER_DIM; }
+int get_EVENT_RING_SIZE()  { return EVENT_RING_SIZE; }
+int get_MAX_ACTION_REPEAT()  { return MAX_ACTION_REPEAT; }
+
+// The random key env env_n of vector vec_n would get in process (rand_seed, local rank),
+// so tests can check that MPI workers don't share random streams.
+uint64_t get_env_rand_key(int rand_seed, int rank, int vec_n, int env_n)
+{
+  return env_rand_key(rand_seed, rank, vec_n, env_n);
+}
 
 void initialize_args(int *int_args, float *float_args) {
   NUM_LEVELS = int_args[0];
   PAINT_VEL_INFO = int_args[1] == 1;
   USE_DATA_AUGMENTATION = int_args[2] == 1;
   LEVEL_TIMEOUT = int_args[5];
+  USE_FAST_AGENT_RENDER = int_args[6] == 1;
+  VIDEORES = int_args[7];
+  VIDEO_THREADS = int_args[8];
+  BATCHED_PHYSICS = int_args[9] == 1;
+  PIN_THREADS = int_args[10] == 1;
+  LOCAL_RANK = int_args[11];
+  VIDEO_GL = int_args[12] == 1;
 
   AIR_CONTROL = float_args[0];
   BUMP_HEAD_PENALTY = float_args[1];
@@ -2049,23 +6001,28 @@ void initialize_args(int *int_args, float *float_args) {
   int training_sets_seed = int_args[3];
   int rand_seed = int_args[4];
 
+  USE_LEVEL_SET = false;
+  delete[] LEVEL_SEEDS;
+  LEVEL_SEEDS = 0;
   if (NUM_LEVELS > 0 && (training_sets_seed != -1)) {
-    global_rand_gen.seed(training_sets_seed);
+    RandGen set_rand_gen;
+    set_rand_gen.seed(training_sets_seed);
 
     USE_LEVEL_SET = true;
 
     LEVEL_SEEDS = new int[NUM_LEVELS];
 
     for (int i = 0; i < NUM_LEVELS; i++) {
-      LEVEL_SEEDS[i] = global_rand_gen.randint();
+      LEVEL_SEEDS[i] = set_rand_gen.randint();
     }
   }
 
   if (training_sets_seed != -1) {
-    global_rand_gen.seed(training_sets_seed);
+    master_seed = training_sets_seed;
   } else {
-    global_rand_gen.seed(rand_seed);
+    master_seed = rand_seed;
   }
+  process_rand_seed = rand_seed;
 }
 
 void initialize_set_monitor_dir(const char *d, int monitor_csv_policy_)
@@ -2074,6 +6031,28 @@ void initialize_set_monitor_dir(const char *d, int monitor_csv_policy_)
   monitor_csv_policy = monitor_csv_policy_;
 }
 
+// 0 writes monitor.csv, 1 the binary monitor.bin described at MetaFileHeader, 2 both.
+void initialize_set_monitor_format(int format)
+{
+  monitor_format = format;
+}
+
+// Asset atlas file to map, baked first if missing or stale, see asset(). Empty (the
+// default) decodes the assets in every process. Call before init().
+void initialize_set_asset_atlas(const char *path)
+{
+  asset_atlas_path = path;
+}
+
+void initialize_set_video_sink(const char *d, int kind)
+{
+  video_sink_dir = d;
+  video_sink_kind = kind;
+  // writing to a dead ffmpeg would otherwise kill the whole process
+  if (kind == VIDEO_SINK_FFMPEG)
+    signal(SIGPIPE, SIG_IGN);
+}
+
 void init(int threads)
 {
   if (bg_images.empty())
@@ -2083,45 +6062,115 @@ void init(int threads)
         throw std::runtime_error("missing environment variable COINRUN_RESOURCES_PATH");
       }
       images_load();
+      fast_sprites_load();
     } catch (const std::exception &e) {
       fprintf(stderr, "ERROR: %s\n", e.what());
       return;
     }
 
+  // init() may follow a coinrun_shutdown(), as in coinrun_bench
+  shutdown_flag = false;
+
+  assert(!monitor_writer);
+  monitor_writer_stop = false;
+  monitor_writer_exited = false;
+  monitor_writer.reset(new MonitorWriterThread);
+  monitor_writer->start();
+
+  assert(!level_pregen);
+  level_pregen.reset(new LevelPregenThread);
+  level_pregen->start(QThread::LowPriority);
+
   assert(all_threads.empty());
+  work_tickets.init(4096);
+  worker_cpus_choose(threads);
   all_threads.resize(threads);
   for (int t = 0; t < threads; t++) {
     all_threads[t] = std::shared_ptr<QThread>(new SteppingThread(t));
     all_threads[t]->start();
   }
+
+  assert(render_threads.empty());
+  render_queues.resize(VIDEO_THREADS);
+  render_threads.resize(VIDEO_THREADS);
+  for (int t = 0; t < VIDEO_THREADS; t++) {
+    render_queues[t].reset(new RenderQueue);
+    render_threads[t] = std::shared_ptr<QThread>(new VideoRenderThread(t));
+    render_threads[t]->start();
+  }
 }
 
-int vec_create(int nenvs, int lump_n, bool collect_data, float default_zoom)
+// obs_mode is OBS_PIXELS (the 64x64 frame) or OBS_SYMBOLIC, in which case nothing is
+// painted for the agent and the observations go to vec_set_symbolic_buffers() arrays.
+int vec_create(int nenvs, int lump_n, bool collect_data, float default_zoom, int obs_mode)
 {
   std::shared_ptr<VectorOfStates> vstate(new VectorOfStates);
   vstate->states.resize(nenvs);
+  int homes = max(1, (int)all_threads.size());
+  vstate->todo.resize(homes);
+  for (int t = 0; t < homes; t++) {
+    vstate->todo[t].reset(new MPMCRing<int>);
+    vstate->todo[t]->init(nenvs);
+  }
 
-  for (int n = 0; n < nenvs; n++) {
-    vstate->states[n] = std::shared_ptr<State>(new State(vstate));
-    vstate->states[n]->state_n = n;
-    if (
-        (monitor_csv_policy == 1 && n == 0) ||
-        (monitor_csv_policy == 2))
-    {
-      vstate->states[n]->agent.monitor_csv_open(n + lump_n * nenvs);
+  // envs of a second vec_create() in the same process get streams of their own
+  static std::atomic<int> vecs_created{0};
+  uint64_t vec_n = vecs_created++;
+  if (worker_cpus.empty()) {
+    vec_build_states(vstate, 0, nenvs, lump_n, vec_n);
+  } else {
+    std::vector<std::unique_ptr<StatesBuildThread>> builders;
+    for (int n = 0; n < nenvs; ) {
+      int t = int(int64_t(n) * homes / nenvs);
+      int end = n;
+      while (end < nenvs && int(int64_t(end) * homes / nenvs) == t)
+        end++;
+      StatesBuildThread* b = new StatesBuildThread;
+      b->vstate = vstate;
+      b->cpu = worker_cpus[t];
+      b->begin = n;
+      b->end = end;
+      b->lump_n = lump_n;
+      b->vec_n = vec_n;
+      b->start();
+      builders.emplace_back(b);
+      n = end;
     }
-    state_reset(vstate->states[n]);
+    for (auto& b : builders)
+      b->wait();
+  }
+
+  for (int n = 0; n < nenvs; n++) {
     vstate->states[n]->agent_ready = false;
     vstate->states[n]->agent.zoom = default_zoom;
     vstate->states[n]->agent.target_zoom = default_zoom;
     vstate->states[n]->agent.collect_data = collect_data;
+    vstate->states[n]->agent.symbolic_obs = obs_mode == OBS_SYMBOLIC;
     if (collect_data) {
-        vstate->states[n]->agent.render_hires_buf = new uint8_t[VIDEORES*VIDEORES*4];
+        if (video_sink_kind != VIDEO_SINK_OFF) {
+          vstate->states[n]->video_sink.reset(new VideoSink);
+          vstate->states[n]->video_sink->prefix = env_file_prefix(video_sink_dir, n + lump_n * nenvs);
+        }
+        if (render_threads.empty()) {
+          vstate->states[n]->agent.render_hires_buf = new uint8_t[VIDEORES*VIDEORES*4];
+        } else {
+          vstate->states[n]->video.reset(new VideoQueue);
+          vstate->states[n]->video->render_thread = n % render_threads.size();
+          vstate->states[n]->video->sink = vstate->states[n]->video_sink;
+        }
         vstate->states[n]->agent.audio_seg_map_buf = new uint8_t[AUDIO_MAP_SIZE];
     }
 
   }
+  // only now, so that the initial levels don't depend on how fast the pregen thread is
+  for (int n = 0; n < nenvs; n++)
+    level_pregen_request(vstate->states[n]);
   vstate->nenvs = nenvs;
+  vstate->symbolic_obs = obs_mode == OBS_SYMBOLIC;
+  vstate->step_cfg = step_config();
+  vstate->claim_batch = max(1, min(MAX_CLAIM_BATCH, nenvs / (4 * max(1, (int)all_threads.size()))));
+  if (BATCHED_PHYSICS) // fill the lanes, as long as every thread still gets envs to step
+    vstate->claim_batch = max(vstate->claim_batch, min(AGENT_LANES, nenvs / max(1, (int)all_threads.size())));
   int h;
   {
     QMutexLocker lock(&h2s_mutex);
@@ -2143,25 +6192,194 @@ void vec_close(int handle)
   }
 }
 
-void vec_step_async_discrete(int handle, int32_t *actions)
+// Every env holds its action for repeat game steps, or until a game over, and the
+// rewards are summed. Only the last of them is painted and observed. repeat is at most
+// MAX_ACTION_REPEAT, so that a monitor frame has room for all coins eaten meanwhile.
+void vec_step_async_discrete_repeat(int handle, int32_t *actions, int repeat)
 {
+  assert(repeat >= 1 && repeat <= MAX_ACTION_REPEAT);
   std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
-  QMutexLocker sleeplock(&h2s_mutex);
-  {
-    QMutexLocker lock2(&vstate->states_mutex);
-    for (int e = 0; e < vstate->nenvs; e++) {
-      std::shared_ptr<State> state = vstate->states[e];
-      assert((unsigned int)actions[e] < (unsigned int)NUM_ACTIONS);
-      state->agent.action_dx = DISCRETE_ACTIONS[2 * actions[e] + 0];
-      state->agent.action_dy = DISCRETE_ACTIONS[2 * actions[e] + 1];
-      {
-        QMutexLocker lock3(&state->step_mutex);
-        state->agent_ready = true;
-        workers_todo.push_back(state);
-      }
+  vstate->steps_outstanding.fetch_add(vstate->nenvs);
+  for (int e = 0; e < vstate->nenvs; e++) {
+    const std::shared_ptr<State>& state = vstate->states[e];
+    assert((unsigned int)actions[e] < (unsigned int)NUM_ACTIONS);
+    assert(!state->agent_ready && "env stepped twice without vec_wait");
+    state->agent.action_dx = DISCRETE_ACTIONS[2 * actions[e] + 0];
+    state->agent.action_dy = DISCRETE_ACTIONS[2 * actions[e] + 1];
+    state->action_repeat = repeat;
+    state->agent_ready = true;
+    if (vstate->async_steps) {
+      assert(!vstate->async_busy[e] && "env stepped twice without collecting it");
+      vstate->async_busy[e] = 1;
     }
+    vstate->todo_push(e);
+  }
+  submit_work(vstate, vstate->nenvs);
+}
+
+void vec_step_async_discrete(int handle, int32_t *actions)
+{
+  vec_step_async_discrete_repeat(handle, actions, 1);
+}
+
+// Steps only envs env_idx[0..n), env_idx[i] with actions[i], and lets the caller pick
+// up each as soon as it is done with vec_wait_any() or vec_poll(), so that one slow
+// env (a reset, a death animation to paint) doesn't hold back the others. An env
+// may be stepped again once it has been collected, while others are still running.
+// The first call turns the vector async for good: vec_wait() then waits for all
+// stepped envs, and vec_rollout() is not available. Workers then claim single envs,
+// so no env waits for others claimed with it, and BATCHED_PHYSICS has no effect.
+void vec_step_async_subset(int handle, int32_t* env_idx, int32_t* actions, int n)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  if (!vstate->async_steps) {
+    assert(vstate->steps_outstanding.load() == 0);
+    vstate->async_busy.assign(vstate->nenvs, 0);
+    vstate->async_steps = true;
+    vstate->claim_batch = 1;
+  }
+  if (n <= 0)
+    return;
+  vstate->steps_outstanding.fetch_add(n);
+  for (int i = 0; i < n; i++) {
+    int e = env_idx[i];
+    assert((unsigned int)e < (unsigned int)vstate->nenvs);
+    assert((unsigned int)actions[i] < (unsigned int)NUM_ACTIONS);
+    assert(!vstate->async_busy[e] && "env stepped twice without collecting it");
+    const std::shared_ptr<State>& state = vstate->states[e];
+    state->agent.action_dx = DISCRETE_ACTIONS[2 * actions[i] + 0];
+    state->agent.action_dy = DISCRETE_ACTIONS[2 * actions[i] + 1];
+    state->action_repeat = 1;
+    state->agent_ready = true;
+    vstate->async_busy[e] = 1;
+    vstate->todo_push(e);
+  }
+  submit_work(vstate, n);
+}
+
+// Steps every env T times with actions [T][nenvs] and returns when all are done, each
+// action held for repeat game steps like vec_step_async_discrete_repeat(). Step t
+// is written to slot t of time-major buffers shaped like those of vec_wait with a
+// leading T: obs_rgb [T][nenvs][RES_H][RES_W][3], rew, done and new_level [T][nenvs],
+// and so on. Observation pointers may be null, when only rewards are wanted, and then
+// those observations are not painted at all. The symbolic ones are used by OBS_SYMBOLIC
+// vectors only. Events go to events [T][nenvs][EVENT_RING_SIZE] and event_counts
+// [T][nenvs], see vec_set_event_buffers(); when those are null the events of the
+// rollout are dropped. With VIDEO_THREADS and no video sink hires frames can only come
+// from vec_video_drain(), which nobody calls during a rollout, so obs_hires_rgb must be
+// null then and no frames are queued. Must not overlap a vec_step.
+void vec_rollout(
+  int handle,
+  int32_t* actions,
+  int T,
+  int repeat,
+  uint8_t* obs_rgb,
+  uint8_t* obs_hires_rgb,
+  uint8_t* obs_audio_seg_map,
+  float* rew,
+  bool* done,
+  bool* new_level,
+  uint8_t* obs_tiles,
+  float* obs_agent,
+  float* obs_monsters,
+  Event* events,
+  int32_t* event_counts)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  assert(vstate->steps_outstanding.load() == 0);
+  assert(!events == !event_counts);
+  // symbolic observations may be left out like the others, but only all three together
+  assert(!obs_tiles == !obs_agent && !obs_tiles == !obs_monsters);
+  assert((vstate->symbolic_obs || !obs_tiles) && "symbolic observations from a pixel vector");
+  assert(!vstate->async_steps && "vec_rollout on a vector stepped with vec_step_async_subset");
+  assert(repeat >= 1 && repeat <= MAX_ACTION_REPEAT);
+  if (T <= 0)
+    return;
+  for (int i = 0; i < T * vstate->nenvs; i++)
+    assert((unsigned int)actions[i] < (unsigned int)NUM_ACTIONS);
+  for (int e = 0; e < vstate->nenvs; e++)
+    assert(!(obs_hires_rgb && vstate->states[e]->video && !vstate->states[e]->video_sink) &&
+      "vec_rollout cannot return hires frames with VIDEO_THREADS, they would fill the video queue");
+
+  StepOutputs& out = vstate->rollout_outputs;
+  out.obs_rgb = obs_rgb;
+  out.obs_hires_rgb = obs_hires_rgb;
+  out.obs_audio_seg_map = obs_audio_seg_map;
+  out.rew = rew;
+  out.done = done;
+  out.new_level = new_level;
+  out.obs_tiles = obs_tiles;
+  out.obs_agent = obs_agent;
+  out.obs_monsters = obs_monsters;
+  out.events = events;
+  out.event_counts = event_counts;
+  vstate->rollout_actions = actions;
+  vstate->rollout_steps = T;
+
+  vstate->steps_outstanding.fetch_add(vstate->nenvs);
+  for (int e = 0; e < vstate->nenvs; e++) {
+    const std::shared_ptr<State>& state = vstate->states[e];
+    assert(!state->agent_ready && "env stepped twice without vec_wait");
+    state->agent.action_dx = DISCRETE_ACTIONS[2 * actions[e] + 0];
+    state->agent.action_dy = DISCRETE_ACTIONS[2 * actions[e] + 1];
+    state->action_repeat = repeat; // rollout_states() keeps it for the later steps
+    state->agent_ready = true;
+    vstate->todo_push(e);
   }
-  wait_for_actions.wakeAll();
+  submit_work(vstate, vstate->nenvs);
+  vstate->wait_steps_done();
+  vstate->rollout_steps = 0;
+}
+
+// Registers caller-owned output arrays (same shapes as the vec_wait arguments).
+// After this, workers fill them in as each env finishes its step, and vec_wait
+// ignores its buffer arguments. Must not be called while a step is in progress.
+void vec_set_buffers(
+  int handle,
+  uint8_t* obs_rgb,
+  uint8_t* obs_hires_rgb,
+  uint8_t* obs_audio_seg_map,
+  float* rew,
+  bool* done,
+  bool* new_level)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  assert(vstate->steps_outstanding.load() == 0);
+  vstate->registered_outputs.obs_rgb = obs_rgb;
+  vstate->registered_outputs.obs_hires_rgb = obs_hires_rgb;
+  vstate->registered_outputs.obs_audio_seg_map = obs_audio_seg_map;
+  vstate->registered_outputs.rew = rew;
+  vstate->registered_outputs.done = done;
+  vstate->registered_outputs.new_level = new_level;
+  vstate->has_registered_outputs = obs_rgb != 0;
+}
+
+// Registers the caller-owned symbolic observation arrays of an OBS_SYMBOLIC vector,
+// [nenvs][SYMBOLIC_TILES_H][SYMBOLIC_TILES_W] uint8, [nenvs][SYMBOLIC_AGENT_DIM] float and
+// [nenvs][SYMBOLIC_MONSTERS][SYMBOLIC_MONSTER_DIM] float. Unlike vec_set_buffers these are
+// also used by vec_wait. Must not be called while a step is in progress.
+void vec_set_symbolic_buffers(int handle, uint8_t* obs_tiles, float* obs_agent, float* obs_monsters)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  assert(vstate->steps_outstanding.load() == 0);
+  assert(vstate->symbolic_obs && "vec_set_symbolic_buffers on a pixel vector");
+  assert(obs_tiles && obs_agent && obs_monsters);
+  vstate->registered_outputs.obs_tiles = obs_tiles;
+  vstate->registered_outputs.obs_agent = obs_agent;
+  vstate->registered_outputs.obs_monsters = obs_monsters;
+}
+
+// Registers caller-owned event arrays, [nenvs][EVENT_RING_SIZE] Event and [nenvs] int32.
+// Every step writes the events of env e since its previous step into events[e], oldest
+// first, and their number into counts[e]. Also used by vec_wait, like the symbolic
+// buffers. Must not be called while a step is in progress.
+void vec_set_event_buffers(int handle, Event* events, int32_t* counts)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  assert(vstate->steps_outstanding.load() == 0);
+  assert(!events == !counts);
+  vstate->registered_outputs.events = events;
+  vstate->registered_outputs.event_counts = counts;
 }
 
 void vec_wait(
@@ -2174,52 +6392,330 @@ void vec_wait(
   bool* new_level)
 {
   std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
-  while (1) {
-    QMutexLocker sleeplock(&h2s_mutex);
-    bool all_steps_completed = true;
-    {
-      QMutexLocker lock2(&vstate->states_mutex);
-      for (int e = 0; e < vstate->nenvs; e++) {
-        std::shared_ptr<State> state = vstate->states[e];
-        QMutexLocker lock3(&state->step_mutex);
-        all_steps_completed &= !state->agent_ready;
-      }
-    }
-    if (all_steps_completed)
-      break;
-    wait_for_step_completed.wait(&h2s_mutex, 1000); // milliseconds
+  vstate->check_symbolic_buffers();
+  {
+    STATS_SCOPE(STAT_WAIT);
+    vstate->wait_steps_done();
+  }
+  if (vstate->async_steps) {
+    // everything stepped is done, and collected here
+    QMutexLocker lock(&vstate->completion_mutex);
+    vstate->completed.clear();
+    vstate->async_busy.assign(vstate->nenvs, 0);
   }
+  if (vstate->has_registered_outputs)
+    return; // workers already wrote everything into the registered buffers
+
+  StepOutputs out;
+  out.obs_rgb = obs_rgb;
+  out.obs_hires_rgb = obs_hires_rgb;
+  out.obs_audio_seg_map = obs_audio_seg_map;
+  out.rew = rew;
+  out.done = done;
+  out.new_level = new_level;
+  out.obs_tiles = vstate->registered_outputs.obs_tiles;
+  out.obs_agent = vstate->registered_outputs.obs_agent;
+  out.obs_monsters = vstate->registered_outputs.obs_monsters;
+  out.events = vstate->registered_outputs.events;
+  out.event_counts = vstate->registered_outputs.event_counts;
+
   QMutexLocker lock1(&vstate->states_mutex);
   for (int e = 0; e < vstate->nenvs; e++) {
     std::shared_ptr<State> state_e = vstate->states[e];
     QMutexLocker lock2(&state_e->state_mutex);
     // don't really need a mutex, because step is completed, but it's cheap to lock anyway
-    Agent& a = state_e->agent;
-    if (a.collect_data) {
-      copy_render_buf(e, obs_hires_rgb, a.render_hires_buf, VIDEORES, VIDEORES);
-      copy_audio_buf(e, obs_audio_seg_map, a.audio_seg_map_buf, AUDIO_MAP_SIZE);
+    write_step_outputs(e, out, state_e.get());
+  }
+}
+
+// Takes up to max_n finished envs of an async vector off its completed list, waiting
+// for at least min_n of them unless nothing is running anymore. Their indices go to
+// env_idx, oldest first; their results to the same rows vec_wait would use.
+static
+int vec_collect(
+  int handle,
+  int min_n,
+  int max_n,
+  int32_t* env_idx,
+  uint8_t* obs_rgb,
+  uint8_t* obs_hires_rgb,
+  uint8_t* obs_audio_seg_map,
+  float* rew,
+  bool* done,
+  bool* new_level)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  assert(vstate->async_steps && "vec_wait_any/vec_poll without vec_step_async_subset");
+  vstate->check_symbolic_buffers();
+  int n;
+  {
+    STATS_SCOPE(STAT_WAIT);
+    QMutexLocker lock(&vstate->completion_mutex);
+    while ((int)vstate->completed.size() < min_n && vstate->steps_outstanding.load() > 0)
+      vstate->step_completed.wait(&vstate->completion_mutex, 1000); // milliseconds
+    n = min(max_n, (int)vstate->completed.size());
+    std::copy(vstate->completed.begin(), vstate->completed.begin() + n, env_idx);
+    vstate->completed.erase(vstate->completed.begin(), vstate->completed.begin() + n);
+  }
+  for (int i = 0; i < n; i++)
+    vstate->async_busy[env_idx[i]] = 0;
+  if (vstate->has_registered_outputs)
+    return n;
+
+  StepOutputs out;
+  out.obs_rgb = obs_rgb;
+  out.obs_hires_rgb = obs_hires_rgb;
+  out.obs_audio_seg_map = obs_audio_seg_map;
+  out.rew = rew;
+  out.done = done;
+  out.new_level = new_level;
+  out.obs_tiles = vstate->registered_outputs.obs_tiles;
+  out.obs_agent = vstate->registered_outputs.obs_agent;
+  out.obs_monsters = vstate->registered_outputs.obs_monsters;
+  out.events = vstate->registered_outputs.events;
+  out.event_counts = vstate->registered_outputs.event_counts;
+  for (int i = 0; i < n; i++) {
+    State* state = vstate->states[env_idx[i]].get();
+    QMutexLocker lock(&state->state_mutex);
+    write_step_outputs(env_idx[i], out, state);
+  }
+  return n;
+}
+
+// After vec_step_async_subset(): blocks until k of the stepped envs are done (fewer
+// if fewer are still running) and returns how many it collected, at most k. Buffers
+// are those of vec_wait, with registered buffers the rows of the returned envs are
+// already filled in and the arguments are ignored.
+int vec_wait_any(
+  int handle,
+  int k,
+  int32_t* env_idx,
+  uint8_t* obs_rgb,
+  uint8_t* obs_hires_rgb,
+  uint8_t* obs_audio_seg_map,
+  float* rew,
+  bool* done,
+  bool* new_level)
+{
+  return vec_collect(handle, k, k, env_idx, obs_rgb, obs_hires_rgb, obs_audio_seg_map, rew, done, new_level);
+}
+
+// Like vec_wait_any(), but never blocks: collects up to max_n envs that are done already.
+int vec_poll(
+  int handle,
+  int max_n,
+  int32_t* env_idx,
+  uint8_t* obs_rgb,
+  uint8_t* obs_hires_rgb,
+  uint8_t* obs_audio_seg_map,
+  float* rew,
+  bool* done,
+  bool* new_level)
+{
+  return vec_collect(handle, 0, max_n, env_idx, obs_rgb, obs_hires_rgb, obs_audio_seg_map, rew, done, new_level);
+}
+
+// Copies up to max_frames finished hires frames of env e, oldest first, into
+// consecutive VIDEORES x VIDEORES RGB slots of obs_hires_rgb. Returns how many were
+// copied. Only meaningful with VIDEO_THREADS > 0 and no video sink, otherwise always 0.
+int vec_video_drain(int handle, int e, uint8_t* obs_hires_rgb, int max_frames)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  const std::shared_ptr<VideoQueue>& q = vstate->states[e]->video;
+  if (!q)
+    return 0;
+
+  QMutexLocker lock(&q->mutex);
+  int n = 0;
+  while (n < max_frames && !q->done.empty()) {
+    std::unique_ptr<VideoFrame> f = std::move(q->done.front());
+    q->done.pop_front();
+    copy_render_buf(n++, obs_hires_rgb, f->pixels.data(), VIDEORES, VIDEORES);
+    q->spare.push_back(std::move(f));
+  }
+  q->pending -= n;
+  if (n > 0)
+    q->changed.wakeAll();
+  return n;
+}
+
+// Waits until every frame queued so far by this vector's envs has been painted.
+void vec_video_wait(int handle)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  for (int e = 0; e < vstate->nenvs; e++) {
+    const std::shared_ptr<VideoQueue>& q = vstate->states[e]->video;
+    if (!q)
+      continue;
+    QMutexLocker lock(&q->mutex);
+    while ((int)q->done.size() < q->pending && !shutdown_flag)
+      q->changed.wait(&q->mutex, 1000); // milliseconds
+  }
+}
+
+// Saves env e, between vec_wait() and the next step, into snapshot snap, or into a new
+// one if snap is 0. Returns the snapshot handle. Overwriting an old snapshot reuses its
+// memory, which is what a search saving thousands of nodes per second wants.
+int vec_snapshot_save(int handle, int e, int snap)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  std::shared_ptr<Snapshot> s;
+  {
+    QMutexLocker lock(&snapshots_mutex);
+    if (snap == 0) {
+      snap = snapshot_seq++;
+      snapshots[snap].reset(new Snapshot);
     }
-    copy_render_buf(e, obs_rgb, a.render_buf, RES_W, RES_H);
-    
+    auto f = snapshots.find(snap);
+    if (f == snapshots.end()) {
+      fprintf(stderr, "cannot find snapshot handle %i\n", snap);
+      assert(0);
+    }
+    s = f->second;
+  }
+  const std::shared_ptr<State>& state = vstate->states[e];
+  QMutexLocker lock(&state->state_mutex);
+  state_snapshot_save(s.get(), state.get());
+  return snap;
+}
+
+// Puts env e, of this or any other vec of the same process, back into the saved state.
+// Its next step continues from there, the observation of vec_wait() is not changed.
+void vec_snapshot_load(int handle, int e, int snap)
+{
+  std::shared_ptr<VectorOfStates> vstate = vstate_find(handle);
+  std::shared_ptr<Snapshot> s;
+  {
+    QMutexLocker lock(&snapshots_mutex);
+    auto f = snapshots.find(snap);
+    if (f == snapshots.end()) {
+      fprintf(stderr, "cannot find snapshot handle %i\n", snap);
+      assert(0);
+    }
+    s = f->second;
+  }
+  const std::shared_ptr<State>& state = vstate->states[e];
+  QMutexLocker lock(&state->state_mutex);
+  state_snapshot_load(state, *s);
+}
+
+// Stage names, see StatsStage. get_stats_n() is 0 when built without COINRUN_STATS.
+int get_stats_n()
+{
+#ifdef COINRUN_STATS
+  return STATS_N;
+#else
+  return 0;
+#endif
+}
+
+const char* get_stats_name(int i)
+{
+  return (i >= 0 && i < STATS_N) ? STATS_NAMES[i] : "";
+}
+
+#ifdef COINRUN_STATS
+static QMutex stats_mutex; // readers only, guards the baseline below
+static uint64_t stats_base_count[STATS_N];
+static uint64_t stats_base_ticks[STATS_N];
+static uint64_t stats_t0_ticks = stats_ticks();
+static double stats_t0_seconds = get_time();
+
+static
+void stats_sum(uint64_t* count, uint64_t* ticks)
+{
+  for (int k = 0; k < STATS_N; k++)
+    count[k] = ticks[k] = 0;
+  int used = min(STATS_SLOTS, stats_slots_used.load());
+  for (int t = 0; t < used; t++) {
+    for (int k = 0; k < STATS_N; k++) {
+      count[k] += stats_slots[t].count[k].load(std::memory_order_relaxed);
+      ticks[k] += stats_slots[t].ticks[k].load(std::memory_order_relaxed);
+    }
+  }
+}
+#endif
 
-    rew[e] = a.reward;
-    done[e] = a.game_over;
-    new_level[e] = state_e->maze->is_new_level;
-    a.reward = 0;
-    a.game_over = false;
-    state_e->maze->is_new_level = false;
+// Calls and seconds per stage since the last reset_stats(), over all threads, into
+// arrays of get_stats_n().
+void get_stats(int64_t* counts, double* seconds)
+{
+#ifdef COINRUN_STATS
+  QMutexLocker lock(&stats_mutex);
+  uint64_t count[STATS_N], ticks[STATS_N];
+  stats_sum(count, ticks);
+  // ticks are TSC cycles (or nanoseconds), calibrated against the clock since startup
+  double elapsed = get_time() - stats_t0_seconds;
+  double ticks_per_second = elapsed > 0 ? (stats_ticks() - stats_t0_ticks) / elapsed : 1e9;
+  for (int k = 0; k < STATS_N; k++) {
+    counts[k] = count[k] - stats_base_count[k];
+    seconds[k] = (ticks[k] - stats_base_ticks[k]) / ticks_per_second;
   }
+#else
+  (void)counts;
+  (void)seconds;
+#endif
+}
+
+void reset_stats()
+{
+#ifdef COINRUN_STATS
+  // the counters only ever grow, a reset moves the baseline
+  QMutexLocker lock(&stats_mutex);
+  stats_sum(stats_base_count, stats_base_ticks);
+#endif
+}
+
+void snapshot_free(int snap)
+{
+  QMutexLocker lock(&snapshots_mutex);
+  snapshots.erase(snap);
 }
 
 void coinrun_shutdown()
 {
   shutdown_flag = true;
+  {
+    QMutexLocker lock(&idle_mutex);
+    wait_for_actions.wakeAll();
+  }
   while (!all_threads.empty()) {
     std::shared_ptr<QThread> th = all_threads.back();
     all_threads.pop_back();
     th->wait();
     assert(th->isFinished());
   }
+  for (const std::unique_ptr<RenderQueue>& rq: render_queues) {
+    QMutexLocker lock(&rq->mutex);
+    rq->wake.wakeAll();
+  }
+  while (!render_threads.empty()) {
+    std::shared_ptr<QThread> th = render_threads.back();
+    render_threads.pop_back();
+    th->wait();
+    assert(th->isFinished());
+  }
+  render_queues.clear();
+
+  if (level_pregen) {
+    {
+      QMutexLocker lock(&level_pregen_mutex);
+      level_pregen_wake.wakeAll();
+    }
+    level_pregen->wait();
+    level_pregen.reset();
+    level_pregen_todo.clear();
+  }
+
+  if (monitor_writer) {
+    {
+      QMutexLocker lock(&monitor_logs_mutex);
+      monitor_writer_stop = true;
+      monitor_writer_wake.wakeAll();
+    }
+    monitor_writer->wait();
+    monitor_writer.reset();
+  }
 }
 }
 
@@ -2233,12 +6729,14 @@ public:
 
   int font_h;
   int render_mode = 0;
+  VideoFrame frame;
 
   void paint(QPainter& p, const QRect& rect)
   {
     Agent& agent = show_state->agent;
 
-    paint_the_world_for_video_data(p, rect, show_state, &agent);
+    video_frame_snapshot(&frame, show_state, &agent);
+    paint_the_world_for_video_data(p, rect, frame, agent.video_themes);
 
     QRect text_rect = rect;
     text_rect.adjust(font_h/3, font_h/3, -font_h/3, -font_h/3);
@@ -2374,7 +6872,7 @@ public:
     fprintf(stderr, "starting ffmpeg\n");
     QStringList arguments;
     arguments << "-y" << "-r" << "30" <<
-      "-f" << "rawvideo" << "-s:v" << (VIDEORES_STR "x" VIDEORES_STR) << "-pix_fmt" << "rgb32" <<
+      "-f" << "rawvideo" << "-s:v" << QString::fromStdString(stdprintf("%ix%i", VIDEORES, VIDEORES)) << "-pix_fmt" << "rgb32" <<
       "-i" << "-" << "-vcodec" << "libx264" << "-pix_fmt" << "yuv420p" << "-crf" << "10" <<
       "coinrun-manualplay.mp4";
     viz->ffmpeg.start("ffmpeg", arguments);
@@ -2446,7 +6944,7 @@ extern "C" void test_main_loop()
     app = new QApplication(argc, const_cast<char **>(argv));
   }
 
-  int handle = vec_create(1, 0, false, 5.0);
+  int handle = vec_create(1, 0, false, 5.0, OBS_PIXELS);
 
   window = new TestWindow();
   window->resize(800, 800);
@@ -0,0 +1,301 @@
+// Throughput benchmark of the engine alone, without Python in the loop. Random agents
+// are driven through vec_step_async_discrete/vec_wait for every combination of the
+// swept parameters, and the results are printed to stdout as one JSON document:
+//
+//   make bench && .build-release/coinrun_bench --nenvs 16,64 --threads 1,4 > bench.json
+//
+// Progress goes to stderr. Run with --help for the parameters.
+//
+// Steps in which some env had a game over also reset it, so they are timed apart from
+// the others: reset_us is the median, over those steps, of their latency above the
+// median latency of steps without a game over, per game over. It is null when a run
+// had no steps of one kind.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+
+extern "C" {
+int get_NUM_ACTIONS();
+int get_RES_W();
+int get_RES_H();
+int get_VIDEORES();
+int get_AUDIO_MAP_SIZE();
+void initialize_args(int *int_args, float *float_args);
+void init(int threads);
+void coinrun_shutdown();
+int vec_create(int nenvs, int lump_n, bool collect_data, float default_zoom, int obs_mode);
+void vec_close(int handle);
+void vec_step_async_discrete(int handle, int32_t *actions);
+void vec_set_buffers(int handle, uint8_t* obs_rgb, uint8_t* obs_hires_rgb, uint8_t* obs_audio_seg_map, float* rew, bool* done, bool* new_level);
+void vec_wait(int handle, uint8_t* obs_rgb, uint8_t* obs_hires_rgb, uint8_t* obs_audio_seg_map, float* rew, bool* done, bool* new_level);
+}
+
+struct BenchArgs {
+  std::vector<int> nenvs = {16, 64};
+  std::vector<int> threads = {1, 4};
+  std::vector<int> collect_data = {0, 1};
+  std::vector<float> zoom = {5.5};
+  std::vector<int> num_levels = {0, 500};
+  int steps = 1000;
+  int warmup = 50;
+  int video_res = 256;
+  int fast_render = 0;
+  int batch_physics = 0;
+  int video_gl = 0;
+  int seed = 1;
+};
+
+struct BenchResult {
+  int nenvs, threads, collect_data, num_levels;
+  float zoom;
+  int steps;
+  double seconds;
+  double env_steps_per_sec;
+  double latency_p50_us, latency_p99_us;
+  double done_latency_p50_us; // of steps with a game over
+  double reset_us;
+  bool reset_measured;        // false without steps of one of the two kinds
+  long dones;
+};
+
+static
+double now_seconds()
+{
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+template<typename T>
+static
+std::vector<T> parse_list(const char* s)
+{
+  std::vector<T> v;
+  while (*s) {
+    char* end;
+    double x = strtod(s, &end);
+    if (end == s) {
+      fprintf(stderr, "cannot parse list '%s'\n", s);
+      exit(1);
+    }
+    v.push_back(T(x));
+    s = *end == ',' ? end + 1 : end;
+  }
+  return v;
+}
+
+static
+void usage()
+{
+  fprintf(stderr,
+    "coinrun_bench [options], lists are comma separated and swept over:\n"
+    "  --nenvs LIST         envs per vector (16,64)\n"
+    "  --threads LIST       stepping threads (1,4)\n"
+    "  --collect-data LIST  0 agent frames only, 1 with hires frames and audio maps (0,1)\n"
+    "  --zoom LIST          default zoom of the hires frames (5.5)\n"
+    "  --num-levels LIST    NUM_LEVELS, 0 is unbounded (0,500)\n"
+    "  --steps N            timed vec steps per run (1000)\n"
+    "  --warmup N           untimed vec steps before that (50)\n"
+    "  --video-res N        hires frame size with collect data (256)\n"
+    "  --fast-render 0|1    USE_FAST_AGENT_RENDER (0)\n"
+    "  --batch-physics 0|1  BATCHED_PHYSICS (0)\n"
+    "  --video-gl 0|1       VIDEO_GL, needs a COINRUN_GL build (0)\n"
+    "  --seed N             random seed of levels and actions (1)\n");
+}
+
+static
+BenchArgs parse_args(int argc, char** argv)
+{
+  BenchArgs a;
+  for (int i = 1; i < argc; i++) {
+    std::string k = argv[i];
+    if (k == "--help" || k == "-h") {
+      usage();
+      exit(0);
+    }
+    if (i + 1 >= argc) {
+      usage();
+      exit(1);
+    }
+    const char* v = argv[++i];
+    if (k == "--nenvs") a.nenvs = parse_list<int>(v);
+    else if (k == "--threads") a.threads = parse_list<int>(v);
+    else if (k == "--collect-data") a.collect_data = parse_list<int>(v);
+    else if (k == "--zoom") a.zoom = parse_list<float>(v);
+    else if (k == "--num-levels") a.num_levels = parse_list<int>(v);
+    else if (k == "--steps") a.steps = atoi(v);
+    else if (k == "--warmup") a.warmup = atoi(v);
+    else if (k == "--video-res") a.video_res = atoi(v);
+    else if (k == "--fast-render") a.fast_render = atoi(v);
+    else if (k == "--batch-physics") a.batch_physics = atoi(v);
+    else if (k == "--video-gl") a.video_gl = atoi(v);
+    else if (k == "--seed") a.seed = atoi(v);
+    else {
+      usage();
+      exit(1);
+    }
+  }
+  return a;
+}
+
+static
+double percentile(std::vector<double>& v, double p)
+{
+  if (v.empty())
+    return 0;
+  size_t k = std::min(v.size() - 1, size_t(p * (v.size() - 1) + 0.5));
+  std::nth_element(v.begin(), v.begin() + k, v.end());
+  return v[k];
+}
+
+static
+BenchResult bench_run(const BenchArgs& args, int nenvs, int threads, int collect_data, float zoom, int num_levels)
+{
+  BenchResult r;
+  r.nenvs = nenvs;
+  r.threads = threads;
+  r.collect_data = collect_data;
+  r.zoom = zoom;
+  r.num_levels = num_levels;
+  r.steps = args.steps;
+
+  int res_w = get_RES_W();
+  int res_h = get_RES_H();
+  int hires = collect_data ? get_VIDEORES() : 1;
+  int audio = collect_data ? get_AUDIO_MAP_SIZE() : 1;
+  std::vector<uint8_t> obs_rgb(size_t(nenvs) * res_w * res_h * 3);
+  std::vector<uint8_t> obs_hires(collect_data ? size_t(nenvs) * hires * hires * 3 : 1);
+  std::vector<uint8_t> obs_audio(collect_data ? size_t(nenvs) * audio : 1);
+  std::vector<float> rew(nenvs);
+  std::unique_ptr<bool[]> done(new bool[nenvs]);
+  std::unique_ptr<bool[]> new_level(new bool[nenvs]);
+  std::vector<int32_t> actions(nenvs);
+
+  int h = vec_create(nenvs, 0, collect_data != 0, zoom, 0);
+  vec_set_buffers(h, obs_rgb.data(), obs_hires.data(), obs_audio.data(), rew.data(), done.get(), new_level.get());
+
+  std::mt19937 rng(args.seed);
+  int num_actions = get_NUM_ACTIONS();
+  std::vector<double> latency;
+  std::vector<double> plain_latency; // of the steps without game overs
+  std::vector<double> done_latency;  // of the steps with game overs
+  std::vector<int> done_count;       // and how many there were in each
+  latency.reserve(args.steps);
+  r.dones = 0;
+  double start = 0;
+  for (int t = -args.warmup; t < args.steps; t++) {
+    if (t == 0)
+      start = now_seconds();
+    for (int e = 0; e < nenvs; e++)
+      actions[e] = rng() % num_actions;
+    double s = now_seconds();
+    vec_step_async_discrete(h, actions.data());
+    vec_wait(h, obs_rgb.data(), obs_hires.data(), obs_audio.data(), rew.data(), done.get(), new_level.get());
+    if (t < 0)
+      continue;
+    double us = (now_seconds() - s) * 1e6;
+    int step_dones = 0;
+    for (int e = 0; e < nenvs; e++)
+      step_dones += done[e];
+    r.dones += step_dones;
+    latency.push_back(us);
+    if (step_dones > 0) {
+      done_latency.push_back(us);
+      done_count.push_back(step_dones);
+    } else {
+      plain_latency.push_back(us);
+    }
+  }
+  r.seconds = now_seconds() - start;
+  r.env_steps_per_sec = r.seconds > 0 ? double(args.steps) * nenvs / r.seconds : 0;
+  r.latency_p50_us = percentile(latency, 0.50);
+  r.latency_p99_us = percentile(latency, 0.99);
+  r.done_latency_p50_us = percentile(done_latency, 0.50);
+  r.reset_us = 0;
+  r.reset_measured = !plain_latency.empty() && !done_latency.empty();
+  if (r.reset_measured) {
+    double plain_p50 = percentile(plain_latency, 0.50);
+    std::vector<double> per_reset;
+    for (size_t i = 0; i < done_latency.size(); i++)
+      per_reset.push_back((done_latency[i] - plain_p50) / done_count[i]);
+    r.reset_us = percentile(per_reset, 0.50);
+  }
+  vec_close(h);
+  return r;
+}
+
+static
+void init_engine(const BenchArgs& args, int num_levels)
+{
+  int int_args[13] = {
+    num_levels,
+    1,                   // PAINT_VEL_INFO
+    0,                   // USE_DATA_AUGMENTATION
+    -1,                  // training sets seed
+    args.seed,
+    1000,                // LEVEL_TIMEOUT
+    args.fast_render,
+    args.video_res,
+    0,                   // VIDEO_THREADS
+    args.batch_physics,
+    0,                   // PIN_THREADS
+    0,                   // local rank
+    args.video_gl,
+  };
+  float float_args[7] = { 0.15f, 0.0f, 0.0f, 5.0f, 0.0f, 0.0f, 0.0f };
+  initialize_args(int_args, float_args);
+}
+
+int main(int argc, char** argv)
+{
+  BenchArgs args = parse_args(argc, argv);
+
+  if (!getenv("COINRUN_RESOURCES_PATH")) {
+    // the binary lives in coinrun/.build-release, the assets in coinrun/assets
+    std::string dir = argv[0];
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : dir.substr(0, slash);
+    setenv("COINRUN_RESOURCES_PATH", (dir + "/../assets").c_str(), 0);
+  }
+
+  std::vector<BenchResult> results;
+  for (int num_levels: args.num_levels) {
+    init_engine(args, num_levels);
+    for (int threads: args.threads) {
+      init(threads);
+      for (int nenvs: args.nenvs)
+        for (int collect_data: args.collect_data)
+          for (float zoom: args.zoom) {
+            BenchResult r = bench_run(args, nenvs, threads, collect_data, zoom, num_levels);
+            fprintf(stderr, "nenvs=%i threads=%i collect_data=%i zoom=%g num_levels=%i: %.0f steps/s, p50 %.0f us, p99 %.0f us\n",
+              nenvs, threads, collect_data, zoom, num_levels, r.env_steps_per_sec, r.latency_p50_us, r.latency_p99_us);
+            results.push_back(r);
+          }
+      coinrun_shutdown();
+    }
+  }
+
+  printf("{\n  \"steps\": %i,\n  \"warmup\": %i,\n  \"video_res\": %i,\n  \"fast_render\": %i,\n  \"batch_physics\": %i,\n  \"video_gl\": %i,\n  \"seed\": %i,\n  \"results\": [\n",
+    args.steps, args.warmup, args.video_res, args.fast_render, args.batch_physics, args.video_gl, args.seed);
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult& r = results[i];
+    char reset_us[32] = "null";
+    if (r.reset_measured)
+      snprintf(reset_us, sizeof(reset_us), "%.1f", r.reset_us);
+    printf("    {\"nenvs\": %i, \"threads\": %i, \"collect_data\": %i, \"zoom\": %g, \"num_levels\": %i, "
+      "\"seconds\": %.6f, \"env_steps_per_sec\": %.1f, \"step_latency_p50_us\": %.1f, \"step_latency_p99_us\": %.1f, "
+      "\"done_step_latency_p50_us\": %.1f, \"reset_us\": %s, \"dones\": %li}%s\n",
+      r.nenvs, r.threads, r.collect_data, r.zoom, r.num_levels,
+      r.seconds, r.env_steps_per_sec, r.latency_p50_us, r.latency_p99_us,
+      r.done_latency_p50_us, reset_us, r.dones, i + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+  return 0;
+}
@@ -10,7 +10,7 @@ import os
 import atexit
 import random
 import sys
-from ctypes import c_int, c_char_p, c_float, c_bool
+from ctypes import c_int, c_char_p, c_float, c_bool, c_void_p, c_uint64
 
 import gym
 import gym.spaces
@@ -57,21 +57,68 @@ lib.get_NUM_ACTIONS.restype = c_int
 lib.get_RES_W.restype = c_int
 lib.get_RES_H.restype = c_int
 lib.get_VIDEORES.restype = c_int
+lib.get_VIDEO_MAX_PENDING.restype = c_int
+lib.get_SYMBOLIC_TILES_W.restype = c_int
+lib.get_SYMBOLIC_TILES_H.restype = c_int
+lib.get_SYMBOLIC_AGENT_DIM.restype = c_int
+lib.get_SYMBOLIC_MONSTERS.restype = c_int
+lib.get_SYMBOLIC_MONSTER_DIM.restype = c_int
+lib.get_EVENT_RING_SIZE.restype = c_int
+lib.get_MAX_ACTION_REPEAT.restype = c_int
+lib.get_env_rand_key.argtypes = [c_int, c_int, c_int, c_int]  # rand_seed, local rank, vec_n, env_n
+lib.get_env_rand_key.restype = c_uint64
+
+# struct Event in coinrun.cpp, kind is one of EVENT_KINDS
+EVENT_DTYPE = np.dtype({
+    'names': ['frame', 'x', 'y', 'kind'],
+    'formats': [np.int32, np.float32, np.float32, np.uint8],
+    'offsets': [0, 4, 8, 12],
+    'itemsize': 16,
+    })
+EVENT_KINDS = ['ladder_climbing', 'jump', 'walk', 'bumped_head', 'killed', 'coin', 'killed_monster', 'gem']
 
 lib.vec_create.argtypes = [
     c_int,    # nenvs
     c_int,    # lump_n
     c_bool,   # collect_data
     c_float,  # default_zoom
+    c_int,    # obs_mode, 0 pixels or 1 symbolic
     ]
 lib.vec_create.restype = c_int
 
 lib.vec_close.argtypes = [c_int]
 
 lib.vec_step_async_discrete.argtypes = [c_int, npct.ndpointer(dtype=np.int32, ndim=1)]
+lib.vec_step_async_discrete_repeat.argtypes = [c_int, npct.ndpointer(dtype=np.int32, ndim=1), c_int]
 
 lib.initialize_args.argtypes = [npct.ndpointer(dtype=np.int32, ndim=1), npct.ndpointer(dtype=np.float32, ndim=1)]
 lib.initialize_set_monitor_dir.argtypes = [c_char_p, c_int]
+lib.initialize_set_video_sink.argtypes = [c_char_p, c_int]
+lib.initialize_set_asset_atlas.argtypes = [c_char_p]
+lib.initialize_set_monitor_format.argtypes = [c_int]
+
+lib.vec_set_buffers.argtypes = [
+    c_int,
+    npct.ndpointer(dtype=np.uint8, ndim=4),    # smaller rgb for input to agent
+    npct.ndpointer(dtype=np.uint8, ndim=4),    # larger rgb for hires render
+    npct.ndpointer(dtype=np.uint8, ndim=2),    # audio semantic map
+    npct.ndpointer(dtype=np.float32, ndim=1),  # reward
+    npct.ndpointer(dtype=np.bool, ndim=1),     # done
+    npct.ndpointer(dtype=np.bool, ndim=1),     # new_level
+    ]
+
+lib.vec_set_symbolic_buffers.argtypes = [
+    c_int,
+    npct.ndpointer(dtype=np.uint8, ndim=3),    # tiles around the agent
+    npct.ndpointer(dtype=np.float32, ndim=2),  # agent state
+    npct.ndpointer(dtype=np.float32, ndim=3),  # nearest monsters
+    ]
+
+lib.vec_set_event_buffers.argtypes = [
+    c_int,
+    npct.ndpointer(dtype=EVENT_DTYPE, ndim=2), # events of the last step [nenvs, EVENT_RING_SIZE]
+    npct.ndpointer(dtype=np.int32, ndim=1),    # how many of them
+    ]
 
 lib.vec_wait.argtypes = [
     c_int,
@@ -83,6 +130,50 @@ lib.vec_wait.argtypes = [
     npct.ndpointer(dtype=np.bool, ndim=1),     # new_level
     ]
 
+lib.vec_step_async_subset.argtypes = [
+    c_int,
+    npct.ndpointer(dtype=np.int32, ndim=1),    # env indices
+    npct.ndpointer(dtype=np.int32, ndim=1),    # their actions
+    c_int,                                     # how many
+    ]
+
+# vec_wait_any(handle, k, ...) and vec_poll(handle, max_n, ...), the buffers are those of vec_wait
+for f in [lib.vec_wait_any, lib.vec_poll]:
+    f.argtypes = [c_int, c_int, npct.ndpointer(dtype=np.int32, ndim=1)] + lib.vec_wait.argtypes[1:]
+    f.restype = c_int
+
+lib.vec_video_drain.argtypes = [
+    c_int,
+    c_int,                                     # env index
+    npct.ndpointer(dtype=np.uint8, ndim=4),    # hires rgb frames, oldest first
+    c_int,                                     # max frames
+    ]
+lib.vec_video_drain.restype = c_int
+
+lib.vec_video_wait.argtypes = [c_int]
+
+# buffers as c_void_p, so that observations can be left out with None
+lib.vec_rollout.argtypes = [
+    c_int,
+    npct.ndpointer(dtype=np.int32, ndim=2),    # actions [T, nenvs]
+    c_int,                                     # T
+    c_int,                                     # action repeat
+    c_void_p, c_void_p, c_void_p,              # obs rgb, hires rgb, audio seg map, time-major
+    c_void_p, c_void_p, c_void_p,              # rew, done, new_level [T, nenvs]
+    c_void_p, c_void_p, c_void_p,              # symbolic tiles, agent, monsters
+    c_void_p, c_void_p,                        # events [T, nenvs, EVENT_RING_SIZE], event counts [T, nenvs]
+    ]
+
+lib.get_stats_n.restype = c_int
+lib.get_stats_name.argtypes = [c_int]
+lib.get_stats_name.restype = c_char_p
+lib.get_stats.argtypes = [npct.ndpointer(dtype=np.int64, ndim=1), npct.ndpointer(dtype=np.float64, ndim=1)]
+
+lib.vec_snapshot_save.argtypes = [c_int, c_int, c_int]  # vec handle, env index, snapshot handle or 0
+lib.vec_snapshot_save.restype = c_int
+lib.vec_snapshot_load.argtypes = [c_int, c_int, c_int]
+lib.snapshot_free.argtypes = [c_int]
+
 already_inited = False
 
 def init_args_and_threads(cpu_count=4,
@@ -95,14 +186,18 @@ def init_args_and_threads(cpu_count=4,
     """
     os.environ['COINRUN_RESOURCES_PATH'] = os.path.join(SCRIPT_DIR, 'assets')
 
+    # pinned stepping threads of the processes on one machine go to different cores
+    local_rank, local_size = mpi_util.get_local_rank_size(MPI.COMM_WORLD)
+
     if rand_seed is None:
         rand_seed = random.SystemRandom().randint(0, 1000000000)
 
         # ensure different MPI processes get different seeds (just in case SystemRandom implementation is poor)
-        mpi_rank, mpi_size = mpi_util.get_local_rank_size(MPI.COMM_WORLD)
-        rand_seed = rand_seed - rand_seed % mpi_size + mpi_rank
+        rand_seed = rand_seed - rand_seed % local_size + local_rank
 
-    int_args = np.array([Config.NUM_LEVELS, int(Config.PAINT_VEL_INFO), Config.USE_DATA_AUGMENTATION, Config.SET_SEED, rand_seed, Config.LEVEL_TIMEOUT]).astype(np.int32)
+    # a monitor frame has room for the coins of at most MAX_ACTION_REPEAT game steps
+    assert 1 <= Config.ACTION_REPEAT <= lib.get_MAX_ACTION_REPEAT(), 'action_repeat must be in [1, %i]' % lib.get_MAX_ACTION_REPEAT()
+    int_args = np.array([Config.NUM_LEVELS, int(Config.PAINT_VEL_INFO), Config.USE_DATA_AUGMENTATION, Config.SET_SEED, rand_seed, Config.LEVEL_TIMEOUT, Config.FAST_RENDER, Config.VIDEO_RES, Config.VIDEO_THREADS, Config.BATCH_PHYSICS, Config.PIN_THREADS, local_rank, Config.VIDEO_GL]).astype(np.int32)
     float_args = np.array([Config.AIR_CONTROL, Config.BUMP_HEAD_PENALTY, Config.DIE_PENALTY, Config.KILL_MONSTER_REWARD, Config.JUMP_PENALTY, Config.SQUAT_PENALTY, Config.JITTER_SQUAT_PENALTY]).astype(np.float32)
     lib.initialize_args(int_args, float_args)
     # this specify the folder to write the monitor csv file in game engine
@@ -110,14 +205,50 @@ def init_args_and_threads(cpu_count=4,
     if not os.path.exists(csv_folder):
         os.makedirs(csv_folder)
     lib.initialize_set_monitor_dir(csv_folder.encode('utf-8'), {'off': 0, 'first_env': 1, 'all': 2}[monitor_csv_policy])
+    lib.initialize_set_monitor_format({'csv': 0, 'bin': 1, 'both': 2}[Config.MONITOR_FORMAT])
+    # hires videos encoded by the engine itself go next to the csv folder, one file per env and game
+    video_folder = os.path.join(os.path.dirname(csv_folder), 'video')
+    if Config.VIDEO_SINK != 'off' and not os.path.exists(video_folder):
+        os.makedirs(video_folder)
+    lib.initialize_set_video_sink(video_folder.encode('utf-8'), {'off': 0, 'y4m': 1, 'ffmpeg': 2}[Config.VIDEO_SINK])
 
     global already_inited
     if already_inited:
         return
 
+    if Config.ASSET_ATLAS == 'auto':
+        # in the user's cache, the installed package may be shared or read-only
+        cache_dir = os.environ.get('XDG_CACHE_HOME') or os.path.join(os.path.expanduser('~'), '.cache')
+        atlas_dir = os.path.join(cache_dir, 'coinrun')
+        try:
+            os.makedirs(atlas_dir, exist_ok=True)
+            atlas_path = os.path.join(atlas_dir, 'assets.atlas')
+        except OSError:
+            atlas_path = ''
+    elif Config.ASSET_ATLAS == 'off':
+        atlas_path = ''
+    else:
+        atlas_path = Config.ASSET_ATLAS
+    lib.initialize_set_asset_atlas(atlas_path.encode('utf-8'))
+
     lib.init(cpu_count)
     already_inited = True
 
+def get_stats(reset=False):
+    """
+    Calls and seconds spent per stage of the engine's hot path, summed over its threads,
+    as {stage: (count, seconds)} since the last reset. Empty unless the engine was built
+    with COINRUN_STATS=1 in the environment of the first build.
+    """
+    n = lib.get_stats_n()
+    counts = np.zeros([n], dtype=np.int64)
+    seconds = np.zeros([n], dtype=np.float64)
+    if n > 0:
+        lib.get_stats(counts, seconds)
+        if reset:
+            lib.reset_stats()
+    return {lib.get_stats_name(i).decode('utf-8'): (int(counts[i]), float(seconds[i])) for i in range(n)}
+
 @atexit.register
 def shutdown():
     global already_inited
@@ -133,6 +264,14 @@ class CoinRunVecEnv(VecEnv):
     `num_envs`: number of environments to create in this VecEnv
     `lump_n`: only used when the environment creates `monitor.csv` files
     `default_zoom`: controls how much of the level the agent can see
+
+    With `Config.SYMBOLIC_OBS` observations are dicts of 'tiles' (uint8 tile chars
+    around the agent, top row first), 'agent' (x, y, vx, vy, spring, facing_right,
+    ladder_mode, power_up_mode, is_killed, time_alive) and 'monsters' (nearest first:
+    present, dx, dy, vx, vy, theme_n, is_flying, is_walking, is_dead, can_be_killed).
+
+    The arrays `step_wait` returns are the engine's output buffers, not copies. They
+    stay valid until the next `step_wait`, copy anything that is kept for longer.
     """
     def __init__(self, num_envs, lump_n=0, default_zoom=5.5):
         self.metadata = {'render.modes': []}
@@ -142,23 +281,65 @@ class CoinRunVecEnv(VecEnv):
         self.RES_W       = lib.get_RES_W()
         self.RES_H       = lib.get_RES_H()
         self.VIDEORES    = lib.get_VIDEORES()
+        self.VIDEO_MAX_PENDING = lib.get_VIDEO_MAX_PENDING()
         self.AUDIO_MAP_SIZE = lib.get_AUDIO_MAP_SIZE()
 
-        self.buf_rew = np.zeros([num_envs], dtype=np.float32)
-        self.buf_done = np.zeros([num_envs], dtype=np.bool)
-        self.buf_new_level = np.zeros([num_envs], dtype=np.bool)
-        self.buf_rgb   = np.zeros([num_envs, self.RES_H, self.RES_W, 3], dtype=np.uint8)
-        
-        self.collect_data = Config.COLLECT_DATA
-        if self.collect_data:
-            self.buf_render_rgb = np.zeros([num_envs, self.VIDEORES, self.VIDEORES, 3], dtype=np.uint8)
-            self.buf_audio_seg_map = np.zeros([num_envs, self.AUDIO_MAP_SIZE], dtype=np.uint8)
+        self.symbolic_obs = bool(Config.SYMBOLIC_OBS)
+        if self.symbolic_obs:
+            # nothing is painted for the agent, so the rgb buffer is only a placeholder
+            rgb_shape = [1, 1, 1, 3]
         else:
-            self.buf_render_rgb = np.zeros([1, 1, 1, 1], dtype=np.uint8)
-            self.buf_audio_seg_map = np.zeros([1, 1], dtype=np.uint8)
+            rgb_shape = [num_envs, self.RES_H, self.RES_W, 3]
 
-        num_channels = 1 if Config.USE_BLACK_WHITE else 3
-        obs_space = gym.spaces.Box(0, 255, shape=[self.RES_H, self.RES_W, num_channels], dtype=np.uint8)
+        self.collect_data = Config.COLLECT_DATA
+        self.async_video = self.collect_data and Config.VIDEO_THREADS > 0
+        if self.collect_data and Config.VIDEO_SINK != 'off':
+            # the engine encodes hires frames itself, only metadata comes back here
+            render_shape = [1, 1, 1, 1]
+            audio_shape = [num_envs, self.AUDIO_MAP_SIZE]
+            self.async_video = False
+        elif self.async_video:
+            # hires frames come from drain_video(), not from step_wait()
+            render_shape = [1, 1, 1, 1]
+            self.buf_video_drain = np.zeros([self.VIDEO_MAX_PENDING, self.VIDEORES, self.VIDEORES, 3], dtype=np.uint8)
+            audio_shape = [num_envs, self.AUDIO_MAP_SIZE]
+        elif self.collect_data:
+            render_shape = [num_envs, self.VIDEORES, self.VIDEORES, 3]
+            audio_shape = [num_envs, self.AUDIO_MAP_SIZE]
+        else:
+            render_shape = [1, 1, 1, 1]
+            audio_shape = [1, 1]
+
+        # Two sets of output arrays. step_async registers the one step_wait did not hand
+        # out last, so the engine never writes into arrays the caller may still be reading.
+        self.out_sets = []
+        for _ in range(2):
+            out = {
+                'rgb': np.zeros(rgb_shape, dtype=np.uint8),
+                'render_rgb': np.zeros(render_shape, dtype=np.uint8),
+                'audio_seg_map': np.zeros(audio_shape, dtype=np.uint8),
+                'rew': np.zeros([num_envs], dtype=np.float32),
+                'done': np.zeros([num_envs], dtype=np.bool),
+                'new_level': np.zeros([num_envs], dtype=np.bool),
+                }
+            if self.symbolic_obs:
+                out['tiles'] = np.zeros([num_envs, lib.get_SYMBOLIC_TILES_H(), lib.get_SYMBOLIC_TILES_W()], dtype=np.uint8)
+                out['agent'] = np.zeros([num_envs, lib.get_SYMBOLIC_AGENT_DIM()], dtype=np.float32)
+                out['monsters'] = np.zeros([num_envs, lib.get_SYMBOLIC_MONSTERS(), lib.get_SYMBOLIC_MONSTER_DIM()], dtype=np.float32)
+            self.out_sets.append(out)
+        self.out_n = 0
+        self.async_steps = False
+        self._select_outputs(0)
+
+        if self.symbolic_obs:
+            obs_space = gym.spaces.Dict({
+                'tiles': gym.spaces.Box(0, 255, shape=self.buf_tiles.shape[1:], dtype=np.uint8),
+                'agent': gym.spaces.Box(-np.inf, np.inf, shape=self.buf_agent.shape[1:], dtype=np.float32),
+                'monsters': gym.spaces.Box(-np.inf, np.inf, shape=self.buf_monsters.shape[1:], dtype=np.float32),
+                })
+        else:
+            num_channels = 1 if Config.USE_BLACK_WHITE else 3
+            obs_space = gym.spaces.Box(0, 255, shape=[self.RES_H, self.RES_W, num_channels], dtype=np.uint8)
 
         super().__init__(
             num_envs=num_envs,
@@ -169,9 +350,42 @@ class CoinRunVecEnv(VecEnv):
             self.num_envs,
             lump_n,
             self.collect_data,
-            default_zoom)
+            default_zoom,
+            1 if self.symbolic_obs else 0)
+        self._register_outputs()
+        self.buf_events = np.zeros([num_envs, lib.get_EVENT_RING_SIZE()], dtype=EVENT_DTYPE)
+        self.buf_event_counts = np.zeros([num_envs], dtype=np.int32)
+        lib.vec_set_event_buffers(self.handle, self.buf_events, self.buf_event_counts)
         self.dummy_info = [{} for _ in range(num_envs)]
 
+    def _select_outputs(self, n):
+        out = self.out_sets[n]
+        self.out_n = n
+        self.buf_rgb = out['rgb']
+        self.buf_render_rgb = out['render_rgb']
+        self.buf_audio_seg_map = out['audio_seg_map']
+        self.buf_rew = out['rew']
+        self.buf_done = out['done']
+        self.buf_new_level = out['new_level']
+        if self.symbolic_obs:
+            self.buf_tiles = out['tiles']
+            self.buf_agent = out['agent']
+            self.buf_monsters = out['monsters']
+
+    def _register_outputs(self):
+        # the engine writes every step straight into these arrays, so both sets must stay
+        # allocated (and never be replaced) for the lifetime of the handle
+        lib.vec_set_buffers(
+            self.handle,
+            self.buf_rgb,
+            self.buf_render_rgb,
+            self.buf_audio_seg_map,
+            self.buf_rew,
+            self.buf_done,
+            self.buf_new_level)
+        if self.symbolic_obs:
+            lib.vec_set_symbolic_buffers(self.handle, self.buf_tiles, self.buf_agent, self.buf_monsters)
+
     def __del__(self):
         if hasattr(self, 'handle'):
             lib.vec_close(self.handle)
@@ -185,6 +399,101 @@ class CoinRunVecEnv(VecEnv):
         obs, _, _, _, _, _, r = self.step_wait()
         return obs
 
+    def drain_video(self, wait=False):
+        """
+        With `Config.VIDEO_THREADS` > 0 hires frames are painted in the background.
+        Returns, for each env, the frames finished since the last call as an array
+        of shape [n, VIDEORES, VIDEORES, 3], oldest first. Stepping an env blocks
+        once it has VIDEO_MAX_PENDING frames that were not drained, so call this
+        every few steps. `wait` first lets all queued frames finish painting.
+        """
+        if not self.async_video:
+            return [np.zeros([0, self.VIDEORES, self.VIDEORES, 3], dtype=np.uint8) for _ in range(self.num_envs)]
+        if wait:
+            lib.vec_video_wait(self.handle)
+        frames = []
+        for e in range(self.num_envs):
+            n = lib.vec_video_drain(self.handle, e, self.buf_video_drain, self.VIDEO_MAX_PENDING)
+            frames.append(self.buf_video_drain[:n].copy())
+        return frames
+
+    def get_events(self):
+        """
+        Returns, for each env, what happened to its agent during the last step as an
+        EVENT_DTYPE array (frame, x, y, kind), oldest first. `kind` indexes EVENT_KINDS,
+        which are also the columns of the audio semantic map.
+        """
+        return [self.buf_events[e, :n].copy() for e, n in enumerate(self.buf_event_counts)]
+
+    def save_state(self, e, snapshot=0):
+        """
+        Saves env `e` into a new snapshot, or over `snapshot` to reuse its memory, and
+        returns the snapshot handle. Call between `step_wait` and the next `step_async`.
+        """
+        return lib.vec_snapshot_save(self.handle, e, snapshot)
+
+    def load_state(self, e, snapshot):
+        """
+        Puts env `e` into the saved state, it may come from any env of the process.
+        The next step continues from there.
+        """
+        lib.vec_snapshot_load(self.handle, e, snapshot)
+
+    def free_state(self, snapshot):
+        lib.snapshot_free(snapshot)
+
+    def rollout(self, actions, observations=True, events=False):
+        """
+        Steps all envs len(actions) times without coming back to Python, for scripted
+        or random policies. `actions` is [T, num_envs]. Like `step_async`, every action
+        is held for Config.ACTION_REPEAT game steps. Returns time-major observations
+        (None without `observations`), rewards, dones and new level flags, and the step
+        events (None without `events`). Nothing is painted that isn't returned: no hires
+        frames or audio maps (a video sink still gets its frames), and no agent frames
+        without `observations`.
+
+        With `events` the step events are a list over steps of what `get_events` returns,
+        and `get_events` then reports the last step. Without, the events of the rollout
+        are dropped and `get_events` reports none.
+        """
+        actions = np.ascontiguousarray(actions, dtype=np.int32)
+        T = actions.shape[0]
+        assert actions.shape == (T, self.num_envs)
+        rew = np.zeros([T, self.num_envs], dtype=np.float32)
+        done = np.zeros([T, self.num_envs], dtype=np.bool)
+        new_level = np.zeros([T, self.num_envs], dtype=np.bool)
+        obs = None
+        ptr = lambda a: None if a is None else a.ctypes.data
+        rgb = tiles = agent = monsters = None
+        if observations and self.symbolic_obs:
+            tiles = np.zeros((T,) + self.buf_tiles.shape, dtype=np.uint8)
+            agent = np.zeros((T,) + self.buf_agent.shape, dtype=np.float32)
+            monsters = np.zeros((T,) + self.buf_monsters.shape, dtype=np.float32)
+            obs = {'tiles': tiles, 'agent': agent, 'monsters': monsters}
+        elif observations:
+            rgb = np.zeros((T,) + self.buf_rgb.shape, dtype=np.uint8)
+            obs = rgb
+        ev = ev_counts = None
+        if events:
+            ev = np.zeros((T,) + self.buf_events.shape, dtype=EVENT_DTYPE)
+            ev_counts = np.zeros([T, self.num_envs], dtype=np.int32)
+        lib.vec_rollout(
+            self.handle, actions, T, Config.ACTION_REPEAT,
+            ptr(rgb), None, None,
+            ptr(rew), ptr(done), ptr(new_level),
+            ptr(tiles), ptr(agent), ptr(monsters),
+            ptr(ev), ptr(ev_counts))
+        if Config.USE_BLACK_WHITE and rgb is not None:
+            obs = np.mean(rgb, axis=-1).astype(np.uint8)[...,None]
+        if not events:
+            self.buf_event_counts[:] = 0
+            return obs, rew, done, new_level, None
+        if T > 0:
+            self.buf_events[:] = ev[-1]
+            self.buf_event_counts[:] = ev_counts[-1]
+        step_events = [[ev[t, e, :n].copy() for e, n in enumerate(ev_counts[t])] for t in range(T)]
+        return obs, rew, done, new_level, step_events
+
     def get_images(self):
         if self.hires_render:
             return self.buf_render_rgb
@@ -194,13 +503,69 @@ class CoinRunVecEnv(VecEnv):
     def step_async(self, actions):
         assert actions.dtype in [np.int32, np.int64]
         actions = actions.astype(np.int32)
-        lib.vec_step_async_discrete(self.handle, actions)
+        self._swap_outputs()
+        if Config.ACTION_REPEAT > 1:
+            lib.vec_step_async_discrete_repeat(self.handle, actions, Config.ACTION_REPEAT)
+        else:
+            lib.vec_step_async_discrete(self.handle, actions)
+
+    def _swap_outputs(self):
+        # subset steps keep writing rows of the registered set while others are collected,
+        # so only whole vector steps alternate
+        if not self.async_steps:
+            self._select_outputs(1 - self.out_n)
+            self._register_outputs()
+
+    def step_async_subset(self, env_idx, actions):
+        """
+        Steps only the envs `env_idx`, with `actions`, to be collected one by one with
+        `step_wait_any` or `poll` as they finish. Envs may be stepped again right after
+        they were collected, whatever the others are doing. After the first call
+        `step_wait` waits for everything that was stepped.
+        """
+        env_idx = np.ascontiguousarray(env_idx, dtype=np.int32)
+        actions = np.ascontiguousarray(actions, dtype=np.int32)
+        assert env_idx.shape == actions.shape and env_idx.ndim == 1
+        self._swap_outputs()
+        self.async_steps = True
+        lib.vec_step_async_subset(self.handle, env_idx, actions, len(env_idx))
+
+    def step_wait_any(self, k):
+        """
+        Waits until `k` of the envs stepped by `step_async_subset` are done, fewer if fewer
+        are running, and returns their indices in completion order, with their
+        observations, rewards, dones and new level flags.
+        """
+        return self._collect(lib.vec_wait_any, k)
+
+    def poll(self, max_n=None):
+        """
+        Like `step_wait_any`, but returns at once with the envs that are done already,
+        at most `max_n`.
+        """
+        return self._collect(lib.vec_poll, self.num_envs if max_n is None else max_n)
+
+    def _collect(self, f, n):
+        env_idx = np.zeros([max(n, 0)], dtype=np.int32)
+        n = f(
+            self.handle, n, env_idx,
+            self.buf_rgb,
+            self.buf_render_rgb,
+            self.buf_audio_seg_map,
+            self.buf_rew,
+            self.buf_done,
+            self.buf_new_level)
+        env_idx = env_idx[:n]
+        # rows of these envs stay put until they are stepped again, still hand out copies
+        if self.symbolic_obs:
+            obs = {'tiles': self.buf_tiles[env_idx], 'agent': self.buf_agent[env_idx], 'monsters': self.buf_monsters[env_idx]}
+        else:
+            obs = self.buf_rgb[env_idx]
+            if Config.USE_BLACK_WHITE:
+                obs = np.mean(obs, axis=-1).astype(np.uint8)[...,None]
+        return env_idx, obs, self.buf_rew[env_idx], self.buf_done[env_idx], self.buf_new_level[env_idx]
 
     def step_wait(self):
-        self.buf_rew = np.zeros_like(self.buf_rew)
-        self.buf_done = np.zeros_like(self.buf_done)
-        self.buf_new_level = np.zeros_like(self.buf_new_level)
-
         lib.vec_wait(
             self.handle,
             self.buf_rgb,
@@ -210,12 +575,18 @@ class CoinRunVecEnv(VecEnv):
             self.buf_done,
             self.buf_new_level)
 
-        obs_frames = self.buf_rgb
-
-        if Config.USE_BLACK_WHITE:
-            obs_frames = np.mean(obs_frames, axis=-1).astype(np.uint8)[...,None]
+        if self.symbolic_obs:
+            obs = {'tiles': self.buf_tiles, 'agent': self.buf_agent, 'monsters': self.buf_monsters}
+        elif Config.USE_BLACK_WHITE:
+            obs = np.mean(self.buf_rgb, axis=-1).astype(np.uint8)[...,None]
+        else:
+            obs = self.buf_rgb
 
-        return obs_frames, self.buf_rew, self.buf_done, self.dummy_info, self.buf_render_rgb, self.buf_audio_seg_map, self.buf_new_level
+        if self.async_steps:
+            # subset steps write into these arrays again as soon as they are queued
+            obs = {k: v.copy() for k, v in obs.items()} if self.symbolic_obs else obs.copy()
+            return obs, self.buf_rew.copy(), self.buf_done.copy(), self.dummy_info, self.buf_render_rgb.copy(), self.buf_audio_seg_map.copy(), self.buf_new_level.copy()
+        return obs, self.buf_rew, self.buf_done, self.dummy_info, self.buf_render_rgb, self.buf_audio_seg_map, self.buf_new_level
 
 def make(num_envs, **kwargs):
     return CoinRunVecEnv(num_envs, **kwargs)
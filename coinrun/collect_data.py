@@ -103,7 +103,12 @@ def run_env_sess(sess):
 
         data_collector.save_frame_info(audio_seg_map[0,:])
         curr_rews += rew[0]
-        if can_render:
+        if Config.VIDEO_THREADS > 0:
+            frames = env.drain_video()[0]
+            if can_render and len(frames):
+                viewer.imshow(frames[-1])
+        elif can_render and Config.VIDEO_SINK == 'off':
+            # with a video sink, high_res_render is only a 1x1 placeholder
             viewer.imshow(high_res_render[0,:,:,-3:])
 
 def main():
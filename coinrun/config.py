@@ -63,6 +63,33 @@ class ConfigSingle(object):
         type_keys.append(('level-timeout', 'level_timeout', int, 1000))
         bool_keys.append(('collect_data', 'collect_data'))
 
+        # What the engine writes per env into the csv folder: 'csv' (monitor.csv for
+        # convert_csv_to_json.py), 'bin' (monitor.bin, read with coinrun/metadata.py) or 'both'
+        type_keys.append(('monitor-format', 'monitor_format', str, 'csv'))
+
+        # Resolution of the hires video frames painted when collecting data
+        type_keys.append(('video-res', 'video_res', int, 1024))
+
+        # Number of threads painting hires video frames in the background. With 0 they are
+        # painted inside the env step and returned by step_wait, otherwise they have to be
+        # fetched with CoinRunVecEnv.drain_video()
+        type_keys.append(('video-threads', 'video_threads', int, 0))
+
+        # Should hires video frames be drawn with OpenGL through a headless EGL context instead
+        # of QPainter. Needs the library built with make COINRUN_GL=1, otherwise (or without a
+        # usable GL 3.3) QPainter is used anyway. 1/0 means True/False
+        type_keys.append(('video-gl', 'video_gl', int, 0))
+
+        # Have the engine write hires frames to disk itself instead of returning them, one file
+        # per env and game, in <save-dir>/model_<id>_seed_<seed>/video. One of 'off', 'y4m',
+        # 'ffmpeg' (h264 mp4, needs ffmpeg on the PATH)
+        type_keys.append(('video-sink', 'video_sink', str, 'off'))
+
+        # File the decoded, mirrored and downsampled assets are baked into on first use and
+        # then memory-mapped from, shared by all processes of the user. 'auto' keeps it in
+        # $XDG_CACHE_HOME/coinrun (~/.cache/coinrun), 'off' decodes the assets in every process
+        type_keys.append(('asset-atlas', 'asset_atlas', str, 'auto'))
+
         # Agent Reward Config
         type_keys.append(('air-control', 'air_control', float, 0.15))
         type_keys.append(('bump-head-penalty', 'bump_head_penalty', float, 0.0))
@@ -102,6 +129,29 @@ class ConfigSingle(object):
         # No frame stack is necessary if PAINT_VEL_INFO = 1
         type_keys.append(('fs', 'frame_stack', int, 1, True))
 
+        # Should the 64x64 agent observation be drawn by the built-in software tile renderer
+        # instead of QPainter. Much faster, visually equivalent up to subpixel placement.
+        # 1/0 means True/False
+        type_keys.append(('fast-render', 'fast_render', int, 0))
+
+        # Should observations be symbolic instead of pixels: the tiles around the agent, the
+        # agent's own state and the nearest monsters, with nothing painted at all.
+        # 1/0 means True/False
+        type_keys.append(('symbolic-obs', 'symbolic_obs', int, 0))
+
+        # Should the worker threads move the agents of the envs they step together, in SIMD
+        # friendly batches. Same results as the per-agent physics. 1/0 means True/False
+        type_keys.append(('batch-physics', 'batch_physics', int, 0))
+
+        # How many game steps each action is held for, rewards summed. Only the last one
+        # is painted and written to the monitors, the repeats stop early at a game over.
+        # At most 8 (MAX_ACTION_REPEAT in coinrun.cpp)
+        type_keys.append(('action-repeat', 'action_repeat', int, 1))
+
+        # Should the stepping threads be pinned to cores, spread over the processes of the
+        # machine by MPI local rank. Envs then stay on their thread's core. 1/0 means True/False
+        type_keys.append(('pin-threads', 'pin_threads', int, 0))
+
         # Should observations be transformed to grayscale
         # 1/0 means True/False
         type_keys.append(('ubw', 'use_black_white', int, 0, True))
@@ -0,0 +1,139 @@
+"""
+Reader for the binary monitor.bin episode metadata written by the CoinRun engine
+with --monitor-format bin (or both). The layout is documented next to
+MetaFileHeader in coinrun.cpp. Nothing is parsed up front: the file is memory
+mapped and games and frames are numpy views into it.
+
+Usage:
+    meta = MetadataFile('video_data/model_x_seed_1/csv/000.monitor.bin')
+    game = meta.game(3)
+    game.maze            # [maze_h, maze_w] tile chars, row 0 is the bottom row
+    game.frames[10]      # agent record of frame 10
+    game.monsters[10]    # [n_monsters] monster records of frame 10
+
+Copyright (c) Meta Platforms, Inc. All Right reserved.
+"""
+
+import numpy as np
+
+THEME_TABLES = ['background_themes', 'ground_themes', 'agent_themes',
+                'ground_monsters', 'flying_monsters', 'walking_monsters']
+NAME_LEN = 64
+MAX_ACTION_REPEAT = 8  # a frame holds the coins of that many game steps
+MAX_COINS = 8 * MAX_ACTION_REPEAT
+VERSION = 2
+
+file_header_dtype = np.dtype([
+    ('magic', 'S8'), ('version', '<u4'), ('n_theme_tables', '<u4'), ('t_start', '<f8')])
+
+game_header_dtype = np.dtype([
+    ('tag', 'S4'), ('game_id', '<i4'), ('level_seed', '<i4'), ('zoom', '<f4'),
+    ('world_theme_n', '<i4'), ('agent_theme_n', '<i4'), ('maze_w', '<i4'), ('maze_h', '<i4'),
+    ('n_monsters', '<i4'), ('pad', '<i4')])
+
+# flag bits of frame_dtype['flags']
+FACING_RIGHT, LADDER, KILLED, KILLED_MONSTER, BUMPED_HEAD, COLLECTED_COIN, COLLECTED_GEM, POWER_UP = \
+    [1 << i for i in range(8)]
+
+frame_dtype = np.dtype([
+    ('time_alive', '<i4'), ('state_time', '<i4'),
+    ('x', '<f4'), ('y', '<f4'), ('vx', '<f4'), ('vy', '<f4'), ('spring', '<f4'),
+    ('killed_animation_frame_cnt', '<i4'), ('finished_level_frame_cnt', '<i4'),
+    ('flags', '<u2'), ('n_coins', 'u1'), ('pad', 'u1'),
+    ('coins', '<i2', (MAX_COINS, 2))])
+
+# flag bits of monster_dtype['flags']
+MONSTER_FLYING, MONSTER_WALKING, MONSTER_JUMPING, MONSTER_DEAD = [1 << i for i in range(4)]
+
+monster_dtype = np.dtype([
+    ('x', '<f4'), ('y', '<f4'), ('vx', '<f4'), ('vy', '<f4'),
+    ('monster_dying_frame_cnt', '<i4'), ('theme_n', '<i2'), ('flags', 'u1'), ('anim_freq', 'u1')])
+
+index_dtype = np.dtype([
+    ('game_id', '<i4'), ('n_monsters', '<i4'), ('offset', '<u8'), ('n_frames', '<u4'),
+    ('length', '<i4'), ('reward_sum', '<f4'), ('pad', '<u4'), ('seconds', '<f8')])
+
+trailer_dtype = np.dtype([('index_offset', '<u8'), ('n_games', '<u4'), ('magic', 'S4')])
+
+assert file_header_dtype.itemsize == 24 and game_header_dtype.itemsize == 40
+assert frame_dtype.itemsize == 40 + 4 * MAX_COINS and monster_dtype.itemsize == 24
+assert index_dtype.itemsize == 40 and trailer_dtype.itemsize == 16
+
+
+class Game:
+    def __init__(self, data, entry):
+        offset = int(entry['offset'])
+        self.entry = entry
+        self.header = data[offset:offset + game_header_dtype.itemsize].view(game_header_dtype)[0]
+        w, h = int(self.header['maze_w']), int(self.header['maze_h'])
+        offset += game_header_dtype.itemsize
+        self.maze = data[offset:offset + w * h].view('S1').reshape(h, w)
+        offset += (w * h + 7) // 8 * 8
+
+        n_monsters = int(self.header['n_monsters'])
+        record_dtype = np.dtype([('agent', frame_dtype), ('monsters', monster_dtype, (n_monsters,))])
+        n_frames = int(entry['n_frames'])
+        records = data[offset:offset + n_frames * record_dtype.itemsize].view(record_dtype)
+        self.frames = records['agent']
+        self.monsters = records['monsters']
+
+
+class MetadataFile:
+    def __init__(self, path):
+        self.data = np.memmap(path, dtype=np.uint8, mode='r')
+        self.header = self.data[:file_header_dtype.itemsize].view(file_header_dtype)[0]
+        assert self.header['magic'] == b'CRMETA', 'not a coinrun monitor.bin file'
+        assert self.header['version'] == VERSION, 'monitor.bin version %i, expected %i' % (self.header['version'], VERSION)
+
+        offset = file_header_dtype.itemsize
+        self.themes = {}
+        for name in THEME_TABLES[:int(self.header['n_theme_tables'])]:
+            count = int(self.data[offset:offset + 4].view('<u4')[0])
+            offset += 4
+            names = self.data[offset:offset + count * NAME_LEN].view('S%i' % NAME_LEN)
+            self.themes[name] = [n.decode('utf-8') for n in names]
+            offset += count * NAME_LEN
+        self.first_game_offset = offset
+
+        self.index = self._read_index()
+        if self.index is None:
+            self.index = self._scan_games()
+
+    def _read_index(self):
+        if len(self.data) < self.first_game_offset + trailer_dtype.itemsize:
+            return None
+        trailer = self.data[-trailer_dtype.itemsize:].view(trailer_dtype)[0]
+        if trailer['magic'] != b'CRIX':
+            return None
+        start = int(trailer['index_offset'])
+        return self.data[start:start + int(trailer['n_games']) * index_dtype.itemsize].view(index_dtype)
+
+    def _scan_games(self):
+        # the env was not closed cleanly, so there is no index: walk the game headers instead
+        entries = []
+        offset = self.first_game_offset
+        while offset + game_header_dtype.itemsize <= len(self.data):
+            h = self.data[offset:offset + game_header_dtype.itemsize].view(game_header_dtype)[0]
+            if h['tag'] != b'GAME':
+                break
+            w, hh, n_monsters = int(h['maze_w']), int(h['maze_h']), int(h['n_monsters'])
+            frames_start = offset + game_header_dtype.itemsize + (w * hh + 7) // 8 * 8
+            stride = frame_dtype.itemsize + n_monsters * monster_dtype.itemsize
+            n_frames = 0
+            # frames run until the next game header or the end of the file
+            pos = frames_start
+            while pos + stride <= len(self.data):
+                if bytes(self.data[pos:pos + 4]) == b'GAME':
+                    break
+                pos += stride
+                n_frames += 1
+            entries.append((h['game_id'], n_monsters, offset, n_frames, -1, 0.0, 0, 0.0))
+            offset = pos
+        return np.array(entries, dtype=index_dtype)
+
+    def __len__(self):
+        return len(self.index)
+
+    def game(self, n):
+        """The n-th game in the file, see Game."""
+        return Game(self.data, self.index[n])
@@ -14,6 +14,7 @@ from mpi4py import MPI
 
 from coinrun.tb_utils import TB_Writer
 import coinrun.main_utils as utils
+from coinrun import coinrunenv
 
 from coinrun.config import Config
 
@@ -187,7 +188,7 @@ class Runner(AbstractEnvRunner):
             mb_actions.append(actions)
             mb_values.append(values)
             mb_neglogpacs.append(neglogpacs)
-            mb_dones.append(self.dones)
+            mb_dones.append(self.dones.copy())
 
             # Take actions in env and look the results
             # Infos contains a ton of useful informations
@@ -195,7 +196,7 @@ class Runner(AbstractEnvRunner):
             for info in infos:
                 maybeepinfo = info.get('episode')
                 if maybeepinfo: epinfos.append(maybeepinfo)
-            mb_rewards.append(rewards)
+            mb_rewards.append(rewards.copy())
         #batch of steps to batch of rollouts
         mb_obs = np.asarray(mb_obs, dtype=self.obs.dtype)
         mb_rewards = np.asarray(mb_rewards, dtype=np.float32)
@@ -363,6 +364,7 @@ def learn(*, policy, env, nsteps, total_timesteps, ent_coef, lr,
 
             tb_writer.log_scalar(ep_len_mean, 'ep_len_mean')
             tb_writer.log_scalar(fps, 'fps')
+            tb_writer.log_engine_stats(coinrunenv.get_stats(reset=True), step)
 
             mpi_print('time_elapsed', tnow - tfirststart, run_t_total, train_t_total)
             mpi_print('timesteps', update*nsteps, total_timesteps)
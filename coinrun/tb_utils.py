@@ -75,5 +75,12 @@ class TB_Writer(object):
                 tb_writer.add_summary(_merged, step)
                 tb_writer.flush()
         
+        def log_engine_stats(stats, step):
+            # stats as returned by coinrunenv.get_stats
+            for stage, (count, seconds) in stats.items():
+                log_scalar(seconds, 'engine_seconds/' + stage, step)
+                log_scalar(count, 'engine_calls/' + stage, step)
+
         self.add_summary = add_summary
         self.log_scalar = log_scalar
+        self.log_engine_stats = log_engine_stats
@@ -1,8 +1,318 @@
-from coinrun import random_agent
+import numpy as np
+from coinrun import random_agent, coinrunenv
+from coinrun.config import Config
+
+def set_args(rand_seed=1, **kwargs):
+    # the engine's flags are process wide and read again by every vec_create()
+    Config.initialize_args(use_cmd_line_args=False, **kwargs)
+    coinrunenv.init_args_and_threads(4, rand_seed=rand_seed)
+
+def make_env(num_envs, **kwargs):
+    set_args(**kwargs)
+    return coinrunenv.CoinRunVecEnv(num_envs)
+
+def step(env, actions):
+    env.step_async(np.asarray(actions, dtype=np.int32))
+    return env.step_wait()
 
 def test_coinrun():
     random_agent.random_agent(num_envs=16, max_steps=100)
 
+def test_ranks_have_own_random_streams():
+    # every MPI worker creates the same vectors, only its rand_seed and rank differ
+    lib = coinrunenv.lib
+    for env_n in range(16):
+        assert lib.get_env_rand_key(1234, 0, 0, env_n) != lib.get_env_rand_key(1234, 1, 0, env_n)
+        assert lib.get_env_rand_key(1234, 0, 0, env_n) != lib.get_env_rand_key(1235, 0, 0, env_n)
+        assert lib.get_env_rand_key(1234, 0, 0, env_n) == lib.get_env_rand_key(1234, 0, 0, env_n)
+
+def test_loaded_state_plays_like_its_source():
+    env = make_env(2, level_timeout=50)
+    env.reset()
+    snapshot = env.save_state(0)
+    env.load_state(1, snapshot)
+    env.free_state(snapshot)
+    actions = np.random.RandomState(0).randint(0, env.NUM_ACTIONS, size=200)
+    resets = 0
+    for a in actions:
+        obs, rew, done = step(env, [a, a])[:3]
+        # env 1 now plays env 0's levels, also the ones after the next reset
+        assert np.array_equal(obs[0], obs[1])
+        assert rew[0] == rew[1] and done[0] == done[1]
+        resets += int(done[0])
+    assert resets > 0
+    env.close()
+
+def test_step_outputs_stay_valid_until_next_step_wait():
+    env = make_env(2)
+    env.reset()
+    obs, rew = step(env, [1, 1])[:2]
+    kept_obs, kept_rew = obs.copy(), rew.copy()
+    next_obs = step(env, [1, 1])[0]
+    assert next_obs is not obs
+    assert np.array_equal(obs, kept_obs) and np.array_equal(rew, kept_rew)
+    env.close()
+
+def test_rollout_matches_steps():
+    env = make_env(3, level_timeout=50)
+    env.reset()
+    snapshots = [env.save_state(e) for e in range(env.num_envs)]
+    actions = np.random.RandomState(1).randint(0, env.NUM_ACTIONS, size=(120, env.num_envs))
+    obs, rew, done, new_level, step_events = env.rollout(actions)
+    assert step_events is None
+    assert obs.shape == (len(actions),) + env.buf_rgb.shape
+    for e, snapshot in enumerate(snapshots):
+        env.load_state(e, snapshot)
+        env.free_state(snapshot)
+    for t, a in enumerate(actions):
+        step_obs, step_rew, step_done = step(env, a)[:3]
+        assert np.array_equal(obs[t], step_obs)
+        assert np.array_equal(rew[t], step_rew)
+        assert np.array_equal(done[t], step_done)
+    assert done.any()
+    env.close()
+
+def test_async_subset_steps():
+    env = make_env(4)
+    ref = coinrunenv.CoinRunVecEnv(1)
+    env.reset()
+    ref.reset()
+    starts = [env.save_state(e) for e in range(env.num_envs)]
+    rand = np.random.RandomState(2)
+    history = [[] for _ in range(env.num_envs)]
+    def step_subset(env_idx):
+        actions = rand.randint(0, env.NUM_ACTIONS, size=len(env_idx))
+        for e, a in zip(env_idx, actions):
+            history[e].append(a)
+        env.step_async_subset(env_idx, actions)
+
+    step_subset([])
+    assert len(env.poll()[0]) == 0  # nothing stepped, nothing finished
+    step_subset([0, 2])
+    env_idx = env.step_wait_any(env.num_envs)[0]  # only two are running
+    assert sorted(env_idx) == [0, 2]
+    assert len(env.step_wait_any(1)[0]) == 0
+    step_subset([1, 3])
+    env_idx = env.step_wait_any(1)[0]
+    assert len(env_idx) == 1
+    step_subset(env_idx)  # again, while the other may still be running
+    obs = env.step_wait()[0]  # waits for all of them and collects them
+    assert len(env.poll()[0]) == 0
+    assert len(env.step_wait_any(1)[0]) == 0
+
+    for e in range(env.num_envs):
+        ref.load_state(0, starts[e])
+        env.free_state(starts[e])
+        for a in history[e]:
+            ref_obs = step(ref, [a])[0]
+        assert np.array_equal(obs[e], ref_obs[0])
+    ref.close()
+    env.close()
+
+def test_action_repeat_matches_single_steps():
+    k = 4
+    env = make_env(1, level_timeout=50)
+    env.reset()
+    snapshot = env.save_state(0)
+    resets = 0
+    for a in np.random.RandomState(3).randint(0, env.NUM_ACTIONS, size=100):
+        env.save_state(0, snapshot)
+        Config.ACTION_REPEAT = k
+        # copied, the k single steps below reuse the output buffers
+        obs, rew, done = [x.copy() for x in step(env, [a])[:3]]
+        Config.ACTION_REPEAT = 1
+        env.load_state(0, snapshot)
+        rew_sum = 0
+        for _ in range(k):
+            step_obs, step_rew, step_done = step(env, [a])[:3]
+            rew_sum += step_rew[0]
+            if step_done[0]:
+                break  # a game over ends the repeats early
+        assert np.array_equal(obs, step_obs)
+        assert rew[0] == rew_sum and done[0] == step_done[0]
+        resets += int(done[0])
+    assert resets > 0
+    env.free_state(snapshot)
+    env.close()
+
+def test_symbolic_obs():
+    env = make_env(2, symbolic_obs=1)
+    lib = coinrunenv.lib
+    obs = env.reset()
+    assert obs['tiles'].shape == (2, lib.get_SYMBOLIC_TILES_H(), lib.get_SYMBOLIC_TILES_W())
+    assert obs['agent'].shape == (2, lib.get_SYMBOLIC_AGENT_DIM())
+    assert obs['monsters'].shape == (2, lib.get_SYMBOLIC_MONSTERS(), lib.get_SYMBOLIC_MONSTER_DIM())
+    for key, space in env.observation_space.spaces.items():
+        assert obs[key].shape[1:] == space.shape and obs[key].dtype == space.dtype
+
+    # walk and jump to the right, the frame end events carry the agent's position
+    walk, jump = coinrunenv.EVENT_KINDS.index('walk'), coinrunenv.EVENT_KINDS.index('jump')
+    checked = 0
+    for a in np.random.RandomState(4).choice([1, 4], size=200):
+        before = obs['agent'].copy()
+        obs, rew, done = step(env, [a, a])[:3]
+        agent = obs['agent']
+        for e, events in enumerate(env.get_events()):
+            if done[e] or agent[e, 8]:
+                continue  # a new level, or a dead agent that doesn't move
+            assert agent[e, 9] == before[e, 9] + 1  # time_alive
+            for ev in events[np.isin(events['kind'], [walk, jump])]:
+                assert ev['frame'] == agent[e, 9]
+                assert (ev['x'], ev['y']) == (agent[e, 0], agent[e, 1])
+                checked += 1
+    assert checked > 0
+    env.close()
+
+def test_batched_physics_matches_per_agent():
+    # created batched, so that workers claim several envs at once
+    env = make_env(16, level_timeout=50, batch_physics=1)
+    env.reset()
+    snapshots = [env.save_state(e) for e in range(env.num_envs)]
+    actions = np.random.RandomState(5).randint(0, env.NUM_ACTIONS, size=(150, env.num_envs))
+    set_args(level_timeout=50, batch_physics=0)
+    obs, rew, done = env.rollout(actions)[:3]
+    set_args(level_timeout=50, batch_physics=1)
+    for e, snapshot in enumerate(snapshots):
+        env.load_state(e, snapshot)
+        env.free_state(snapshot)
+    batched_obs, batched_rew, batched_done = env.rollout(actions)[:3]
+    assert np.array_equal(obs, batched_obs)
+    assert np.array_equal(rew, batched_rew)
+    assert np.array_equal(done, batched_done)
+    assert done.any()
+    env.close()
+
+def test_painting_does_not_change_outcomes():
+    # augmentation blotches are only drawn when the agent frame is painted
+    env = make_env(4, level_timeout=50, use_data_augmentation=1)
+    env.reset()
+    snapshots = [env.save_state(e) for e in range(env.num_envs)]
+    actions = np.random.RandomState(7).randint(0, env.NUM_ACTIONS, size=(300, env.num_envs))
+    _, rew, done = env.rollout(actions)[:3]
+    for e, snapshot in enumerate(snapshots):
+        env.load_state(e, snapshot)
+        env.free_state(snapshot)
+    obs, unpainted_rew, unpainted_done = env.rollout(actions, observations=False)[:3]
+    assert obs is None
+    assert np.array_equal(rew, unpainted_rew)
+    assert np.array_equal(done, unpainted_done)
+    assert done.any()
+    env.close()
+
+def agent_frames_close(a, b):
+    # the fast renderer puts sprites on whole pixels, QPainter blends them in at subpixel
+    # offsets, so only the pixels along sprite edges may differ much
+    diff = np.abs(a.astype(np.int16) - b.astype(np.int16)).max(axis=-1)
+    return diff.mean() < 8 and (diff > 64).mean() < 0.05
+
+def full_repaint_frame(ref, decoy, snapshot, action):
+    # loading another level first gives the next load a new layout, so the step after it
+    # paints the whole static level layer from scratch
+    ref.load_state(0, decoy)
+    ref.load_state(0, snapshot)
+    return step(ref, [action])[0][0]
+
+def check_static_layer(fast):
+    # agent frames are cropped from a level layer patched by coin and gem pickups and by
+    # snapshot loads, which must look like the layer painted anew
+    if fast:
+        same = lambda a, b: np.array_equal(a, b)
+    else:
+        # QPainter draws lava after its neighbours, which can change their one pixel overlaps
+        same = agent_frames_close
+    set_args(level_timeout=100, fast_render=fast)
+    env = coinrunenv.CoinRunVecEnv(8)
+    ref = coinrunenv.CoinRunVecEnv(1)
+    env.reset()
+    ref.reset()
+    decoy = ref.save_state(0)
+    kinds = coinrunenv.EVENT_KINDS
+    pickup_kinds = [kinds.index('coin'), kinds.index('gem')]
+    before = [env.save_state(e) for e in range(env.num_envs)]
+    earlier = [env.save_state(e) for e in range(env.num_envs)]
+    picked = np.zeros(env.num_envs, dtype=np.bool)
+    new_level = np.zeros(env.num_envs, dtype=np.bool)
+    pickups = rewinds = relayouts = 0
+    for t, a in enumerate(np.random.RandomState(9).choice([1, 4, 5], size=(400, env.num_envs))):
+        if t % 25 == 24:
+            # back to where the env was 25 steps ago: the same level with its edits undone,
+            # or, after a game over, a level of another layout
+            for e in range(env.num_envs):
+                env.load_state(e, earlier[e])
+            rewinds += (picked & ~new_level).sum()
+            relayouts += new_level.sum()
+            obs = step(env, a)[0]
+            for e in range(env.num_envs):
+                assert same(obs[e], full_repaint_frame(ref, decoy, earlier[e], a[e])), (t, e)
+                env.save_state(e, earlier[e])
+            picked[:] = False
+            new_level[:] = False
+            continue
+        for e in range(env.num_envs):
+            env.save_state(e, before[e])
+        obs, _, done = step(env, a)[:3]
+        new_level |= done
+        for e, events in enumerate(env.get_events()):
+            if np.isin(events['kind'], pickup_kinds).any():
+                assert same(obs[e], full_repaint_frame(ref, decoy, before[e], a[e])), (t, e)
+                picked[e] = True
+                pickups += 1
+    assert pickups > 0 and rewinds > 0 and relayouts > 0
+    for snapshot in before + earlier + [decoy]:
+        env.free_state(snapshot)
+    ref.close()
+    env.close()
+
+def test_fast_agent_render_matches_qpainter():
+    env = make_env(4, level_timeout=50, fast_render=0)
+    env.reset()
+    snapshots = [env.save_state(e) for e in range(env.num_envs)]
+    actions = np.random.RandomState(8).randint(0, env.NUM_ACTIONS, size=(150, env.num_envs))
+    obs = env.rollout(actions)[0]
+    set_args(level_timeout=50, fast_render=1)
+    for e, snapshot in enumerate(snapshots):
+        env.load_state(e, snapshot)
+        env.free_state(snapshot)
+    fast_obs = env.rollout(actions)[0]
+    for t in range(len(actions)):
+        for e in range(env.num_envs):
+            assert agent_frames_close(obs[t, e], fast_obs[t, e]), (t, e)
+    env.close()
+
+    for fast in [0, 1]:
+        check_static_layer(fast)
+
+def test_events_match_rewards_and_dones():
+    env = make_env(16, level_timeout=100)
+    env.reset()
+    kinds = coinrunenv.EVENT_KINDS
+    rewarding = [kinds.index('coin'), kinds.index('gem'), kinds.index('killed_monster')]
+    killed = kinds.index('killed')
+    actions = np.random.RandomState(6).choice([1, 4, 5], size=(400, env.num_envs))
+    _, rew, done, _, step_events = env.rollout(actions, observations=False, events=True)
+    deaths = 0
+    for t, events in enumerate(step_events):
+        for e, ev in enumerate(events):
+            # rewards come in the step of the event, a death ends the game the step after,
+            # unless the game was over already
+            assert (rew[t, e] > 0) == np.isin(ev['kind'], rewarding).any()
+            if (ev['kind'] == killed).any() and not done[t, e] and t + 1 < len(actions):
+                assert done[t + 1, e]
+                deaths += 1
+    assert deaths > 0
+    env.close()
+
 
 if __name__ == '__main__':
-    test_coinrun()
\ No newline at end of file
+    test_coinrun()
+    test_ranks_have_own_random_streams()
+    test_loaded_state_plays_like_its_source()
+    test_step_outputs_stay_valid_until_next_step_wait()
+    test_rollout_matches_steps()
+    test_async_subset_steps()
+    test_action_repeat_matches_single_steps()
+    test_symbolic_obs()
+    test_batched_physics_matches_per_agent()
+    test_painting_does_not_change_outcomes()
+    test_fast_agent_render_matches_qpainter()
+    test_events_match_rewards_and_dones()
\ No newline at end of file